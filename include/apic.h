@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APIC_SPURIOUS_VECTOR 0xFF
+#define APIC_MAX_CPUS        64
+
+bool apic_init(void);
+
+// enable the local APIC of an AP; apic_init() must have run on the BSP
+void lapic_init_ap(void);
+
+bool apic_enabled(void);
+
+bool apic_x2apic_mode(void);
+
+uint32_t lapic_id(void);
+
+void lapic_eoi(void);
+
+// send an interrupt to another CPU by APIC ID
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// route an ISA IRQ through the I/O APIC to a vector on the given CPU,
+// honouring MADT source overrides
+bool ioapic_route_irq(uint8_t irq, uint8_t vector, uint32_t apic_id);
+
+// route a global system interrupt directly, for devices outside the ISA
+// set such as HPET comparators
+bool ioapic_route_gsi(uint32_t gsi, uint8_t vector, uint32_t apic_id, bool level, bool active_low);
+
+// whether an ISA IRQ is wired to this GSI
+bool ioapic_gsi_is_isa(uint32_t gsi);
+
+void ioapic_mask_irq(uint8_t irq);
+
+void ioapic_unmask_irq(uint8_t irq);
+
+// APIC IDs of the processors the MADT lists as usable
+uint32_t apic_cpu_count(void);
+
+uint32_t apic_cpu_id(uint32_t index);
+
+// one-shot local APIC timer, in TSC-deadline mode when the CPU has it
+bool lapic_timer_init(uint8_t vector);
+
+bool lapic_timer_tsc_deadline(void);
+
+void lapic_timer_arm(uint64_t deadline_ns);
+
+void lapic_timer_stop(void);
@@ -1,6 +1,9 @@
 #pragma once
 #include <stdint.h>
 
+void ata_init(void);
+
+// sleep until the drive is idle or has data, when the caller can sleep
 void ata_wait_busy(void);
 
 void ata_wait_drq(void);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// orders 0..BUDDY_MAX_ORDER, so the largest block is 4 MiB
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NONE      UINT64_MAX
+
+size_t buddy_metadata_size(uint64_t max_pfn);
+
+void buddy_init(void *metadata, uint64_t max_pfn);
+
+void buddy_add_range(uint64_t pfn, uint64_t count);
+
+uint64_t buddy_alloc(unsigned int order);
+
+void buddy_free(uint64_t pfn, unsigned int order);
+
+uint64_t buddy_alloc_contig(uint64_t count);
+
+void buddy_free_contig(uint64_t pfn, uint64_t count);
+
+uint64_t buddy_free_blocks(unsigned int order);
@@ -71,9 +71,7 @@ struct ext2_directory_entry {
     char name[255];
 };
 
-static struct ext2_superblock sb;
-static struct ext2_group_descriptor bgdt[32];
-static struct ext2_inode inode;
+void ext2_init_caches(void);
 
 void read_inode(uint32_t inode_number);
 
@@ -107,6 +105,10 @@ uint32_t find_free_inode(uint32_t group_number);
 
 void read_directory_entries(uint32_t inode_number);
 
+// inode number of name in a directory, 0 if there is none; answered from
+// the directory cache without locking when the name was seen before
+uint32_t ext2_lookup(uint32_t parent_inode, const char *name);
+
 void update_superblock(uint32_t delta_inodes, uint32_t delta_blocks);
 
 void parse_blockgroup_descriptors(void);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// how many kernel_fpu_begin() sections may be nested, e.g. an IRQ handler
+// using SIMD on top of a SIMD memory copy
+#define FPU_MAX_DEPTH 4
+
+struct percpu;
+
+// detect features, enable them on the BSP and give it save areas
+void fpu_init(void);
+
+// enable the same features on the calling AP
+void fpu_init_ap(void);
+
+// allocate a CPU's nested save areas; must be called on the BSP
+bool fpu_alloc_state(struct percpu *cpu);
+
+// release whatever fpu_alloc_state() managed to allocate, even partially
+void fpu_free_state(struct percpu *cpu);
+
+bool fpu_has_avx2(void);
+
+void kernel_fpu_begin(void);
+
+void kernel_fpu_end(void);
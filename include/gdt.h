@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+// same layout Limine hands over, so selectors stay valid across the switch
+#define GDT_KERNEL_CODE 0x28
+#define GDT_KERNEL_DATA 0x30
+#define GDT_TSS         0x38
+
+// IST slots in the TSS; 0 in an IDT entry means the current stack
+#define IST_NMI           1
+#define IST_DOUBLE_FAULT  2
+#define IST_MACHINE_CHECK 3
+#define IST_STACK_SIZE    16384
+#define IST_STACK_COUNT   3
+
+#define GDT_ENTRIES 9
+
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+// each CPU has its own TSS, so its own GDT to hold the descriptor
+struct gdt_cpu {
+    uint64_t entries[GDT_ENTRIES];
+    struct tss tss;
+};
+
+// load the boot CPU's tables
+void gdt_init(void);
+
+// build and load tables for the calling CPU; ist_stacks points at
+// IST_STACK_COUNT * IST_STACK_SIZE bytes. FS and GS are not reloaded, so
+// a GS base set beforehand survives.
+void gdt_init_cpu(struct gdt_cpu *gdt, uint8_t *ist_stacks);
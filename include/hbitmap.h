@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define HBITMAP_NONE UINT64_MAX
+
+// Three level bitmap. words[] holds the bits themselves, summary[] has one
+// bit per word that is non-zero and top[] one bit per summary word that is
+// non-zero, so a set bit is found with at most a short scan of top[] and
+// three __builtin_ctzll calls.
+struct hbitmap {
+    uint64_t *words;
+    uint64_t *summary;
+    uint64_t *top;
+    uint64_t nbits;
+    uint64_t nwords;
+    uint64_t nsummary;
+    uint64_t ntop;
+};
+
+size_t hbitmap_storage_size(uint64_t nbits);
+
+void hbitmap_init(struct hbitmap *bm, void *storage, uint64_t nbits);
+
+void hbitmap_set(struct hbitmap *bm, uint64_t bit);
+
+void hbitmap_clear(struct hbitmap *bm, uint64_t bit);
+
+bool hbitmap_test(struct hbitmap *bm, uint64_t bit);
+
+void hbitmap_set_range(struct hbitmap *bm, uint64_t start, uint64_t count);
+
+uint64_t hbitmap_find_next(struct hbitmap *bm, uint64_t from);
+
+uint64_t hbitmap_find_first(struct hbitmap *bm);
+
+uint64_t hbitmap_find_run(struct hbitmap *bm, uint64_t count);
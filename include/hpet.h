@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool hpet_init(void);
+
+bool hpet_available(void);
+
+uint64_t hpet_read_counter(void);
+
+// ticks from start to end, allowing for one wrap of a 32-bit counter
+uint64_t hpet_counter_delta(uint64_t start, uint64_t end);
+
+uint64_t hpet_frequency(void);
+
+uint64_t hpet_ticks_to_ns(uint64_t ticks);
+
+// route comparator 0 to vector as a one-shot event source
+bool hpet_event_init(uint8_t vector);
+
+// fire at the counter value matching ktime_ns() == deadline_ns
+void hpet_event_arm(uint64_t deadline_ns);
+
+void hpet_event_stop(void);
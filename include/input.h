@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// must be a power of two; indices are masked, never divided
+#define INPUT_RING_SIZE 256
+
+#define INPUT_MOD_SHIFT 0x01
+#define INPUT_MOD_CTRL  0x02
+#define INPUT_MOD_ALT   0x04
+#define INPUT_MOD_CAPS  0x08
+
+struct input_event {
+    // TSC value read in the interrupt handler
+    uint64_t tsc;
+    // set 1 make code, without the release bit
+    uint8_t scancode;
+    bool down;
+    // sent with the E0 prefix: right Ctrl/Alt, arrows, keypad Enter and /
+    bool extended;
+    // INPUT_MOD_* held when the key changed, including this key's own
+    uint8_t modifiers;
+    // character for the key under the current modifiers, 0 for none
+    char ascii;
+};
+
+// Each slot's sequence number says whose turn it is: equal to a producer's
+// claimed position when free, one past it once written.
+struct input_slot {
+    volatile uint64_t seq;
+    struct input_event event;
+};
+
+// Bounded multi-producer, single-consumer ring. Producers claim a slot
+// with one compare-and-swap and never wait for each other or the reader,
+// so it is safe to push from any CPU and from interrupt handlers. A full
+// ring drops the new event and counts it.
+struct input_ring {
+    struct input_slot slots[INPUT_RING_SIZE];
+    volatile uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    volatile uint64_t dropped;
+};
+
+void input_ring_init(struct input_ring *ring);
+
+bool input_ring_push(struct input_ring *ring, const struct input_event *event);
+
+// only one consumer at a time; callers with several readers serialise them
+bool input_ring_pop(struct input_ring *ring, struct input_event *event);
+
+bool input_ring_empty(struct input_ring *ring);
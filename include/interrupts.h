@@ -4,6 +4,10 @@
 
 
 #define MAX_NUM_IDT_ENTRIES 256
+#define IRQ_VECTOR_BASE 32
+
+// ISA IRQs keep the vectors the 8259 gave them
+#define ISA_IRQ_VECTOR(irq) (IRQ_VECTOR_BASE + (irq))
 
 extern void isr_stub_0(void);
 extern void isr_stub_1(void);
@@ -38,24 +42,10 @@ extern void isr_stub_29(void);
 extern void isr_stub_30(void);
 extern void isr_stub_31(void);
 
-extern void irq_stub_0(void);
-extern void irq_stub_1(void);
-extern void irq_stub_8(void);
-extern void irq_stub_12(void);
-extern void irq_stub_14(void);
-extern void irq_stub_15(void);
-
-static void* isr_stubs[32] = {
-    isr_stub_0,  isr_stub_1,  isr_stub_2,  isr_stub_3,
-    isr_stub_4,  isr_stub_5,  isr_stub_6,  isr_stub_7,
-    isr_stub_8,  isr_stub_9,  isr_stub_10, isr_stub_11,
-    isr_stub_12, isr_stub_13, isr_stub_14, isr_stub_15,
-    isr_stub_16, isr_stub_17, isr_stub_18, isr_stub_19,
-    isr_stub_20, isr_stub_21, isr_stub_22, isr_stub_23,
-    isr_stub_24, isr_stub_25, isr_stub_26, isr_stub_27,
-    isr_stub_28, isr_stub_29, isr_stub_30, isr_stub_31
-};
+// addresses of the generated stubs for vectors 32 to 255
+extern void *irq_stub_table[MAX_NUM_IDT_ENTRIES - IRQ_VECTOR_BASE];
 
+extern void spurious_stub(void);
 
 struct idtr {
     uint16_t limit;    // Size of IDT - 1
@@ -80,8 +70,6 @@ struct interrupt_frame {
 } __attribute__((packed));
 
 
-__attribute__((used)) static idt_entry_t idt[256];
-
 void enable_interrupts(void);
 
 void disable_interrupts(void);
@@ -92,4 +80,15 @@ void exception_handler(struct interrupt_frame *frame);
 
 void irq_handler(struct interrupt_frame *frame);
 
+void irq_exit(void);
+
+typedef void (*irq_handler_t)(struct interrupt_frame *frame, void *ctx);
+
+// install the handler for a vector in 32..255; fails if one is present
+bool request_irq(uint8_t vector, irq_handler_t handler, void *ctx);
+
+void free_irq(uint8_t vector);
+
 void idt_init(void);
+
+void idt_load(void);
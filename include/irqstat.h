@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "percpu.h"
+
+// bucket n counts handler runs of 2^n up to 2^(n+1) - 1 cycles
+#define IRQSTAT_BUCKETS 32
+
+struct irq_stat {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t histogram[IRQSTAT_BUCKETS];
+};
+
+// called from the entry stubs with the TSC value taken on entry
+void irqstat_account(uint64_t vector, uint64_t start);
+
+// the boot CPU's table is static, since it takes exceptions before the
+// heap is up; every AP gets one from kmalloc
+void irqstat_init_boot(struct percpu *cpu);
+
+bool irqstat_alloc_cpu(struct percpu *cpu);
+
+void irqstat_free_cpu(struct percpu *cpu);
+
+void irqstat_show(void);
+
+void irqstat_dump_serial(void);
+
+void irqstat_reset(void);
+
+void irqstat_command(const char *args);
@@ -1,42 +1,55 @@
+#pragma once
+
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "input.h"
+
 #define SCANCODE_LSHIFT_PRESS   0x2A
 #define SCANCODE_LSHIFT_RELEASE 0xAA
 #define SCANCODE_RSHIFT_PRESS   0x36
 #define SCANCODE_RSHIFT_RELEASE 0xB6
+#define SCANCODE_CTRL_PRESS     0x1D
+#define SCANCODE_ALT_PRESS      0x38
 #define SCANCODE_CAPS_LOCK      0x3A
-
-#define KB_BUFFER_SIZE 128
-
-static const char scancode_to_ascii_lower[] = {
-    0,   0,   '1', '2', '3',  '4', '5', '6', '7', '8', '9', '0', '-',  '=',  '\b',
-    '\t','q', 'w', 'e', 'r',  't', 'y', 'u', 'i', 'o', 'p', '[', ']',  '\n',
-    0,   'a', 's', 'd', 'f',  'g', 'h', 'j', 'k', 'l', ';', '\'','`',
-    0,   '\\','z', 'x', 'c',  'v', 'b', 'n', 'm', ',', '.', '/',  0,
-    '*', 0,   ' '
+#define SCANCODE_EXTENDED       0xE0
+#define SCANCODE_PAUSE_PREFIX   0xE1
+#define SCANCODE_PAUSE          0x45
+// second byte of the E0-prefixed keypad keys
+#define SCANCODE_KEYPAD_ENTER   0x1C
+#define SCANCODE_KEYPAD_SLASH   0x35
+
+// bucket n counts events read 2^n up to 2^(n+1) - 1 cycles after the IRQ
+#define INPUT_LATENCY_BUCKETS 32
+
+struct input_latency {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t histogram[INPUT_LATENCY_BUCKETS];
 };
 
-static const char scancode_to_ascii_upper[] = {
-    0,   0,   '!', '@', '#',  '$', '%', '^', '&', '*', '(', ')', '_',  '+',  '\b',
-    '\t','Q', 'W', 'E', 'R',  'T', 'Y', 'U', 'I', 'O', 'P', '{', '}',  '\n',
-    0,   'A', 'S', 'D', 'F',  'G', 'H', 'J', 'K', 'L', ':', '"', '~',
-    0,   '|', 'Z', 'X', 'C',  'V', 'B', 'N', 'M', '<', '>', '?',  0,
-    '*', 0,   ' '
-};
+void keyboard_init(void);
 
-static bool shift_pressed = false;
-static bool caps_lock = false;
-static char kb_buffer[KB_BUFFER_SIZE];
-static int kb_buffer_read = 0;
-static int kb_buffer_write = 0;
+// take the next event without waiting; false when there is none
+bool keyboard_poll_event(struct input_event *event);
 
-void keyboard_init(void);
+// sleep until an event arrives or timeout_ns (WAIT_FOREVER) passes
+bool keyboard_read_event(struct input_event *event, uint64_t timeout_ns);
 
-static void kb_buffer_put(char c);
+bool keyboard_has_event(void);
 
+// character of the next key press, skipping other events; 0 when none
 char keyboard_get_char(void);
 
-bool keyboard_has_char(void);
+// sleeps until a key with a character is pressed
+char keyboard_read_char(void);
+
+// decode one scancode read at tsc into an event for the readers
+void keyboard_handle_scancode(uint8_t scancode, uint64_t tsc);
+
+void keyboard_latency_show(void);
+
+void keyboard_latency_reset(void);
 
-void keyboard_handle_irq(uint8_t scancode);
\ No newline at end of file
+void inputstat_command(const char *args);
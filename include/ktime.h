@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+
+void ktime_init(void);
+
+// TSC ticks and nanoseconds since ktime_init()
+uint64_t ktime_cycles(void);
+
+uint64_t ktime_ns(void);
+
+uint64_t ktime_tsc_hz(void);
+
+bool ktime_tsc_invariant(void);
+
+uint64_t cycles_to_ns(uint64_t cycles);
+
+uint64_t ns_to_cycles(uint64_t ns);
+
+// absolute TSC value at which ktime_ns() reaches ns
+uint64_t ktime_ns_to_tsc(uint64_t ns);
+
+// nanoseconds since the Unix epoch, from the boot RTC reading plus ktime
+uint64_t clock_realtime(void);
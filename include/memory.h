@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+void memory_init(void);
+
 void *memcpy(void *restrict dest, const void *restrict src, size_t n);
 
 void *memset(void *s, int c, size_t n);
@@ -2,14 +2,21 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <limine.h>
 
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
 #define ENTRIES_PER_TABLE 512
-#define BITMAP_SIZE 32768
+#define TLB_FLUSH_THRESHOLD 32
+#define TLB_FLUSH_VECTOR    0xF2
+#define ZERO_POOL_PAGES 64
 #define PAGE_PRESENT  0x1
 #define PAGE_WRITE    0x2
 #define PAGE_USER     0x4
+#define PAGE_PWT      0x8
+#define PAGE_PCD      0x10
 
 extern volatile struct limine_hhdm_request hhdm_request;
 extern volatile struct limine_memmap_request memmap_request;
@@ -78,16 +85,10 @@ struct pt_entry {
     uint64_t xd:1;
 } __attribute__((packed));
 
-static struct pml4_entry *pml4 = NULL;
-static uint64_t hhdm_offset = 0;
-
-static uint8_t page_bitmap[BITMAP_SIZE];
-static uint64_t total_pages = 0;
-static uint64_t used_pages = 0;
-static uint64_t next_free_page = 0;
-
 void *phys_to_virt(uint64_t phys_addr);
 
+uint64_t virt_to_phys(void *virt_addr);
+
 void setup_paging(void);
 
 void pmm_init(void);
@@ -96,10 +97,34 @@ uint64_t allocate_page(void);
 
 void free_page(uint64_t phys_addr);
 
+uint64_t allocate_zeroed_page(void);
+
+void zero_pool_refill(void);
+
+uint64_t alloc_pages(unsigned int order);
+
+void free_pages(uint64_t phys_addr, unsigned int order);
+
+uint64_t alloc_contig_pages(uint64_t count);
+
+void free_contig_pages(uint64_t phys_addr, uint64_t count);
+
 void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
 
+bool map_large_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t page_size, uint64_t flags);
+
+bool map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length, uint64_t flags);
+
+bool map_pages(uint64_t virtual_addr, const uint64_t *physical_pages, uint64_t count, uint64_t flags);
+
 void unmap_page(uint64_t virtual_addr);
 
+// returns once every CPU has dropped the old translations, so the frames
+// that were mapped may be freed straight after
+void unmap_range(uint64_t virtual_addr, uint64_t length);
+
 uint64_t get_physical_address(uint64_t virtual_addr);
 
+void *map_physical(uint64_t physical_addr, uint64_t length, uint64_t flags);
+
 void pmm_stats(void);
\ No newline at end of file
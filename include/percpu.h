@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "apic.h"
+#include "gdt.h"
+#include "fpu.h"
+
+#define MAX_CPUS APIC_MAX_CPUS
+
+struct thread;
+struct irq_stat;
+
+// Per-CPU data, reached through the GS base. The first field points back
+// at the structure so this_cpu() is a single load.
+struct percpu {
+    struct percpu *self;
+    // dense index, 0 is the boot CPU
+    uint32_t id;
+    uint32_t apic_id;
+    volatile bool online;
+
+    struct thread *current;
+    // thread switched away from, finished off by the next one to run
+    struct thread *switch_prev;
+    volatile bool need_resched;
+    uint32_t preempt_count;
+
+    volatile uint32_t softirq_pending;
+    bool softirq_running;
+
+    // epoch seen by the outermost RCU read section, 0 outside one
+    volatile uint64_t rcu_epoch;
+    uint32_t rcu_nesting;
+
+    uint32_t fpu_depth;
+    void *fpu_save_areas[FPU_MAX_DEPTH - 1];
+
+    struct gdt_cpu *gdt;
+    uint8_t *ist_stacks;
+
+    // handler times by vector, only ever written by this CPU
+    struct irq_stat *irq_stats;
+};
+
+static inline struct percpu *this_cpu(void) {
+    struct percpu *cpu;
+    asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t smp_processor_id(void) {
+    return this_cpu()->id;
+}
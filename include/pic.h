@@ -17,4 +17,6 @@ void init_pic(void);
 
 void pic_unmask_irq(uint8_t irq);
 
-void send_eoi(uint8_t irq);
\ No newline at end of file
+void send_eoi(uint8_t irq);
+
+void pic_disable(void);
\ No newline at end of file
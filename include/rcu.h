@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Read-mostly data published through a pointer. Readers take no lock and
+// write no shared cache line: they only note the current epoch in their
+// CPU's per-CPU area. Writers publish a new version with
+// rcu_assign_pointer() and free the old one once every CPU that might
+// still see it has left its read section.
+
+struct rcu_head;
+
+typedef void (*rcu_callback_t)(struct rcu_head *head);
+
+// embedded in objects freed through call_rcu()
+struct rcu_head {
+    struct rcu_head *next;
+    rcu_callback_t fn;
+};
+
+#define rcu_dereference(p)        __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v)  __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Read sections nest and work from any context, interrupts included, but
+// must not sleep: preemption is off until the outermost rcu_read_unlock().
+void rcu_read_lock(void);
+
+void rcu_read_unlock(void);
+
+// wait until every read section running at the call has finished; must
+// not be called from inside one
+void synchronize_rcu(void);
+
+// run fn(head) after a grace period, from the rcu thread; safe from any
+// context that can take a spinlock
+void call_rcu(struct rcu_head *head, rcu_callback_t fn);
+
+// start the thread that runs call_rcu() callbacks; callbacks queued
+// before this wait for it
+void rcu_init(void);
@@ -4,8 +4,27 @@
 #define RTC_COMMAND 0x70
 #define RTC_DATA    0x71
 
+struct rtc_time {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+};
+
 void rtc_init(void);
 
-void rtc_handler(void);
+// reads the CMOS clock directly; slow, meant for boot and resync only
+void rtc_read(struct rtc_time *time);
+
+// the time read by rtc_init() and the TSC value it was taken at
+const struct rtc_time *rtc_boot_time(void);
+
+uint64_t rtc_boot_tsc(void);
+
+uint64_t rtc_time_to_unix(const struct rtc_time *time);
+
+void rtc_unix_to_time(uint64_t seconds, struct rtc_time *time);
 
-void rtc_read_time(uint8_t *hour, uint8_t *minute, uint8_t *second);
\ No newline at end of file
+void rtc_read_time(uint8_t *hour, uint8_t *minute, uint8_t *second);
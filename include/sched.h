@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "percpu.h"
+
+#define RESCHED_VECTOR       0xF1
+
+// scheduler tick; a CPU with other threads ready is preempted this often
+#define SCHED_TICK_NS        4000000ULL
+
+// higher priorities get a larger share of the CPU; each step is about
+// 1.4 times the weight of the one below
+#define SCHED_PRIO_LEVELS    8
+#define SCHED_PRIO_DEFAULT   4
+
+// thread_create() cpu argument for a thread free to run and be stolen anywhere
+#define SCHED_ANY_CPU        -1
+
+#define THREAD_NAME_LEN      16
+#define THREAD_STACK_PAGES   4
+
+enum thread_state {
+    THREAD_RUNNING,
+    THREAD_READY,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+typedef void (*thread_fn_t)(void *arg);
+
+struct thread {
+    // saved stack pointer while switched out; context_switch() relies on
+    // it being the first field
+    uint64_t rsp;
+    uint32_t id;
+    char name[THREAD_NAME_LEN];
+    volatile enum thread_state state;
+    // still on a CPU's stack; a stealer must leave it alone
+    volatile bool on_cpu;
+    // woken while not blocked; the next sched_block() returns at once
+    bool wake_pending;
+
+    uint32_t priority;
+    uint32_t weight;
+    uint64_t vruntime;
+    uint64_t exec_start;
+    uint64_t runtime_ns;
+
+    // run queue the thread belongs to, and the only one it may use when
+    // pinned
+    uint32_t cpu;
+    bool pinned;
+
+    struct thread *rq_next;
+    struct thread *all_next;
+    uint64_t stack_phys;
+};
+
+void sched_init(void);
+
+// make the calling AP's boot context its idle thread
+void sched_init_ap(void);
+
+// start a thread on the given CPU, or on the caller's run queue for
+// SCHED_ANY_CPU
+struct thread *thread_create(const char *name, thread_fn_t fn, void *arg, uint32_t priority, int cpu);
+
+__attribute__((noreturn)) void thread_exit(void);
+
+struct thread *thread_current(void);
+
+void schedule(void);
+
+void sched_yield(void);
+
+// mark the current thread blocked and switch away; call with interrupts
+// disabled, returns with them still disabled after sched_wake(). A wake
+// that arrives before the block is not lost, so callers recheck whatever
+// they wait for in a loop and may see the odd early return.
+void sched_block(void);
+
+void sched_wake(struct thread *thread);
+
+// whether the caller is a thread that may sleep: not the idle or boot
+// context, and not in an interrupt, softirq, FPU section or spinlock
+bool sched_can_block(void);
+
+// block the current thread for at least ns; uses the BSP timer wheel
+void thread_sleep_ns(uint64_t ns);
+
+// called on the way out of an interrupt
+void sched_preempt_irq(void);
+
+// free the stacks of exited threads; runs from the BSP idle loop
+void thread_reap(void);
+
+void sched_stats(void);
+
+// preemption is only held off, not replayed: a tick that arrives inside
+// the section takes effect at the next one. One gs-relative instruction,
+// so the thread cannot migrate between finding its CPU and counting.
+static inline void preempt_disable(void) {
+    asm volatile("incl %%gs:%c0" : : "i"(offsetof(struct percpu, preempt_count)) : "memory");
+}
+
+static inline void preempt_enable(void) {
+    asm volatile("decl %%gs:%c0" : : "i"(offsetof(struct percpu, preempt_count)) : "memory");
+}
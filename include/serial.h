@@ -8,6 +8,9 @@
 
 void serial_init(void);
 
+// switch output over to the transmit interrupt once the APIC routes it
+void serial_irq_init(void);
+
 bool serial_transmit_empty(void);
 
 void serial_putchar(char c);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Vector kernels built with SSE2/AVX2 enabled. They may only run between
+// kernel_fpu_begin() and kernel_fpu_end(); the AVX2 variants additionally
+// require fpu_has_avx2().
+
+void simd_copy_sse2(void *dest, const void *src, size_t n);
+
+void simd_copy_avx2(void *dest, const void *src, size_t n);
+
+void simd_fill_sse2(void *dest, uint32_t value, size_t n);
+
+void simd_fill_avx2(void *dest, uint32_t value, size_t n);
+
+// index of the first nonzero word, or count if every word is zero
+size_t simd_find_nonzero_sse2(const uint64_t *words, size_t count);
+
+size_t simd_find_nonzero_avx2(const uint64_t *words, size_t count);
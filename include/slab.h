@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "spinlock.h"
+
+// every slab is one naturally aligned buddy block, so the slab header of an
+// object is found by masking its address
+#define SLAB_ORDER       3
+#define SLAB_BYTES       (PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAX_CACHES  32
+
+#define KMALLOC_MIN_SIZE 16
+#define KMALLOC_MAX_SIZE 4096
+
+struct slab;
+
+struct kmem_cache {
+    // FIFO so an allocation-heavy CPU cannot starve the others
+    struct ticket_lock lock;
+    const char *name;
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    struct slab *partial;
+    struct slab *full;
+    struct slab *spare;
+    uint64_t slab_count;
+    uint64_t active_objects;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    struct kmem_cache *next;
+};
+
+void slab_init(void);
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t object_size);
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+void kmem_cache_free(struct kmem_cache *cache, void *object);
+
+void *kmalloc(size_t size);
+
+void kfree(void *ptr);
+
+void slab_stats(void);
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "percpu.h"
+
+// point GS at the boot CPU's per-CPU area; call right after gdt_init()
+void percpu_init_boot(void);
+
+// start the application processors Limine reports and wait for them to
+// reach their idle loops
+void smp_init(void);
+
+uint32_t smp_cpu_count(void);
+
+// per-CPU area by dense index, NULL if that CPU is not online
+struct percpu *cpu_data(uint32_t id);
+
+// the idle thread: run whatever is ready, steal, or halt until an
+// interrupt; every CPU's boot context ends up here
+__attribute__((noreturn)) void cpu_idle(void);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// lower numbers run first
+enum {
+    SOFTIRQ_TIMER,
+    NR_SOFTIRQS
+};
+
+typedef void (*softirq_handler_t)(void);
+
+void open_softirq(unsigned int nr, softirq_handler_t handler);
+
+// for IRQ handlers only; the handler runs on the way out of the interrupt
+void raise_softirq(unsigned int nr);
+
+// run pending softirqs with interrupts enabled; returns with them disabled
+void do_softirq(void);
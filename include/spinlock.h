@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Contention counters for one lock, compiled in with `make LOCKSTAT=1`.
+// They are only written while the lock is held, so they need no atomics.
+struct lock_stat {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    uint64_t max_wait_cycles;
+    struct lock_stat *next;
+    bool registered;
+};
+
+#ifdef LOCKSTAT
+#define LOCK_STAT_FIELD struct lock_stat stat;
+#define LOCK_STAT_INIT(lock_name) .stat = { .name = lock_name },
+#else
+#define LOCK_STAT_FIELD
+#define LOCK_STAT_INIT(lock_name)
+#endif
+
+// test-and-test-and-set; cheapest when uncontended
+struct spinlock {
+    volatile uint32_t locked;
+    LOCK_STAT_FIELD
+};
+
+// FIFO handoff, so no CPU starves under contention
+struct ticket_lock {
+    volatile uint16_t next;
+    volatile uint16_t owner;
+    LOCK_STAT_FIELD
+};
+
+// Each waiter spins on its own node, so a contended lock costs one cache
+// line transfer per handoff instead of one per waiter. The node lives on
+// the caller's stack for as long as the lock is held.
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile bool locked;
+};
+
+struct mcs_lock {
+    struct mcs_node *volatile tail;
+    LOCK_STAT_FIELD
+};
+
+#define SPINLOCK_INIT(lock_name)    { .locked = 0, LOCK_STAT_INIT(lock_name) }
+#define TICKET_LOCK_INIT(lock_name) { .next = 0, .owner = 0, LOCK_STAT_INIT(lock_name) }
+#define MCS_LOCK_INIT(lock_name)    { .tail = NULL, LOCK_STAT_INIT(lock_name) }
+
+// The plain variants hold off preemption; the irqsave ones disable
+// interrupts, which also rules it out, and must be used for any lock an
+// interrupt or softirq handler takes.
+void spin_lock_init(struct spinlock *lock, const char *name);
+
+void spin_lock(struct spinlock *lock);
+
+bool spin_trylock(struct spinlock *lock);
+
+void spin_unlock(struct spinlock *lock);
+
+uint64_t spin_lock_irqsave(struct spinlock *lock);
+
+void spin_unlock_irqrestore(struct spinlock *lock, uint64_t flags);
+
+void ticket_lock_init(struct ticket_lock *lock, const char *name);
+
+void ticket_lock(struct ticket_lock *lock);
+
+void ticket_unlock(struct ticket_lock *lock);
+
+uint64_t ticket_lock_irqsave(struct ticket_lock *lock);
+
+void ticket_unlock_irqrestore(struct ticket_lock *lock, uint64_t flags);
+
+void mcs_lock_init(struct mcs_lock *lock, const char *name);
+
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node);
+
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node);
+
+uint64_t mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_node *node);
+
+void mcs_unlock_irqrestore(struct mcs_lock *lock, struct mcs_node *node, uint64_t flags);
+
+void lockstat_show(void);
+
+void lockstat_reset(void);
+
+void lockstat_command(const char *args);
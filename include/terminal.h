@@ -8,21 +8,11 @@
 
 #define CMD_MAX 256
 
-static struct limine_framebuffer *g_fb = NULL;
-static void *g_glyphs = NULL;
-static struct psf1_header *g_hdr = NULL;
-static uint64_t cursor_x = 10;
-static uint64_t cursor_y = 50;
-static uint32_t text_color = 0xFFFFFF;
-static size_t fb_height = 0;
-static size_t fb_width = 0;
-static bool auto_prompt = false;
-static bool accept_input = false;
-static char cmd[CMD_MAX];
-static size_t cmd_len = 0;
-
 void terminal_prompt(void);
 
+// move command execution out of the keyboard softirq into a thread
+void terminal_start_shell(void);
+
 void terminal_write(const char *str);
 
 void terminal_init(struct limine_framebuffer *fb, void *glyphs, struct psf1_header *hdr);
@@ -51,6 +41,9 @@ void terminal_prompt();
 
 void terminal_write(const char* s);
 
+// draws without feeding the command line, unlike terminal_putchar()
+void terminal_write_len(const char *s, size_t len);
+
 void terminal_write_hex(uint64_t value);
 
 void terminal_write_dec(uint64_t value);
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_VECTOR 0xF0
+
+// the wheel counts in 2^20 ns (~1 ms) ticks; each level is 64 slots of
+// 64 times the width of the level below
+#define TIMER_TICK_SHIFT  20
+#define TIMER_LEVEL_BITS  6
+#define TIMER_LEVEL_SIZE  (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS      4
+
+struct timer;
+
+typedef void (*timer_fn_t)(struct timer *timer, void *ctx);
+
+// embedded by the caller; arming and cancelling only relink it
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    uint64_t expires;
+    uint8_t level;
+    uint8_t slot;
+    timer_fn_t fn;
+    void *ctx;
+};
+
+void timer_subsystem_init(void);
+
+void timer_init(struct timer *timer, timer_fn_t fn, void *ctx);
+
+// run fn from the timer softirq once ktime_ns() passes deadline_ns
+void timer_add(struct timer *timer, uint64_t deadline_ns);
+
+// Returns whether the timer was still pending. Also waits out a callback
+// already running on another CPU, so the timer may be freed on return.
+bool timer_cancel(struct timer *timer);
+
+// timer_cancel() without the wait, for static timers whose callback may
+// safely outlast the call
+bool timer_del(struct timer *timer);
+
+bool timer_pending(struct timer *timer);
+
+void sleep_ns(uint64_t ns);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+#define VMA_READ  0x1
+#define VMA_WRITE 0x2
+#define VMA_USER  0x4
+
+// demand paged kernel allocations are placed in this window
+#define VMM_ARENA_START 0xFFFFE00000000000ULL
+#define VMM_ARENA_END   0xFFFFE10000000000ULL
+
+struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+    struct vma *next;
+};
+
+// VMAs sorted by start address, plus the last one a lookup hit since
+// faults tend to come in runs against the same region. The lock covers the
+// list and is held across a whole fault, so a region cannot be torn down
+// under a fault being resolved in it. It leaves interrupts alone, so
+// demand-paged memory must not be touched from interrupt context.
+struct address_space {
+    struct spinlock lock;
+    struct vma *vmas;
+    struct vma *last_hit;
+    uint64_t vma_count;
+};
+
+struct fault_stats {
+    uint64_t faults;
+    uint64_t zero_maps;
+    uint64_t anon_maps;
+    uint64_t cow_copies;
+    uint64_t write_upgrades;
+    uint64_t bad_faults;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+};
+
+extern struct address_space kernel_space;
+
+void vmm_init(void);
+
+// the vma_* calls expect the caller to hold as->lock
+struct vma *vma_find(struct address_space *as, uint64_t addr);
+
+struct vma *vma_create(struct address_space *as, uint64_t start, uint64_t length, uint32_t flags);
+
+void vma_destroy(struct address_space *as, struct vma *vma);
+
+void *vmm_alloc(struct address_space *as, uint64_t length, uint32_t flags);
+
+void vmm_free(struct address_space *as, void *addr);
+
+bool vmm_handle_fault(uint64_t fault_addr, uint64_t error_code);
+
+void vmm_stats(void);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+#define WAIT_FOREVER UINT64_MAX
+
+struct thread;
+
+// one sleeper, on its own stack for as long as it waits
+struct wait_entry {
+    struct thread *thread;
+    struct wait_entry *next;
+    struct wait_entry *prev;
+    bool queued;
+};
+
+// Threads sleeping until an interrupt, timer or another thread changes
+// something they are waiting for. Woken in FIFO order.
+struct wait_queue {
+    struct spinlock lock;
+    struct wait_entry *head;
+    struct wait_entry *tail;
+};
+
+#define WAIT_QUEUE_INIT(lock_name) { .lock = SPINLOCK_INIT(lock_name), .head = NULL, .tail = NULL }
+
+typedef bool (*wait_cond_t)(void *ctx);
+
+void wait_queue_init(struct wait_queue *wq, const char *name);
+
+// Sleep until cond(ctx) holds or timeout_ns passes, and return whether it
+// holds. cond is evaluated with interrupts off, and the side that makes it
+// true calls wake_up() afterwards. Callers that cannot sleep (see
+// sched_can_block()) poll cond instead.
+bool wait_until(struct wait_queue *wq, wait_cond_t cond, void *ctx, uint64_t timeout_ns);
+
+// wake up to count sleepers; returns how many were waiting
+uint32_t wake_up(struct wait_queue *wq, uint32_t count);
+
+static inline void wake_up_one(struct wait_queue *wq) {
+    wake_up(wq, 1);
+}
+
+static inline void wake_up_all(struct wait_queue *wq) {
+    wake_up(wq, UINT32_MAX);
+}
+
+// Futex-style wait on a word: sleep while *word still equals expected.
+// Returns false on timeout. Pair with futex_wake() after changing the word.
+bool futex_wait(struct wait_queue *wq, volatile uint32_t *word, uint32_t expected, uint64_t timeout_ns);
+
+void futex_wake(struct wait_queue *wq, uint32_t count);
+
+// Sleeping lock on top of futex_wait(), for sections that wait on I/O.
+// state is 0 when free, 1 when held and 2 when held with sleepers.
+struct mutex {
+    volatile uint32_t state;
+    struct wait_queue wait;
+};
+
+#define MUTEX_INIT(lock_name) { .state = 0, .wait = WAIT_QUEUE_INIT(lock_name) }
+
+void mutex_init(struct mutex *mutex, const char *name);
+
+void mutex_lock(struct mutex *mutex);
+
+bool mutex_trylock(struct mutex *mutex);
+
+void mutex_unlock(struct mutex *mutex);
@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "limine.h"
+#include "paging.h"
+#include "serial.h"
+#include "acpi.h"
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST_ID,
+    .revision = 0
+};
+
+static struct acpi_sdt_header *root_table = NULL;
+static bool root_is_xsdt = false;
+
+static bool acpi_checksum(const void *table, size_t length) {
+    const uint8_t *bytes = (const uint8_t *)table;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+// tables live in firmware memory the HHDM may not cover, so map the
+// header first and then the full length it reports
+static struct acpi_sdt_header *acpi_map_table(uint64_t phys) {
+    struct acpi_sdt_header *header = map_physical(phys, sizeof(struct acpi_sdt_header), 0);
+    if (!header) {
+        return NULL;
+    }
+    return map_physical(phys, header->length, 0);
+}
+
+bool acpi_init(void) {
+    if (!rsdp_request.response) {
+        serial_write("ACPI: no RSDP from bootloader\n");
+        return false;
+    }
+
+    // base revision 3 and later hand over the physical address
+    uint64_t rsdp_phys = (uint64_t)rsdp_request.response->address;
+    struct acpi_rsdp *rsdp = map_physical(rsdp_phys, sizeof(struct acpi_rsdp), 0);
+    if (!rsdp || !acpi_checksum(rsdp, 20)) {
+        serial_write("ACPI: bad RSDP checksum\n");
+        return false;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+        root_table = acpi_map_table(rsdp->xsdt_address);
+        root_is_xsdt = true;
+    } else {
+        root_table = acpi_map_table(rsdp->rsdt_address);
+        root_is_xsdt = false;
+    }
+
+    if (!root_table || !acpi_checksum(root_table, root_table->length)) {
+        serial_write("ACPI: bad root table\n");
+        root_table = NULL;
+        return false;
+    }
+    return true;
+}
+
+struct acpi_sdt_header *acpi_find_table(const char *signature) {
+    if (!root_table) {
+        return NULL;
+    }
+
+    size_t entry_size = root_is_xsdt ? 8 : 4;
+    size_t count = (root_table->length - sizeof(struct acpi_sdt_header)) / entry_size;
+    uint8_t *entries = (uint8_t *)root_table + sizeof(struct acpi_sdt_header);
+
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys;
+        if (root_is_xsdt) {
+            phys = *(uint64_t *)(entries + i * 8);
+        } else {
+            phys = *(uint32_t *)(entries + i * 4);
+        }
+
+        struct acpi_sdt_header *table = acpi_map_table(phys);
+        if (!table) {
+            continue;
+        }
+        if (table->signature[0] == signature[0] && table->signature[1] == signature[1] &&
+            table->signature[2] == signature[2] && table->signature[3] == signature[3] &&
+            acpi_checksum(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
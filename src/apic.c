@@ -0,0 +1,418 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "ktime.h"
+#include "paging.h"
+#include "serial.h"
+#include "interrupts.h"
+#include "pic.h"
+#include "acpi.h"
+#include "apic.h"
+
+#define IA32_APIC_BASE      0x1B
+#define APIC_BASE_ENABLE    (1ULL << 11)
+#define APIC_BASE_X2APIC    (1ULL << 10)
+#define X2APIC_MSR_BASE     0x800
+
+#define LAPIC_ID            0x020
+#define LAPIC_TPR           0x080
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_LVT_MASKED    (1 << 16)
+#define LAPIC_ICR_PENDING   (1 << 12)
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+#define LAPIC_TIMER_DIV_16  0x3
+#define LAPIC_TIMER_ONESHOT (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define IA32_TSC_DEADLINE   0x6E0
+#define LAPIC_CALIBRATE_NS  10000000ULL
+
+#define IOAPIC_REGSEL       0x00
+#define IOAPIC_WINDOW       0x10
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_REDIRECTION  0x10
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+#define IOAPIC_MAX          8
+#define ISA_IRQ_COUNT       16
+
+struct ioapic {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+
+// MADT interrupt source override for one ISA IRQ; ISA defaults are
+// edge triggered and active high on the identity GSI
+struct isa_route {
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+static volatile uint32_t *lapic_regs = NULL;
+static bool x2apic = false;
+static bool apic_active = false;
+
+static struct ioapic ioapics[IOAPIC_MAX];
+static uint32_t ioapic_count = 0;
+static struct isa_route isa_routes[ISA_IRQ_COUNT];
+
+static bool tsc_deadline = false;
+static uint64_t lapic_timer_hz = 0;
+// longest delta that fits the 32-bit initial count, which also keeps
+// delta * lapic_timer_hz within 64 bits
+static uint64_t lapic_timer_max_ns = 0;
+
+static uint32_t cpu_apic_ids[APIC_MAX_CPUS];
+static uint32_t cpu_count = 0;
+
+static uint32_t lapic_read(uint32_t reg) {
+    if (x2apic) {
+        return (uint32_t)rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+    }
+    return lapic_regs[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    if (x2apic) {
+        wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+    } else {
+        lapic_regs[reg / 4] = value;
+    }
+}
+
+static uint32_t ioapic_read(struct ioapic *ioapic, uint32_t reg) {
+    ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+    return ioapic->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(struct ioapic *ioapic, uint32_t reg, uint32_t value) {
+    ioapic->regs[IOAPIC_REGSEL / 4] = reg;
+    ioapic->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static struct ioapic *ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].gsi_count) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+static void add_cpu(uint32_t apic_id, uint32_t flags) {
+    // bit 0 enabled, bit 1 online capable
+    if (!(flags & 0x3) || cpu_count >= APIC_MAX_CPUS) {
+        return;
+    }
+    cpu_apic_ids[cpu_count++] = apic_id;
+}
+
+static uint64_t parse_madt(struct acpi_madt *madt) {
+    uint64_t lapic_phys = madt->lapic_address;
+
+    uint8_t *entry = (uint8_t *)madt + sizeof(struct acpi_madt);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    while (entry + sizeof(struct madt_entry) <= end) {
+        struct madt_entry *header = (struct madt_entry *)entry;
+        if (header->length < sizeof(struct madt_entry)) {
+            break;
+        }
+
+        if (header->type == MADT_LOCAL_APIC) {
+            struct madt_local_apic *lapic = (struct madt_local_apic *)entry;
+            add_cpu(lapic->apic_id, lapic->flags);
+        } else if (header->type == MADT_LOCAL_X2APIC) {
+            struct madt_local_x2apic *lapic = (struct madt_local_x2apic *)entry;
+            add_cpu(lapic->x2apic_id, lapic->flags);
+        } else if (header->type == MADT_IO_APIC && ioapic_count < IOAPIC_MAX) {
+            struct madt_io_apic *io = (struct madt_io_apic *)entry;
+            struct ioapic *ioapic = &ioapics[ioapic_count];
+            ioapic->regs = map_physical(io->address, PAGE_SIZE, PAGE_PCD | PAGE_PWT);
+            if (ioapic->regs) {
+                ioapic->gsi_base = io->gsi_base;
+                ioapic->gsi_count = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+                ioapic_count++;
+            }
+        } else if (header->type == MADT_INTERRUPT_OVERRIDE) {
+            struct madt_interrupt_override *iso = (struct madt_interrupt_override *)entry;
+            if (iso->bus == 0 && iso->source < ISA_IRQ_COUNT) {
+                isa_routes[iso->source].gsi = iso->gsi;
+                isa_routes[iso->source].flags = iso->flags;
+            }
+        } else if (header->type == MADT_LOCAL_APIC_OVERRIDE) {
+            lapic_phys = ((struct madt_local_apic_override *)entry)->address;
+        }
+
+        entry += header->length;
+    }
+
+    return lapic_phys;
+}
+
+// switch the calling CPU's local APIC on in the mode the BSP chose
+static void lapic_enable(void) {
+    uint64_t base = rdmsr(IA32_APIC_BASE) | APIC_BASE_ENABLE;
+    if (x2apic) {
+        base |= APIC_BASE_X2APIC;
+    }
+    wrmsr(IA32_APIC_BASE, base);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+bool apic_init(void) {
+    struct acpi_madt *madt = (struct acpi_madt *)acpi_find_table("APIC");
+    if (!madt) {
+        serial_write("APIC: no MADT, staying on the 8259\n");
+        return false;
+    }
+
+    for (uint8_t irq = 0; irq < ISA_IRQ_COUNT; irq++) {
+        isa_routes[irq].gsi = irq;
+        isa_routes[irq].flags = 0;
+    }
+
+    uint64_t lapic_phys = parse_madt(madt);
+    if (ioapic_count == 0) {
+        serial_write("APIC: no I/O APIC, staying on the 8259\n");
+        return false;
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    x2apic = ecx & (1 << 21);
+
+    uint64_t flags = irq_save();
+
+    if (!x2apic) {
+        lapic_regs = map_physical(lapic_phys, PAGE_SIZE, PAGE_PCD | PAGE_PWT);
+    }
+    lapic_enable();
+    set_idt_entry(APIC_SPURIOUS_VECTOR, spurious_stub, 0x8E);
+
+    // everything starts masked; the IRQs the kernel has handlers for are
+    // moved over from the 8259 before it is shut off
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        for (uint32_t pin = 0; pin < ioapics[i].gsi_count; pin++) {
+            ioapic_write(&ioapics[i], IOAPIC_REDIRECTION + pin * 2, IOAPIC_MASKED);
+        }
+    }
+
+    uint32_t bsp = lapic_id();
+    static const uint8_t isa_irqs[] = {0, 1, 4, 8, 14, 15};
+    for (size_t i = 0; i < sizeof(isa_irqs); i++) {
+        ioapic_route_irq(isa_irqs[i], ISA_IRQ_VECTOR(isa_irqs[i]), bsp);
+    }
+
+    pic_disable();
+    apic_active = true;
+
+    irq_restore(flags);
+
+    serial_write(x2apic ? "APIC: x2APIC mode, " : "APIC: xAPIC mode, ");
+    serial_write_dec(cpu_count);
+    serial_write(" CPUs, ");
+    serial_write_dec(ioapic_count);
+    serial_write(" I/O APICs\n");
+    return true;
+}
+
+void lapic_init_ap(void) {
+    lapic_enable();
+    // the timer wheel only runs on the BSP
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+}
+
+bool apic_enabled(void) {
+    return apic_active;
+}
+
+bool apic_x2apic_mode(void) {
+    return x2apic;
+}
+
+uint32_t lapic_id(void) {
+    uint32_t id = lapic_read(LAPIC_ID);
+    return x2apic ? id : id >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (x2apic) {
+        // a single 64-bit ICR write, no delivery status to poll. The MSR
+        // write is not serializing, so fence first or the target may not
+        // yet see what it was sent to look at
+        asm volatile("mfence; lfence" ::: "memory");
+        wrmsr(X2APIC_MSR_BASE + (LAPIC_ICR_LOW >> 4), ((uint64_t)apic_id << 32) | vector);
+        return;
+    }
+
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);
+}
+
+bool ioapic_route_gsi(uint32_t gsi, uint8_t vector, uint32_t apic_id, bool level, bool active_low) {
+    struct ioapic *ioapic = ioapic_for_gsi(gsi);
+    if (!ioapic) {
+        return false;
+    }
+
+    uint32_t low = vector;
+    if (active_low) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+    if (level) {
+        low |= IOAPIC_LEVEL;
+    }
+
+    uint32_t pin = gsi - ioapic->gsi_base;
+    ioapic_write(ioapic, IOAPIC_REDIRECTION + pin * 2 + 1, apic_id << 24);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION + pin * 2, low);
+    return true;
+}
+
+bool ioapic_route_irq(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+    if (irq >= ISA_IRQ_COUNT) {
+        return false;
+    }
+
+    struct isa_route *route = &isa_routes[irq];
+    bool active_low = (route->flags & 0x3) == 0x3;
+    bool level = ((route->flags >> 2) & 0x3) == 0x3;
+    return ioapic_route_gsi(route->gsi, vector, apic_id, level, active_low);
+}
+
+bool ioapic_gsi_is_isa(uint32_t gsi) {
+    for (uint8_t irq = 0; irq < ISA_IRQ_COUNT; irq++) {
+        if (isa_routes[irq].gsi == gsi) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ioapic_set_mask(uint8_t irq, bool masked) {
+    if (irq >= ISA_IRQ_COUNT) {
+        return;
+    }
+
+    struct ioapic *ioapic = ioapic_for_gsi(isa_routes[irq].gsi);
+    if (!ioapic) {
+        return;
+    }
+
+    uint32_t reg = IOAPIC_REDIRECTION + (isa_routes[irq].gsi - ioapic->gsi_base) * 2;
+    uint32_t low = ioapic_read(ioapic, reg);
+    if (masked) {
+        low |= IOAPIC_MASKED;
+    } else {
+        low &= ~IOAPIC_MASKED;
+    }
+    ioapic_write(ioapic, reg, low);
+}
+
+void ioapic_mask_irq(uint8_t irq) {
+    ioapic_set_mask(irq, true);
+}
+
+void ioapic_unmask_irq(uint8_t irq) {
+    ioapic_set_mask(irq, false);
+}
+
+uint32_t apic_cpu_count(void) {
+    return cpu_count;
+}
+
+uint32_t apic_cpu_id(uint32_t index) {
+    return index < cpu_count ? cpu_apic_ids[index] : 0;
+}
+
+bool lapic_timer_init(uint8_t vector) {
+    if (!apic_active) {
+        return false;
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    tsc_deadline = (ecx & (1 << 24)) && ktime_tsc_invariant();
+
+    if (tsc_deadline) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | vector);
+        return true;
+    }
+
+    // count down from the maximum for a known time to learn the rate
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    uint64_t end = ktime_ns() + LAPIC_CALIBRATE_NS;
+    while (ktime_ns() < end) {
+        asm volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    lapic_timer_hz = (uint64_t)elapsed * (NSEC_PER_SEC / LAPIC_CALIBRATE_NS);
+    if (lapic_timer_hz) {
+        lapic_timer_max_ns = 0xFFFFFFFFULL * NSEC_PER_SEC / lapic_timer_hz;
+    }
+
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | vector);
+    return lapic_timer_hz != 0;
+}
+
+bool lapic_timer_tsc_deadline(void) {
+    return tsc_deadline;
+}
+
+void lapic_timer_arm(uint64_t deadline_ns) {
+    if (tsc_deadline) {
+        // the SDM wants the write ordered after the LVT mode switch and
+        // earlier stores; WRMSR to this MSR does not serialize
+        asm volatile("mfence; lfence" ::: "memory");
+        wrmsr(IA32_TSC_DEADLINE, ktime_ns_to_tsc(deadline_ns));
+        return;
+    }
+
+    uint64_t now = ktime_ns();
+    uint64_t delta = deadline_ns > now ? deadline_ns - now : 0;
+    if (delta > lapic_timer_max_ns) {
+        // the wheel re-arms when this fires early
+        delta = lapic_timer_max_ns;
+    }
+    uint64_t count = delta * lapic_timer_hz / NSEC_PER_SEC;
+    if (count == 0) {
+        count = 1;
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+void lapic_timer_stop(void) {
+    if (tsc_deadline) {
+        wrmsr(IA32_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+    }
+}
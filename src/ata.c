@@ -1,18 +1,54 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #include "ata.h"
 #include "serial.h"
 #include "interrupts.h"
 #include "terminal.h"
 #include "io.h"
+#include "wait.h"
 
+// The drive interrupts when BSY drops or DRQ rises. The IRQ only prompts
+// a fresh look at the status, so a missed one costs at most this long.
+#define ATA_WAIT_SLICE_NS 10000000ULL
+
+static struct wait_queue ata_wait = WAIT_QUEUE_INIT("ata");
+
+// one command at a time on the channel; ext2 readers no longer share the
+// filesystem lock, so the transfers themselves are serialised here
+static struct mutex ata_lock = MUTEX_INIT("ata_io");
+
+// reading the status register acknowledges the drive's interrupt
+static void ata_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    inb(0x1F7);
+    wake_up_all(&ata_wait);
+}
+
+void ata_init(void) {
+    request_irq(ISA_IRQ_VECTOR(14), ata_irq, NULL);
+}
+
+// the waits poll the alternate status register, which leaves a pending
+// interrupt for the handler
+static bool ata_not_busy(void *ctx) {
+    (void)ctx;
+    return !(inb(0x3F6) & 0x80);
+}
+
+static bool ata_data_ready(void *ctx) {
+    (void)ctx;
+    return inb(0x3F6) & 0x08;
+}
 
 void ata_wait_busy(void){
-    while (inb(0x1F7) & 0x80);
+    while (!wait_until(&ata_wait, ata_not_busy, NULL, ATA_WAIT_SLICE_NS));
 }
 
 void ata_wait_drq(void) {
-    while (!(inb(0x1F7) & 0x08));
+    while (!wait_until(&ata_wait, ata_data_ready, NULL, ATA_WAIT_SLICE_NS));
 }
 
 
@@ -122,17 +158,21 @@ void read(uint32_t start_sector, uint32_t size, uint8_t *buffer){
     uint32_t total_sectors = size /  512;
     uint32_t offset = 0;
 
+    mutex_lock(&ata_lock);
     for (uint32_t sector = start_sector; sector < total_sectors + start_sector; sector++){
         ata_read_sector(sector, buffer + offset);
         offset += 512;
     }
+    mutex_unlock(&ata_lock);
 }
 
 void write(uint32_t start_sector, uint32_t size, uint8_t *buffer){
     uint32_t total_sectors = size /  512;
     uint32_t offset = 0;
+    mutex_lock(&ata_lock);
     for (uint32_t sector = start_sector; sector < total_sectors + start_sector; sector++){
         ata_write_sector(sector, buffer + offset);
         offset += 512;
     }
+    mutex_unlock(&ata_lock);
 }
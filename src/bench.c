@@ -0,0 +1,617 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "str.h"
+#include "terminal.h"
+#include "paging.h"
+#include "memory.h"
+#include "ktime.h"
+#include "hbitmap.h"
+#include "fpu.h"
+#include "simd.h"
+#include "io.h"
+#include "pit.h"
+#include "hpet.h"
+#include "smp.h"
+#include "sched.h"
+#include "vmm.h"
+#include "bench.h"
+
+#define BENCH_BITMAP_PAGES 262144
+#define BENCH_BATCH        64
+#define BENCH_ROUNDS       64
+#define BENCH_RUN_LENGTH   16
+#define BENCH_RUN_ROUNDS   8
+
+#define BENCH_MEM_MAX      (4ULL << 20)
+#define BENCH_MEM_BYTES    (16ULL << 20)
+
+static uint64_t bench_seed = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t bench_random(void) {
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return bench_seed;
+}
+
+// the byte-wise scan allocate_page() used before the buddy allocator,
+// with a set bit meaning the page is in use
+static uint64_t legacy_alloc(uint8_t *bitmap, uint64_t *next_free) {
+    for (uint64_t i = *next_free; i < BENCH_BITMAP_PAGES; i++) {
+        uint64_t byte_index = i / 8;
+        uint64_t bit_index = i % 8;
+
+        if (!(bitmap[byte_index] & (1 << bit_index))) {
+            bitmap[byte_index] |= (1 << bit_index);
+            *next_free = i + 1;
+            return i;
+        }
+    }
+    return HBITMAP_NONE;
+}
+
+static void legacy_free(uint8_t *bitmap, uint64_t *next_free, uint64_t page) {
+    bitmap[page / 8] &= ~(1 << (page % 8));
+    if (page < *next_free) {
+        *next_free = page;
+    }
+}
+
+static uint64_t legacy_find_run(uint8_t *bitmap, uint64_t count) {
+    uint64_t run = 0;
+    for (uint64_t i = 0; i < BENCH_BITMAP_PAGES; i++) {
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            run = 0;
+        } else if (++run == count) {
+            return i + 1 - count;
+        }
+    }
+    return HBITMAP_NONE;
+}
+
+static void bench_bitmap_occupancy(uint8_t *legacy, struct hbitmap *bm, void *bm_storage, uint64_t percent) {
+    uint64_t pages[BENCH_BATCH];
+    uint64_t next_free = 0;
+
+    for (uint64_t i = 0; i < BENCH_BITMAP_PAGES / 8; i++) {
+        legacy[i] = 0;
+    }
+    hbitmap_init(bm, bm_storage, BENCH_BITMAP_PAGES);
+
+    for (uint64_t i = 0; i < BENCH_BITMAP_PAGES; i++) {
+        if (bench_random() % 100 < percent) {
+            legacy[i / 8] |= 1 << (i % 8);
+        } else {
+            hbitmap_set(bm, i);
+        }
+    }
+
+    uint64_t start = rdtsc();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            pages[i] = legacy_alloc(legacy, &next_free);
+        }
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            if (pages[i] != HBITMAP_NONE) {
+                legacy_free(legacy, &next_free, pages[i]);
+            }
+        }
+    }
+    uint64_t legacy_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            pages[i] = hbitmap_find_first(bm);
+            if (pages[i] != HBITMAP_NONE) {
+                hbitmap_clear(bm, pages[i]);
+            }
+        }
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            if (pages[i] != HBITMAP_NONE) {
+                hbitmap_set(bm, pages[i]);
+            }
+        }
+    }
+    uint64_t hbitmap_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < BENCH_RUN_ROUNDS; round++) {
+        legacy_find_run(legacy, BENCH_RUN_LENGTH);
+    }
+    uint64_t legacy_run_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (int round = 0; round < BENCH_RUN_ROUNDS; round++) {
+        hbitmap_find_run(bm, BENCH_RUN_LENGTH);
+    }
+    uint64_t hbitmap_run_cycles = rdtsc() - start;
+
+    uint64_t ops = BENCH_ROUNDS * BENCH_BATCH * 2;
+    terminal_write_dec(percent);
+    terminal_write("%\t");
+    terminal_write_dec(legacy_cycles / ops);
+    terminal_write("\t");
+    terminal_write_dec(hbitmap_cycles / ops);
+    terminal_write("\t");
+    terminal_write_dec(legacy_run_cycles / BENCH_RUN_ROUNDS);
+    terminal_write("\t");
+    terminal_write_dec(hbitmap_run_cycles / BENCH_RUN_ROUNDS);
+    terminal_write("\n");
+}
+
+static void bench_bitmap(void) {
+    uint64_t legacy_pages = BENCH_BITMAP_PAGES / 8 / PAGE_SIZE;
+    uint64_t bm_pages = (hbitmap_storage_size(BENCH_BITMAP_PAGES) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t legacy_phys = alloc_contig_pages(legacy_pages);
+    if (!legacy_phys) {
+        return;
+    }
+    uint64_t bm_phys = alloc_contig_pages(bm_pages);
+    if (!bm_phys) {
+        free_contig_pages(legacy_phys, legacy_pages);
+        return;
+    }
+
+    struct hbitmap bm;
+    uint8_t *legacy = (uint8_t *)phys_to_virt(legacy_phys);
+    void *bm_storage = phys_to_virt(bm_phys);
+
+    terminal_write("Page bitmap: ");
+    terminal_write_dec(BENCH_BITMAP_PAGES);
+    terminal_write(" pages, cycles per operation\n");
+    terminal_write("used\tscan\thbitmap\tscan16\thbitmap16\n");
+
+    bench_bitmap_occupancy(legacy, &bm, bm_storage, 10);
+    bench_bitmap_occupancy(legacy, &bm, bm_storage, 50);
+    bench_bitmap_occupancy(legacy, &bm, bm_storage, 99);
+
+    free_contig_pages(bm_phys, bm_pages);
+    free_contig_pages(legacy_phys, legacy_pages);
+}
+
+// the byte loop memcpy() was before; the empty asm keeps GCC from turning
+// it back into a memcpy() call
+static void byte_copy(uint8_t *dest, const uint8_t *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dest[i] = src[i];
+        asm volatile("" : : : "memory");
+    }
+}
+
+static void write_rate(uint64_t bytes, uint64_t cycles) {
+    uint64_t centi_gbps = cycles ? bytes * ktime_tsc_hz() / cycles / 10000000 : 0;
+    terminal_write_dec(centi_gbps / 100);
+    terminal_write(centi_gbps % 100 < 10 ? ".0" : ".");
+    terminal_write_dec(centi_gbps % 100);
+}
+
+static void bench_mem(void) {
+    uint64_t pages = BENCH_MEM_MAX / PAGE_SIZE;
+    uint64_t src_phys = alloc_contig_pages(pages);
+    if (!src_phys) {
+        return;
+    }
+    uint64_t dest_phys = alloc_contig_pages(pages);
+    if (!dest_phys) {
+        free_contig_pages(src_phys, pages);
+        return;
+    }
+
+    uint8_t *src = (uint8_t *)phys_to_virt(src_phys);
+    uint8_t *dest = (uint8_t *)phys_to_virt(dest_phys);
+    memset(src, 0x5A, BENCH_MEM_MAX);
+
+    terminal_write("Memory bandwidth in GB/s (TSC ");
+    terminal_write_dec(ktime_tsc_hz() / 1000000);
+    terminal_write(" MHz)\n");
+    terminal_write("size\tbytes\tmemcpy\tmemmove\tmemset\n");
+
+    for (uint64_t size = 16; size <= BENCH_MEM_MAX; size *= 4) {
+        uint64_t iters = BENCH_MEM_BYTES / size;
+        uint64_t bytes = iters * size;
+
+        uint64_t start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            byte_copy(dest, src, size);
+        }
+        uint64_t byte_cycles = rdtsc() - start;
+
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            memcpy(dest, src, size);
+        }
+        uint64_t copy_cycles = rdtsc() - start;
+
+        // overlapping by one byte forces the backward path
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            memmove(dest + 1, dest, size - 1);
+        }
+        uint64_t move_cycles = rdtsc() - start;
+
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            memset(dest, (int)i, size);
+        }
+        uint64_t set_cycles = rdtsc() - start;
+
+        if (size >= 1024 * 1024) {
+            terminal_write_dec(size >> 20);
+            terminal_write("M\t");
+        } else if (size >= 1024) {
+            terminal_write_dec(size >> 10);
+            terminal_write("K\t");
+        } else {
+            terminal_write_dec(size);
+            terminal_write("\t");
+        }
+        write_rate(bytes, byte_cycles);
+        terminal_write("\t");
+        write_rate(bytes, copy_cycles);
+        terminal_write("\t");
+        write_rate(bytes, move_cycles);
+        terminal_write("\t");
+        write_rate(bytes, set_cycles);
+        terminal_write("\n");
+    }
+
+    free_contig_pages(dest_phys, pages);
+    free_contig_pages(src_phys, pages);
+}
+
+// results are stored here so the scans are not optimized away
+static volatile size_t bench_sink;
+
+static size_t scalar_find_nonzero(const uint64_t *words, size_t count) {
+    size_t i = 0;
+    while (i < count && !words[i]) {
+        i++;
+    }
+    return i;
+}
+
+static void bench_simd(void) {
+    uint64_t pages = BENCH_MEM_MAX / PAGE_SIZE;
+    uint64_t src_phys = alloc_contig_pages(pages);
+    if (!src_phys) {
+        return;
+    }
+    uint64_t dest_phys = alloc_contig_pages(pages);
+    if (!dest_phys) {
+        free_contig_pages(src_phys, pages);
+        return;
+    }
+
+    uint8_t *src = (uint8_t *)phys_to_virt(src_phys);
+    uint8_t *dest = (uint8_t *)phys_to_virt(dest_phys);
+    bool avx2 = fpu_has_avx2();
+    memset(src, 0x5A, BENCH_MEM_MAX);
+
+    terminal_write("Scalar vs vector in GB/s");
+    terminal_write(avx2 ? "\n" : " (no AVX2)\n");
+    terminal_write("size\tmemcpy\tsse2\tavx2\tmemset\tsse2\tavx2\n");
+
+    for (uint64_t size = 4096; size <= BENCH_MEM_MAX; size *= 16) {
+        uint64_t iters = BENCH_MEM_BYTES / size;
+        uint64_t bytes = iters * size;
+        uint64_t cycles[6] = {0};
+
+        uint64_t start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            memcpy(dest, src, size);
+        }
+        cycles[0] = rdtsc() - start;
+
+        kernel_fpu_begin();
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            simd_copy_sse2(dest, src, size);
+        }
+        cycles[1] = rdtsc() - start;
+
+        if (avx2) {
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) {
+                simd_copy_avx2(dest, src, size);
+            }
+            cycles[2] = rdtsc() - start;
+        }
+        kernel_fpu_end();
+
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            memset(dest, (int)i, size);
+        }
+        cycles[3] = rdtsc() - start;
+
+        kernel_fpu_begin();
+        start = rdtsc();
+        for (uint64_t i = 0; i < iters; i++) {
+            simd_fill_sse2(dest, (uint32_t)i, size);
+        }
+        cycles[4] = rdtsc() - start;
+
+        if (avx2) {
+            start = rdtsc();
+            for (uint64_t i = 0; i < iters; i++) {
+                simd_fill_avx2(dest, (uint32_t)i, size);
+            }
+            cycles[5] = rdtsc() - start;
+        }
+        kernel_fpu_end();
+
+        if (size >= 1024 * 1024) {
+            terminal_write_dec(size >> 20);
+            terminal_write("M");
+        } else {
+            terminal_write_dec(size >> 10);
+            terminal_write("K");
+        }
+        for (int i = 0; i < 6; i++) {
+            terminal_write("\t");
+            write_rate(bytes, cycles[i]);
+        }
+        terminal_write("\n");
+    }
+
+    // a bitmap with only its last word set, as a worst case free-page scan
+    uint64_t *words = (uint64_t *)dest;
+    size_t count = BENCH_BITMAP_PAGES / 64;
+    memset(words, 0, count * sizeof(uint64_t));
+    words[count - 1] = 1;
+
+    uint64_t start = rdtsc();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        bench_sink = scalar_find_nonzero(words, count);
+    }
+    uint64_t scalar_cycles = rdtsc() - start;
+
+    kernel_fpu_begin();
+    start = rdtsc();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        bench_sink = simd_find_nonzero_sse2(words, count);
+    }
+    uint64_t sse2_cycles = rdtsc() - start;
+
+    uint64_t avx2_cycles = 0;
+    if (avx2) {
+        start = rdtsc();
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            bench_sink = simd_find_nonzero_avx2(words, count);
+        }
+        avx2_cycles = rdtsc() - start;
+    }
+    kernel_fpu_end();
+
+    terminal_write("Bitmap scan of ");
+    terminal_write_dec(BENCH_BITMAP_PAGES);
+    terminal_write(" bits, cycles: scalar ");
+    terminal_write_dec(scalar_cycles / BENCH_ROUNDS);
+    terminal_write(", sse2 ");
+    terminal_write_dec(sse2_cycles / BENCH_ROUNDS);
+    terminal_write(", avx2 ");
+    terminal_write_dec(avx2_cycles / BENCH_ROUNDS);
+    terminal_write("\n");
+
+    free_contig_pages(dest_phys, pages);
+    free_contig_pages(src_phys, pages);
+}
+
+#define BENCH_CLOCK_READS 1000
+
+enum clock_source {
+    CLOCK_TSC,
+    CLOCK_HPET,
+    CLOCK_PIT,
+};
+
+static uint64_t read_clock(enum clock_source source) {
+    switch (source) {
+    case CLOCK_TSC:
+        return rdtsc();
+    case CLOCK_HPET:
+        return hpet_read_counter();
+    case CLOCK_PIT: {
+        // latch channel 0, then read the count low byte first
+        outb(CMD_PORT, 0x00);
+        uint8_t lo = inb(DATA_PORT_0);
+        uint8_t hi = inb(DATA_PORT_0);
+        return ((uint64_t)hi << 8) | lo;
+    }
+    }
+    return 0;
+}
+
+// cost of one read in TSC cycles; the spread between min and max is the
+// jitter a caller sees when timestamping with that source
+static void bench_clock_source(const char *name, enum clock_source source) {
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    uint64_t total = 0;
+
+    uint64_t flags = irq_save();
+    for (int i = 0; i < BENCH_CLOCK_READS; i++) {
+        uint64_t start = rdtsc();
+        bench_sink = read_clock(source);
+        uint64_t cycles = rdtsc() - start;
+
+        total += cycles;
+        if (cycles < min) {
+            min = cycles;
+        }
+        if (cycles > max) {
+            max = cycles;
+        }
+    }
+    irq_restore(flags);
+
+    terminal_write(name);
+    terminal_write("\t");
+    terminal_write_dec(min);
+    terminal_write("\t");
+    terminal_write_dec(total / BENCH_CLOCK_READS);
+    terminal_write("\t");
+    terminal_write_dec(max);
+    terminal_write("\t");
+    terminal_write_dec(cycles_to_ns(total / BENCH_CLOCK_READS));
+    terminal_write("\n");
+}
+
+static void bench_clock(void) {
+    terminal_write("Clock read cost in TSC cycles over ");
+    terminal_write_dec(BENCH_CLOCK_READS);
+    terminal_write(" reads\n");
+    terminal_write("source\tmin\tavg\tmax\tavg ns\n");
+
+    bench_clock_source("tsc", CLOCK_TSC);
+    if (hpet_available()) {
+        bench_clock_source("hpet", CLOCK_HPET);
+    } else {
+        terminal_write("hpet\tnot present\n");
+    }
+    bench_clock_source("pit", CLOCK_PIT);
+}
+
+#define BENCH_SCHED_NS      1000000000ULL
+#define BENCH_SCHED_THREADS 16
+
+struct sched_bench_thread {
+    volatile bool *stop;
+    volatile uint32_t *running;
+    uint64_t iterations;
+    uint64_t cpus_seen;
+};
+
+static void sched_bench_worker(void *arg) {
+    struct sched_bench_thread *worker = arg;
+    while (!*worker->stop) {
+        worker->iterations++;
+        worker->cpus_seen |= 1ULL << smp_processor_id();
+    }
+    __atomic_sub_fetch(worker->running, 1, __ATOMIC_RELEASE);
+}
+
+// Two CPU-bound threads per CPU, half at a higher priority, all started on
+// this CPU: stealing has to spread them and the weights should show in
+// each thread's share of the work done.
+static void bench_sched(void) {
+    uint32_t count = smp_cpu_count() * 2;
+    if (count > BENCH_SCHED_THREADS) {
+        count = BENCH_SCHED_THREADS;
+    }
+
+    static struct sched_bench_thread workers[BENCH_SCHED_THREADS];
+    volatile bool stop = false;
+    volatile uint32_t running = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        workers[i].stop = &stop;
+        workers[i].running = &running;
+        workers[i].iterations = 0;
+        workers[i].cpus_seen = 0;
+
+        uint32_t priority = (i & 1) ? SCHED_PRIO_DEFAULT + 2 : SCHED_PRIO_DEFAULT;
+        __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+        if (!thread_create("bench", sched_bench_worker, &workers[i], priority, SCHED_ANY_CPU)) {
+            __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+            count = i;
+            break;
+        }
+    }
+
+    thread_sleep_ns(BENCH_SCHED_NS);
+    stop = true;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        thread_sleep_ns(1000000);
+    }
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        total += workers[i].iterations;
+    }
+
+    terminal_write("Scheduler: ");
+    terminal_write_dec(count);
+    terminal_write(" threads on ");
+    terminal_write_dec(smp_cpu_count());
+    terminal_write(" CPUs for ");
+    terminal_write_dec(BENCH_SCHED_NS / 1000000);
+    terminal_write(" ms\n");
+    terminal_write("thread\tprio\tshare%\tcpus\n");
+    for (uint32_t i = 0; i < count; i++) {
+        terminal_write_dec(i);
+        terminal_write("\t");
+        terminal_write_dec((i & 1) ? SCHED_PRIO_DEFAULT + 2 : SCHED_PRIO_DEFAULT);
+        terminal_write("\t");
+        terminal_write_dec(total ? workers[i].iterations * 100 / total : 0);
+        terminal_write("\t");
+        terminal_write_hex(workers[i].cpus_seen);
+        terminal_write("\n");
+    }
+}
+
+#define BENCH_FAULT_PAGES 1024
+
+// Demand paging on a fresh arena region: a read of each page maps the
+// shared zero page, a write then swaps in a private one, and vmm_free
+// tears it all down. Every figure is per page.
+static void bench_fault(void) {
+    volatile uint8_t *region = vmm_alloc(&kernel_space, BENCH_FAULT_PAGES * PAGE_SIZE, VMA_READ | VMA_WRITE);
+    if (!region) {
+        terminal_write("bench fault: vmm_alloc failed\n");
+        return;
+    }
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FAULT_PAGES; i++) {
+        bench_sink = region[i * PAGE_SIZE];
+    }
+    uint64_t read_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < BENCH_FAULT_PAGES; i++) {
+        region[i * PAGE_SIZE] = 1;
+    }
+    uint64_t write_cycles = rdtsc() - start;
+
+    start = rdtsc();
+    vmm_free(&kernel_space, (void *)region);
+    uint64_t free_cycles = rdtsc() - start;
+
+    terminal_write("Demand paging over ");
+    terminal_write_dec(BENCH_FAULT_PAGES);
+    terminal_write(" pages, ns per page\n");
+    terminal_write("zero map\tcopy\tfree\n");
+    terminal_write_dec(cycles_to_ns(read_cycles / BENCH_FAULT_PAGES));
+    terminal_write("\t\t");
+    terminal_write_dec(cycles_to_ns(write_cycles / BENCH_FAULT_PAGES));
+    terminal_write("\t");
+    terminal_write_dec(cycles_to_ns(free_cycles / BENCH_FAULT_PAGES));
+    terminal_write("\n");
+}
+
+void bench_run(const char *args) {
+    char name[32];
+    getfirststr(args, name, sizeof(name));
+
+    if (strcmp(name, "bitmap")) {
+        bench_bitmap();
+    } else if (strcmp(name, "mem")) {
+        bench_mem();
+    } else if (strcmp(name, "simd")) {
+        bench_simd();
+    } else if (strcmp(name, "clock")) {
+        bench_clock();
+    } else if (strcmp(name, "sched")) {
+        bench_sched();
+    } else if (strcmp(name, "fault")) {
+        bench_fault();
+    } else {
+        terminal_write("Usage: bench <bitmap|mem|simd|clock|sched|fault>\n");
+    }
+}
@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "hbitmap.h"
+#include "buddy.h"
+
+// Free blocks are indexed by one hierarchical bitmap per order: bit i of
+// free_maps[k] is set when the block of 2^k pages starting at page i << k
+// is free. Allocation takes the lowest free block with a few ctz lookups,
+// and the buddy of a block is checked with a single bit test when
+// coalescing. The bitmaps take roughly two bits per physical page and are
+// placed by the caller, sized from the memory map.
+
+static struct hbitmap free_maps[BUDDY_MAX_ORDER + 1];
+static uint64_t free_counts[BUDDY_MAX_ORDER + 1];
+static uint64_t buddy_max_pfn = 0;
+
+static inline uint64_t blocks_for(uint64_t max_pfn, unsigned int order) {
+    return (max_pfn + (1ULL << order) - 1) >> order;
+}
+
+static inline void mark_free(unsigned int order, uint64_t pfn) {
+    hbitmap_set(&free_maps[order], pfn >> order);
+    free_counts[order]++;
+}
+
+static inline void mark_used(unsigned int order, uint64_t pfn) {
+    hbitmap_clear(&free_maps[order], pfn >> order);
+    free_counts[order]--;
+}
+
+size_t buddy_metadata_size(uint64_t max_pfn) {
+    size_t size = 0;
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size += hbitmap_storage_size(blocks_for(max_pfn, order));
+    }
+    return size;
+}
+
+void buddy_init(void *metadata, uint64_t max_pfn) {
+    uint8_t *storage = (uint8_t *)metadata;
+    buddy_max_pfn = max_pfn;
+
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        uint64_t blocks = blocks_for(max_pfn, order);
+        hbitmap_init(&free_maps[order], storage, blocks);
+        storage += hbitmap_storage_size(blocks);
+        free_counts[order] = 0;
+    }
+}
+
+void buddy_add_range(uint64_t pfn, uint64_t count) {
+    if (pfn >= buddy_max_pfn) {
+        return;
+    }
+    if (count > buddy_max_pfn - pfn) {
+        count = buddy_max_pfn - pfn;
+    }
+
+    // carve the range into the largest naturally aligned blocks that fit
+    while (count > 0) {
+        unsigned int order = BUDDY_MAX_ORDER;
+        while (order > 0 && ((pfn & ((1ULL << order) - 1)) || (1ULL << order) > count)) {
+            order--;
+        }
+
+        buddy_free(pfn, order);
+        pfn += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+uint64_t buddy_alloc(unsigned int order) {
+    if (order > BUDDY_MAX_ORDER) {
+        return BUDDY_NONE;
+    }
+
+    unsigned int current = order;
+    uint64_t block = HBITMAP_NONE;
+    while (current <= BUDDY_MAX_ORDER) {
+        block = hbitmap_find_first(&free_maps[current]);
+        if (block != HBITMAP_NONE) {
+            break;
+        }
+        current++;
+    }
+    if (block == HBITMAP_NONE) {
+        return BUDDY_NONE;
+    }
+
+    uint64_t pfn = block << current;
+    mark_used(current, pfn);
+
+    // split down, handing the upper halves back to the smaller orders
+    while (current > order) {
+        current--;
+        mark_free(current, pfn + (1ULL << current));
+    }
+
+    return pfn;
+}
+
+void buddy_free(uint64_t pfn, unsigned int order) {
+    if (pfn >= buddy_max_pfn || order > BUDDY_MAX_ORDER) {
+        return;
+    }
+
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if (!hbitmap_test(&free_maps[order], buddy >> order)) {
+            break;
+        }
+
+        mark_used(order, buddy);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+
+    mark_free(order, pfn);
+}
+
+uint64_t buddy_alloc_contig(uint64_t count) {
+    if (count == 0) {
+        return BUDDY_NONE;
+    }
+
+    uint64_t pfn;
+    uint64_t taken;
+
+    if (count <= (1ULL << BUDDY_MAX_ORDER)) {
+        unsigned int order = 0;
+        while ((1ULL << order) < count) {
+            order++;
+        }
+
+        pfn = buddy_alloc(order);
+        if (pfn == BUDDY_NONE) {
+            return BUDDY_NONE;
+        }
+        taken = 1ULL << order;
+    } else {
+        // larger runs are consecutive free max-order blocks
+        uint64_t blocks = (count + (1ULL << BUDDY_MAX_ORDER) - 1) >> BUDDY_MAX_ORDER;
+        uint64_t first = hbitmap_find_run(&free_maps[BUDDY_MAX_ORDER], blocks);
+        if (first == HBITMAP_NONE) {
+            return BUDDY_NONE;
+        }
+
+        pfn = first << BUDDY_MAX_ORDER;
+        for (uint64_t i = 0; i < blocks; i++) {
+            mark_used(BUDDY_MAX_ORDER, pfn + (i << BUDDY_MAX_ORDER));
+        }
+        taken = blocks << BUDDY_MAX_ORDER;
+    }
+
+    // give back the tail beyond what was asked for
+    buddy_add_range(pfn + count, taken - count);
+    return pfn;
+}
+
+void buddy_free_contig(uint64_t pfn, uint64_t count) {
+    buddy_add_range(pfn, count);
+}
+
+uint64_t buddy_free_blocks(unsigned int order) {
+    if (order > BUDDY_MAX_ORDER) {
+        return 0;
+    }
+    return free_counts[order];
+}
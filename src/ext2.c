@@ -1,34 +1,324 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #include "ata.h"
 #include "terminal.h"
 #include "ext2.h"
 #include "memory.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "rcu.h"
+
+#define EXT2_BLOCK_BUFFER_SIZE 1024
+
+// powers of two, so a bucket is a mask away
+#define ICACHE_BUCKETS 64
+#define DCACHE_BUCKETS 64
+
+// The superblock and group descriptors as one read-only snapshot. Writers
+// copy it, change the copy, write that to disk and publish it; readers
+// use whichever snapshot they find inside an RCU read section. Writers
+// hold ext2_lock, so they may also read fs directly.
+struct ext2_fs {
+    struct rcu_head rcu;
+    struct ext2_superblock sb;
+    uint32_t bgdt_count;
+    // the table is kept in whole 1 KiB blocks so it can be written back as is
+    uint32_t bgdt_size;
+    struct ext2_group_descriptor bgdt[];
+};
+
+// all zeroes until the superblock is parsed, like the static it replaces
+static struct ext2_fs fs_unmounted;
+static struct ext2_fs *fs = &fs_unmounted;
+
+// Inodes and directory entries read from disk, for lookups that take no
+// lock. Entries are never changed in place: an update links in a new
+// entry and frees the old one after a grace period.
+struct icache_entry {
+    struct rcu_head rcu;
+    struct icache_entry *next;
+    uint32_t number;
+    struct ext2_inode inode;
+};
+
+struct dcache_entry {
+    struct rcu_head rcu;
+    struct dcache_entry *next;
+    uint32_t parent;
+    uint32_t inode;
+    uint8_t name_length;
+    char name[255];
+};
+
+static struct icache_entry *icache[ICACHE_BUCKETS];
+static struct dcache_entry *dcache[DCACHE_BUCKETS];
+static struct spinlock icache_lock = SPINLOCK_INIT("ext2_icache");
+static struct spinlock dcache_lock = SPINLOCK_INIT("ext2_dcache");
+
+// scratch inode for the update paths
+static struct ext2_inode inode;
+
+// Serialises updates: allocation, the bitmaps, and publishing new
+// metadata snapshots. The helpers below the update entry points assume
+// it is held. Reads of files and directories do not take it. A mutex, so
+// disk waits under it can sleep.
+static struct mutex ext2_lock = MUTEX_INIT("ext2");
+
+static struct kmem_cache *inode_cache = NULL;
+static struct kmem_cache *dentry_cache = NULL;
+static struct kmem_cache *block_cache = NULL;
+static struct kmem_cache *icache_cache = NULL;
+static struct kmem_cache *dcache_cache = NULL;
+
+void ext2_init_caches(void) {
+    inode_cache = kmem_cache_create("ext2-inode", sizeof(struct ext2_inode));
+    dentry_cache = kmem_cache_create("ext2-dentry", sizeof(struct ext2_directory_entry));
+    block_cache = kmem_cache_create("ext2-block", EXT2_BLOCK_BUFFER_SIZE);
+    icache_cache = kmem_cache_create("ext2-icache", sizeof(struct icache_entry));
+    dcache_cache = kmem_cache_create("ext2-dcache", sizeof(struct dcache_entry));
+}
 
-void read_inode(uint32_t inode_number) {
+static uint32_t ext2_block_size(void) {
+    rcu_read_lock();
+    uint32_t block_size_bytes = 1024 << rcu_dereference(fs)->sb.block_size;
+    rcu_read_unlock();
+    return block_size_bytes;
+}
 
-    uint32_t block_group = find_block_group_from_inode(inode_number);
-    
+static uint32_t ext2_inodes_per_group(void) {
+    rcu_read_lock();
+    uint32_t inodes_per_group = rcu_dereference(fs)->sb.inodes_per_group;
+    rcu_read_unlock();
+    return inodes_per_group;
+}
+
+static uint32_t ext2_blocks_per_group(void) {
+    rcu_read_lock();
+    uint32_t blocks_per_group = rcu_dereference(fs)->sb.blocks_per_group;
+    rcu_read_unlock();
+    return blocks_per_group;
+}
+
+// a copy, since the snapshot may be freed once the read section ends
+static struct ext2_group_descriptor ext2_group(uint32_t group_number) {
+    struct ext2_group_descriptor group = { 0 };
+    rcu_read_lock();
+    struct ext2_fs *snapshot = rcu_dereference(fs);
+    if (group_number < snapshot->bgdt_count) {
+        group = snapshot->bgdt[group_number];
+    }
+    rcu_read_unlock();
+    return group;
+}
+
+static void fs_free_rcu(struct rcu_head *head) {
+    kfree((struct ext2_fs *)head);
+}
+
+// caller holds ext2_lock, so fs is the latest snapshot and stays so
+static struct ext2_fs *fs_copy(uint32_t bgdt_size) {
+    struct ext2_fs *copy = kmalloc(sizeof(struct ext2_fs) + bgdt_size);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, fs, sizeof(struct ext2_fs) + (fs->bgdt_size < bgdt_size ? fs->bgdt_size : bgdt_size));
+    return copy;
+}
+
+static void fs_publish(struct ext2_fs *snapshot) {
+    struct ext2_fs *old = fs;
+    rcu_assign_pointer(fs, snapshot);
+    if (old != &fs_unmounted) {
+        call_rcu(&old->rcu, fs_free_rcu);
+    }
+}
+
+static void icache_free_rcu(struct rcu_head *head) {
+    kmem_cache_free(icache_cache, (struct icache_entry *)head);
+}
+
+static void dcache_free_rcu(struct rcu_head *head) {
+    kmem_cache_free(dcache_cache, (struct dcache_entry *)head);
+}
+
+static bool icache_lookup(uint32_t inode_number, struct ext2_inode *out) {
+    bool found = false;
+    rcu_read_lock();
+    struct icache_entry *entry = rcu_dereference(icache[inode_number & (ICACHE_BUCKETS - 1)]);
+    for (; entry; entry = rcu_dereference(entry->next)) {
+        if (entry->number == inode_number) {
+            *out = entry->inode;
+            found = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return found;
+}
+
+// Readers filling a miss pass replace = false and lose to anything already
+// cached, which an update may have put there while they read the disk.
+// Updates pass true, and drop the old entry even if no new one fits.
+static void icache_insert(uint32_t inode_number, const struct ext2_inode *value, bool replace) {
+    struct icache_entry *entry = kmem_cache_alloc(icache_cache);
+    if (entry) {
+        entry->number = inode_number;
+        entry->inode = *value;
+    }
+
+    struct icache_entry **link = &icache[inode_number & (ICACHE_BUCKETS - 1)];
+    spin_lock(&icache_lock);
+    while (*link && (*link)->number != inode_number) {
+        link = &(*link)->next;
+    }
+    struct icache_entry *old = *link;
+    if (old && !replace) {
+        spin_unlock(&icache_lock);
+        kmem_cache_free(icache_cache, entry);
+        return;
+    }
+    if (entry) {
+        entry->next = old ? old->next : NULL;
+        rcu_assign_pointer(*link, entry);
+    } else if (old) {
+        rcu_assign_pointer(*link, old->next);
+    }
+    spin_unlock(&icache_lock);
+
+    if (old) {
+        call_rcu(&old->rcu, icache_free_rcu);
+    }
+}
+
+static uint32_t dcache_hash(uint32_t parent, const char *name, uint8_t name_length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ parent;
+    for (uint8_t i = 0; i < name_length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash & (DCACHE_BUCKETS - 1);
+}
+
+static bool dcache_match(const struct dcache_entry *entry, uint32_t parent, const char *name, uint8_t name_length) {
+    return entry->parent == parent && entry->name_length == name_length && !memcmp(entry->name, name, name_length);
+}
+
+static uint32_t dcache_lookup(uint32_t parent, const char *name, uint8_t name_length) {
+    uint32_t inode_number = 0;
+    rcu_read_lock();
+    struct dcache_entry *entry = rcu_dereference(dcache[dcache_hash(parent, name, name_length)]);
+    for (; entry; entry = rcu_dereference(entry->next)) {
+        if (dcache_match(entry, parent, name, name_length)) {
+            inode_number = entry->inode;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return inode_number;
+}
+
+// same replace rule as icache_insert()
+static void dcache_insert(uint32_t parent, const char *name, uint8_t name_length, uint32_t inode_number, bool replace) {
+    struct dcache_entry *entry = kmem_cache_alloc(dcache_cache);
+    if (entry) {
+        entry->parent = parent;
+        entry->inode = inode_number;
+        entry->name_length = name_length;
+        memcpy(entry->name, name, name_length);
+    }
+
+    struct dcache_entry **link = &dcache[dcache_hash(parent, name, name_length)];
+    spin_lock(&dcache_lock);
+    while (*link && !dcache_match(*link, parent, name, name_length)) {
+        link = &(*link)->next;
+    }
+    struct dcache_entry *old = *link;
+    if (old && !replace) {
+        spin_unlock(&dcache_lock);
+        kmem_cache_free(dcache_cache, entry);
+        return;
+    }
+    if (entry) {
+        entry->next = old ? old->next : NULL;
+        rcu_assign_pointer(*link, entry);
+    } else if (old) {
+        rcu_assign_pointer(*link, old->next);
+    }
+    spin_unlock(&dcache_lock);
+
+    if (old) {
+        call_rcu(&old->rcu, dcache_free_rcu);
+    }
+}
+
+// drop every name for a deleted inode
+static void dcache_forget_inode(uint32_t inode_number) {
+    spin_lock(&dcache_lock);
+    for (uint32_t bucket = 0; bucket < DCACHE_BUCKETS; bucket++) {
+        struct dcache_entry **link = &dcache[bucket];
+        while (*link) {
+            struct dcache_entry *entry = *link;
+            if (entry->inode == inode_number) {
+                rcu_assign_pointer(*link, entry->next);
+                call_rcu(&entry->rcu, dcache_free_rcu);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    spin_unlock(&dcache_lock);
+}
+
+// sector of the 1 KiB block holding an inode, and the inode's offset in it
+static uint32_t inode_location(uint32_t inode_number, uint32_t *inode_offset_in_block) {
+    rcu_read_lock();
+    struct ext2_fs *snapshot = rcu_dereference(fs);
+
+    uint32_t block_group = (inode_number - 1) / snapshot->sb.inodes_per_group;
+
+    uint32_t index_in_group = inode_number % snapshot->sb.inodes_per_group;
+
+    uint32_t inode_table_block = block_group < snapshot->bgdt_count ? snapshot->bgdt[block_group].inode_table : 0;
+
+    uint32_t block_size_bytes = 1024 << snapshot->sb.block_size;
+    rcu_read_unlock();
 
-    uint32_t index_in_group = inode_number % sb.inodes_per_group;
-    
-    uint32_t inode_table_block = bgdt[block_group].inode_table;
-    
-    uint32_t block_size_bytes = 1024 << sb.block_size;
     uint32_t inode_size = 128;
     uint32_t inodes_per_block = block_size_bytes / inode_size;
     uint32_t block_offset = index_in_group / inodes_per_block;
-    uint32_t inode_offset_in_block = (index_in_group % inodes_per_block) * inode_size;
-    
+    *inode_offset_in_block = (index_in_group % inodes_per_block) * inode_size;
+
     uint32_t target_block = inode_table_block + block_offset;
-    
+
     uint32_t sectors_per_block = block_size_bytes / 512;
-    uint32_t sector = target_block * sectors_per_block;
-    
-    uint8_t buffer[1024];
+    return target_block * sectors_per_block;
+}
+
+// from the inode cache, or the disk on a miss; false if out of memory
+static bool get_inode(uint32_t inode_number, struct ext2_inode *out) {
+    if (icache_lookup(inode_number, out)) {
+        return true;
+    }
+
+    uint32_t inode_offset_in_block;
+    uint32_t sector = inode_location(inode_number, &inode_offset_in_block);
+
+    uint8_t *buffer = kmem_cache_alloc(block_cache);
+    if (!buffer) return false;
     read(sector, 1024, buffer);
-    
-    memcpy(&inode, buffer + inode_offset_in_block, sizeof(struct ext2_inode));
+
+    memcpy(out, buffer + inode_offset_in_block, sizeof(struct ext2_inode));
+    kmem_cache_free(block_cache, buffer);
+
+    icache_insert(inode_number, out, false);
+    return true;
+}
+
+void read_inode(uint32_t inode_number) {
+    if (!get_inode(inode_number, &inode)) return;
 
     /*
     
@@ -118,53 +408,70 @@ void read_inode(uint32_t inode_number) {
     */
 }
 
-void create_file(uint32_t parent_inode, const char *filename) {
+static void do_create_file(uint32_t parent_inode, const char *filename) {
     uint32_t group_number = find_block_group_from_inode(parent_inode);
     
     uint32_t free_inode = find_free_inode(group_number);
     
     update_inode_bitmap(group_number, free_inode, 1);
     
-    struct ext2_inode new_inode = {0};
-    new_inode.type_and_permissions = 0x81A4; // Regular file with permissions 0644 (rw-r--r--)
-    new_inode.uid = 0;
-    new_inode.gid = 0;
-    new_inode.size_low = 0;          // Empty file
-    new_inode.sectors_count = 0;     // No sectors allocated
-    new_inode.links_count = 1;
-    new_inode.flags = 0;
+    struct ext2_inode *new_inode = kmem_cache_alloc(inode_cache);
+    struct ext2_directory_entry *new_entry = kmem_cache_alloc(dentry_cache);
+    if (!new_inode || !new_entry) {
+        kmem_cache_free(inode_cache, new_inode);
+        kmem_cache_free(dentry_cache, new_entry);
+        return;
+    }
+    
+    memset(new_inode, 0, sizeof(struct ext2_inode));
+    new_inode->type_and_permissions = 0x81A4; // Regular file with permissions 0644 (rw-r--r--)
+    new_inode->uid = 0;
+    new_inode->gid = 0;
+    new_inode->size_low = 0;          // Empty file
+    new_inode->sectors_count = 0;     // No sectors allocated
+    new_inode->links_count = 1;
+    new_inode->flags = 0;
 
-    edit_inode_table(free_inode, &new_inode);
+    edit_inode_table(free_inode, new_inode);
     
-    struct ext2_directory_entry new_entry = {0};
-    new_entry.inode = free_inode;
+    memset(new_entry, 0, sizeof(struct ext2_directory_entry));
+    new_entry->inode = free_inode;
     uint8_t name_len = 0;
     while (filename[name_len] != '\0' && name_len < 255) {
         name_len++;
     }
-    new_entry.name_length = name_len;
-    new_entry.type = 1;
+    new_entry->name_length = name_len;
+    new_entry->type = 1;
 
-    memcpy(new_entry.name, filename, name_len);
+    memcpy(new_entry->name, filename, name_len);
     
-    new_entry.size = 0;
+    new_entry->size = 0;
     
-    add_directory_entry(parent_inode, &new_entry);
+    add_directory_entry(parent_inode, new_entry);
+    dcache_insert(parent_inode, new_entry->name, name_len, free_inode, true);
 
+    kmem_cache_free(dentry_cache, new_entry);
+    kmem_cache_free(inode_cache, new_inode);
 }
 
-void delete_file(uint32_t inode_number) {
+static void do_delete_file(uint32_t inode_number) {
     read_inode(inode_number);
     
     uint32_t block_group = find_block_group_from_inode(inode_number);
     
     update_inode_bitmap(block_group, inode_number, 0);
     
-    struct ext2_inode empty_inode = {0};
-    edit_inode_table(inode_number, &empty_inode);
+    struct ext2_inode *empty_inode = kmem_cache_alloc(inode_cache);
+    if (!empty_inode) return;
+    
+    memset(empty_inode, 0, sizeof(struct ext2_inode));
+    edit_inode_table(inode_number, empty_inode);
+    kmem_cache_free(inode_cache, empty_inode);
+
+    dcache_forget_inode(inode_number);
 }
 
-void write_file(uint32_t inode_number, const char* data) {
+static void do_write_file(uint32_t inode_number, const char* data) {
     uint32_t data_len = 0;
     while (data[data_len] != '\0') {
         data_len++;
@@ -182,7 +489,7 @@ void write_file(uint32_t inode_number, const char* data) {
         return;
     }
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
     uint32_t blocks_needed = (data_len + block_size_bytes - 1) / block_size_bytes;
     
@@ -194,6 +501,9 @@ void write_file(uint32_t inode_number, const char* data) {
     uint32_t group_number = find_block_group_from_inode(inode_number);
     uint32_t data_offset = 0;
     
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return;
+    
     for (uint32_t block_idx = 0; block_idx < blocks_needed; block_idx++) {
         uint32_t block_num;
         
@@ -205,8 +515,6 @@ void write_file(uint32_t inode_number, const char* data) {
             block_num = inode.block[block_idx];
         }
         
-        uint8_t block_buffer[1024];
-        
         uint32_t bytes_to_write = data_len - data_offset;
         if (bytes_to_write > block_size_bytes) {
             bytes_to_write = block_size_bytes;
@@ -224,6 +532,8 @@ void write_file(uint32_t inode_number, const char* data) {
         data_offset += bytes_to_write;
     }
     
+    kmem_cache_free(block_cache, block_buffer);
+    
     inode.size_low = data_len;
     inode.sectors_count = blocks_needed * sectors_per_block;
     
@@ -237,16 +547,16 @@ void write_file(uint32_t inode_number, const char* data) {
 }
 
 void read_file(uint32_t inode_number, char* buffer, uint32_t max_size) {
-
-    read_inode(inode_number);
+    struct ext2_inode file;
+    if (!get_inode(inode_number, &file)) return;
     
-    uint16_t file_type = (inode.type_and_permissions >> 12) & 0xF;
+    uint16_t file_type = (file.type_and_permissions >> 12) & 0xF;
     if (file_type != 0x8) {
         terminal_write("Error: Inode is not a regular file!\n");
         return;
     }
     
-    if (inode.size_low == 0) {
+    if (file.size_low == 0) {
         terminal_write("File is empty\n");
         if (buffer != 0) {
             buffer[0] = '\0';
@@ -254,19 +564,20 @@ void read_file(uint32_t inode_number, char* buffer, uint32_t max_size) {
         return;
     }
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
-    uint8_t block_buffer[1024];
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return;
     
     uint32_t bytes_read = 0;
-    uint32_t bytes_to_read = inode.size_low;
+    uint32_t bytes_to_read = file.size_low;
     
     if (buffer != 0 && bytes_to_read > max_size) {
         bytes_to_read = max_size;
     }
     
     for (int block_idx = 0; block_idx < 12; block_idx++) {
-        uint32_t block_num = inode.block[block_idx];
+        uint32_t block_num = file.block[block_idx];
         
         if (block_num == 0) {
             break;
@@ -283,9 +594,7 @@ void read_file(uint32_t inode_number, char* buffer, uint32_t max_size) {
         if (buffer != 0) {
             memcpy(buffer + bytes_read, block_buffer, bytes_in_block);
         } else {
-            for (uint32_t i = 0; i < bytes_in_block; i++) {
-                terminal_putchar(block_buffer[i]);
-            }
+            terminal_write_len((const char *)block_buffer, bytes_in_block);
         }
         
         bytes_read += bytes_in_block;
@@ -295,6 +604,8 @@ void read_file(uint32_t inode_number, char* buffer, uint32_t max_size) {
         }
     }
     
+    kmem_cache_free(block_cache, block_buffer);
+    
     if (buffer != 0 && bytes_read < max_size) {
         buffer[bytes_read] = '\0';
     }
@@ -309,9 +620,10 @@ void read_file(uint32_t inode_number, char* buffer, uint32_t max_size) {
 }
 
 void print_file(uint32_t inode_number) {
-    read_inode(inode_number);
+    struct ext2_inode file;
+    if (!get_inode(inode_number, &file)) return;
     
-    uint16_t file_type = (inode.type_and_permissions >> 12) & 0xF;
+    uint16_t file_type = (file.type_and_permissions >> 12) & 0xF;
     if (file_type != 0x8) {
         terminal_write("Error: Inode is not a regular file!\n");
         return;
@@ -321,19 +633,20 @@ void print_file(uint32_t inode_number) {
     terminal_write_dec(inode_number);
     terminal_write(") ===\n");
     
-    if (inode.size_low == 0) {
+    if (file.size_low == 0) {
         terminal_write("[Empty file]\n");
         return;
     }
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
-    uint8_t block_buffer[1024];
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return;
     
-    uint32_t bytes_remaining = inode.size_low;
+    uint32_t bytes_remaining = file.size_low;
     
     for (int block_idx = 0; block_idx < 12 && bytes_remaining > 0; block_idx++) {
-        uint32_t block_num = inode.block[block_idx];
+        uint32_t block_num = file.block[block_idx];
         
         if (block_num == 0) {
             break;
@@ -348,13 +661,13 @@ void print_file(uint32_t inode_number) {
             bytes_to_print = block_size_bytes;
         }
         
-        for (uint32_t i = 0; i < bytes_to_print; i++) {
-            terminal_putchar(block_buffer[i]);
-        }
+        terminal_write_len((const char *)block_buffer, bytes_to_print);
         
         bytes_remaining -= bytes_to_print;
     }
     
+    kmem_cache_free(block_cache, block_buffer);
+    
     terminal_write("\n=== End of File ===\n");
 }
 
@@ -369,9 +682,10 @@ void add_directory_entry(uint32_t parent_inode, struct ext2_directory_entry *ent
         return;
     }
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
-    uint8_t block_buffer[1024];
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return;
     
     // Search through all direct blocks to find space
     for (int block_idx = 0; block_idx < 12; block_idx++) {
@@ -402,6 +716,7 @@ void add_directory_entry(uint32_t parent_inode, struct ext2_directory_entry *ent
             
             // Write back the updated inode
             edit_inode_table(parent_inode, &inode);
+            kmem_cache_free(block_cache, block_buffer);
             return;
         }
         
@@ -437,6 +752,7 @@ void add_directory_entry(uint32_t parent_inode, struct ext2_directory_entry *ent
                         edit_inode_table(parent_inode, &inode);
                     }
                     
+                    kmem_cache_free(block_cache, block_buffer);
                     return;
                 }
                 break; // Not enough space in this block
@@ -468,6 +784,7 @@ void add_directory_entry(uint32_t parent_inode, struct ext2_directory_entry *ent
 
                     write(sector, 1024, block_buffer);
                     
+                    kmem_cache_free(block_cache, block_buffer);
                     return;
                 }
             }
@@ -481,57 +798,52 @@ void add_directory_entry(uint32_t parent_inode, struct ext2_directory_entry *ent
         }
     }
     
+    kmem_cache_free(block_cache, block_buffer);
     terminal_write("Error: No space available in directory!\n");
 }
 
 void edit_inode_table(uint32_t inode_number, struct ext2_inode *new_inode) {
-    uint32_t block_group = find_block_group_from_inode(inode_number);
+    uint32_t inode_offset_in_block;
+    uint32_t sector = inode_location(inode_number, &inode_offset_in_block);
     
-    uint32_t index_in_group = inode_number % sb.inodes_per_group;
-
-    uint32_t inode_table_block = bgdt[block_group].inode_table;
-    
-    uint32_t block_size_bytes = 1024 << sb.block_size;
-    uint32_t inode_size = 128;
-    uint32_t inodes_per_block = block_size_bytes / inode_size;
-    uint32_t block_offset = index_in_group / inodes_per_block;
-    uint32_t inode_offset_in_block = (index_in_group % inodes_per_block) * inode_size;
-    
-    uint32_t target_block = inode_table_block + block_offset;
-    
-    uint32_t sectors_per_block = block_size_bytes / 512;
-    uint32_t sector = target_block * sectors_per_block;
-    
-    uint8_t buffer[1024];
+    uint8_t *buffer = kmem_cache_alloc(block_cache);
+    if (!buffer) return;
     read(sector, 1024, buffer);
     
     memcpy(buffer + inode_offset_in_block, new_inode, sizeof(struct ext2_inode));
 
     write(sector, 1024, buffer);
+    kmem_cache_free(block_cache, buffer);
+
+    // after the disk, so a reader that misses and reads the old inode
+    // cannot cache it over this one
+    icache_insert(inode_number, new_inode, true);
 }
 
 void update_blockgroup_descriptor(uint32_t group_number, uint32_t delta_inodes, uint32_t delta_blocks){
-    bgdt[group_number].free_blocks_count += delta_blocks;
-    bgdt[group_number].free_inodes_count += delta_inodes;
+    if (group_number >= fs->bgdt_count) return;
+    struct ext2_fs *snapshot = fs_copy(fs->bgdt_size);
+    if (!snapshot) return;
 
-    uint8_t buffer[1024];
+    snapshot->bgdt[group_number].free_blocks_count += delta_blocks;
+    snapshot->bgdt[group_number].free_inodes_count += delta_inodes;
 
-    memcpy(buffer, bgdt, sizeof(bgdt));
-
-    write(4, 1024, buffer);
+    write(4, snapshot->bgdt_size, (uint8_t *)snapshot->bgdt);
+    fs_publish(snapshot);
 }
 
 void update_block_bitmap(uint32_t group_number, uint32_t block_number, uint8_t new_value){
-    uint32_t block_bitmap_block_address = bgdt[group_number].block_usage_bitmap;
+    uint32_t block_bitmap_block_address = ext2_group(group_number).block_usage_bitmap;
 
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
 
-    uint8_t block_bitmap[1024];
+    uint8_t *block_bitmap = kmem_cache_alloc(block_cache);
+    if (!block_bitmap) return;
     uint32_t sector = block_bitmap_block_address * sectors_per_block;
     read(sector, 1024, block_bitmap);
 
-    uint32_t block_index = block_number % sb.blocks_per_group;  
+    uint32_t block_index = block_number % ext2_blocks_per_group();  
     uint32_t byte_idx = block_index / 8;
     uint8_t bit_pos = block_index % 8;
     uint8_t byte = block_bitmap[byte_idx];
@@ -544,6 +856,7 @@ void update_block_bitmap(uint32_t group_number, uint32_t block_number, uint8_t n
     block_bitmap[byte_idx] = byte;
 
     write(sector, 1024, block_bitmap);
+    kmem_cache_free(block_cache, block_bitmap);
 
     if (new_value) {
         update_blockgroup_descriptor(group_number, 0, -1);
@@ -555,16 +868,17 @@ void update_block_bitmap(uint32_t group_number, uint32_t block_number, uint8_t n
 }
 
 void update_inode_bitmap(uint32_t group_number, uint32_t inode_number, uint8_t new_value) {
-    uint32_t inode_bitmap_block_address = bgdt[group_number].inode_usage_bitmap;
+    uint32_t inode_bitmap_block_address = ext2_group(group_number).inode_usage_bitmap;
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
     
-    uint8_t inode_bitmap[1024];
+    uint8_t *inode_bitmap = kmem_cache_alloc(block_cache);
+    if (!inode_bitmap) return;
     uint32_t sector = inode_bitmap_block_address * sectors_per_block;
     read(sector, 1024, inode_bitmap);
     
-    uint32_t inode_index = (inode_number - 1) % sb.inodes_per_group;
+    uint32_t inode_index = (inode_number - 1) % ext2_inodes_per_group();
     
     uint32_t byte_idx = inode_index / 8;
     uint8_t bit_pos = inode_index % 8;
@@ -580,6 +894,7 @@ void update_inode_bitmap(uint32_t group_number, uint32_t inode_number, uint8_t n
     inode_bitmap[byte_idx] = byte;
 
     write(sector, 1024, inode_bitmap);
+    kmem_cache_free(block_cache, inode_bitmap);
     
     if (new_value) {
         update_blockgroup_descriptor(group_number, -1, 0);
@@ -594,7 +909,7 @@ void update_inode_bitmap(uint32_t group_number, uint32_t inode_number, uint8_t n
 /*
 void read_inode_bitmap(uint32_t group_number) {
     // Get the inode bitmap block address
-    uint32_t inode_bitmap_block_address = bgdt[group_number].inode_usage_bitmap;
+    uint32_t inode_bitmap_block_address = ext2_group(group_number).inode_usage_bitmap;
     
     terminal_write("\n=== Inode Bitmap for Group ");
     terminal_write_dec(group_number);
@@ -604,7 +919,7 @@ void read_inode_bitmap(uint32_t group_number) {
     terminal_write("\n\n");
     
     // Read the bitmap block
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
     uint8_t inode_bitmap[1024];
     
@@ -621,7 +936,7 @@ void read_inode_bitmap(uint32_t group_number) {
         uint8_t bit_value = (byte >> bit_pos) & 1;
         
         // Calculate actual inode number
-        uint32_t inode_num = group_number * sb.inodes_per_group + i + 1;
+        uint32_t inode_num = group_number * ext2_inodes_per_group() + i + 1;
         
         terminal_write("  Inode ");
         terminal_write_dec(inode_num);
@@ -643,61 +958,76 @@ void read_inode_bitmap(uint32_t group_number) {
 */
 
 uint32_t find_first_free_group(void){
-    for (uint32_t i = 0; i < 32; i++) {
-        if (bgdt[i].free_blocks_count > 0 && bgdt[i].free_inodes_count > 0) {
-            return i;
+    uint32_t group = -1;
+    rcu_read_lock();
+    struct ext2_fs *snapshot = rcu_dereference(fs);
+    for (uint32_t i = 0; i < snapshot->bgdt_count; i++) {
+        if (snapshot->bgdt[i].free_blocks_count > 0 && snapshot->bgdt[i].free_inodes_count > 0) {
+            group = i;
+            break;
         }
     }
-    return -1;
+    rcu_read_unlock();
+    return group;
 }
 
 uint32_t find_free_block(uint32_t group_number){
-    uint32_t block_bitmap_block_address = bgdt[group_number].block_usage_bitmap;
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_bitmap_block_address = ext2_group(group_number).block_usage_bitmap;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
 
-    uint8_t block_bitmap[1024];
+    uint8_t *block_bitmap = kmem_cache_alloc(block_cache);
+    if (!block_bitmap) return 0;
     uint32_t sector = block_bitmap_block_address * sectors_per_block;
     read(sector, 1024, block_bitmap);
 
-    for (uint32_t i = 0; i < sb.blocks_per_group; i++) {
+    uint32_t blocks_per_group = ext2_blocks_per_group();
+    for (uint32_t i = 0; i < blocks_per_group; i++) {
         uint32_t byte_idx = i / 8;
         uint8_t bit_pos = i % 8;
         uint8_t byte = block_bitmap[byte_idx];
         uint8_t bit_value = (byte >> bit_pos) & 1;
 
         if (bit_value == 0) {
-            return group_number * sb.blocks_per_group + i;
+            kmem_cache_free(block_cache, block_bitmap);
+            return group_number * blocks_per_group + i;
         }
     }
+    kmem_cache_free(block_cache, block_bitmap);
+    return 0;
 }
 
 uint32_t find_free_inode(uint32_t group_number){
-    uint32_t inode_bitmap_block_address = bgdt[group_number].inode_usage_bitmap;
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t inode_bitmap_block_address = ext2_group(group_number).inode_usage_bitmap;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
 
-    uint8_t inode_bitmap[1024];
+    uint8_t *inode_bitmap = kmem_cache_alloc(block_cache);
+    if (!inode_bitmap) return 0;
     uint32_t sector = inode_bitmap_block_address * sectors_per_block;
     read(sector, 1024, inode_bitmap);
 
-    for (uint32_t i = 0; i < sb.inodes_per_group; i++) {
+    uint32_t inodes_per_group = ext2_inodes_per_group();
+    for (uint32_t i = 0; i < inodes_per_group; i++) {
         uint32_t byte_idx = i / 8;
         uint8_t bit_pos = i % 8;
         uint8_t byte = inode_bitmap[byte_idx];
         uint8_t bit_value = (byte >> bit_pos) & 1;
 
         if (bit_value == 0) {
-            return group_number * sb.inodes_per_group + i + 1;
+            kmem_cache_free(block_cache, inode_bitmap);
+            return group_number * inodes_per_group + i + 1;
         }
     }
+    kmem_cache_free(block_cache, inode_bitmap);
+    return 0;
 }
 
 void read_directory_entries(uint32_t inode_number) {
-
-    read_inode(inode_number);
+    struct ext2_inode file;
+    if (!get_inode(inode_number, &file)) return;
     
-    uint16_t file_type = (inode.type_and_permissions >> 12) & 0xF;
+    uint16_t file_type = (file.type_and_permissions >> 12) & 0xF;
     if (file_type != 0x4) {
         terminal_write("Error: Inode ");
         terminal_write_dec(inode_number);
@@ -709,12 +1039,13 @@ void read_directory_entries(uint32_t inode_number) {
     terminal_write_dec(inode_number);
     terminal_write(" ===\n\n");
     
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     uint32_t sectors_per_block = block_size_bytes / 512;
-    uint8_t block_buffer[1024];
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return;
     
     for (int block_idx = 0; block_idx < 12; block_idx++) {
-        uint32_t block_num = inode.block[block_idx];
+        uint32_t block_num = file.block[block_idx];
         
         if (block_num == 0) {
             break;
@@ -747,9 +1078,7 @@ void read_directory_entries(uint32_t inode_number) {
             
             terminal_write("\tName: ");
             
-            for (int i = 0; i < entry->name_length && i < 255; i++) {
-                terminal_putchar(entry->name[i]);
-            }
+            terminal_write_len(entry->name, entry->name_length);
             terminal_write("\n");
             
             offset += entry->size;
@@ -761,31 +1090,107 @@ void read_directory_entries(uint32_t inode_number) {
         }
     }
     
-    if (inode.singly_indirect != 0) {
+    kmem_cache_free(block_cache, block_buffer);
+    
+    if (file.singly_indirect != 0) {
         terminal_write("\n(Note: This directory has indirect blocks - not yet implemented)\n");
     }
 }
 
+uint32_t ext2_lookup(uint32_t parent_inode, const char *name) {
+    uint8_t name_length = 0;
+    while (name[name_length] != '\0' && name_length < 255) {
+        name_length++;
+    }
+
+    uint32_t found = dcache_lookup(parent_inode, name, name_length);
+    if (found) {
+        return found;
+    }
+
+    struct ext2_inode dir;
+    if (!get_inode(parent_inode, &dir)) return 0;
+    if (((dir.type_and_permissions >> 12) & 0xF) != 0x4) {
+        return 0;
+    }
+
+    uint32_t block_size_bytes = ext2_block_size();
+    uint32_t sectors_per_block = block_size_bytes / 512;
+    uint8_t *block_buffer = kmem_cache_alloc(block_cache);
+    if (!block_buffer) return 0;
+
+    for (int block_idx = 0; block_idx < 12 && !found; block_idx++) {
+        uint32_t block_num = dir.block[block_idx];
+
+        if (block_num == 0) {
+            break;
+        }
+
+        read(block_num * sectors_per_block, 1024, block_buffer);
+
+        uint32_t offset = 0;
+        while (offset + 8 <= block_size_bytes) {
+            struct ext2_directory_entry *entry = (struct ext2_directory_entry *)(block_buffer + offset);
+
+            if (entry->inode == 0 || entry->size < 8) {
+                break;
+            }
+            if (entry->name_length == name_length && !memcmp(entry->name, name, name_length)) {
+                found = entry->inode;
+                break;
+            }
+            offset += entry->size;
+        }
+    }
+
+    kmem_cache_free(block_cache, block_buffer);
+
+    if (found) {
+        dcache_insert(parent_inode, name, name_length, found, false);
+    }
+    return found;
+}
+
 void update_superblock(uint32_t delta_inodes, uint32_t delta_blocks){
+    struct ext2_fs *snapshot = fs_copy(fs->bgdt_size);
+    if (!snapshot) return;
 
-    sb.total_unallocated_blocks += delta_blocks;
-    sb.total_unallocated_inodes += delta_inodes;
+    snapshot->sb.total_unallocated_blocks += delta_blocks;
+    snapshot->sb.total_unallocated_inodes += delta_inodes;
 
-    uint8_t buffer[1024];
+    uint8_t *buffer = kmem_cache_alloc(block_cache);
+    if (!buffer) {
+        kfree(snapshot);
+        return;
+    }
 
-    memcpy(buffer, &sb, sizeof(struct ext2_superblock));
+    memcpy(buffer, &snapshot->sb, sizeof(struct ext2_superblock));
 
     write(2, 1024, buffer);
+    kmem_cache_free(block_cache, buffer);
+    fs_publish(snapshot);
 }
 
 
 
 void parse_blockgroup_descriptors(void) {
-    uint8_t buffer[1024];
+    mutex_lock(&ext2_lock);
 
-    read(4, 1024, buffer);
+    uint32_t bgdt_count = (fs->sb.total_blocks + fs->sb.blocks_per_group - 1) / fs->sb.blocks_per_group;
+    uint32_t bgdt_size = (bgdt_count * sizeof(struct ext2_group_descriptor) + 1023) & ~1023U;
+
+    struct ext2_fs *snapshot = fs_copy(bgdt_size);
+    if (!snapshot) {
+        mutex_unlock(&ext2_lock);
+        return;
+    }
+    snapshot->bgdt_count = bgdt_count;
+    snapshot->bgdt_size = bgdt_size;
 
-    memcpy(bgdt, buffer, sizeof(bgdt));
+    read(4, bgdt_size, (uint8_t *)snapshot->bgdt);
+    fs_publish(snapshot);
+
+    struct ext2_group_descriptor *bgdt = snapshot->bgdt;
 
     terminal_write("\n=== ext2 Block Group Descriptors ===\n");
 
@@ -818,15 +1223,31 @@ void parse_blockgroup_descriptors(void) {
         terminal_write_dec(bgdt[i].directories_count);
         terminal_write("\n");
     }
+
+    mutex_unlock(&ext2_lock);
 }
 
 
 void parse_superblock(void) {
-    uint8_t buffer[1024];
+    uint8_t *buffer = kmem_cache_alloc(block_cache);
+    if (!buffer) return;
 
     read(2, 1024, buffer);
 
-    sb = *(struct ext2_superblock *)buffer;
+    // a fresh snapshot without descriptors; parse_blockgroup_descriptors() adds them
+    struct ext2_fs *snapshot = kmalloc(sizeof(struct ext2_fs));
+    if (!snapshot) {
+        kmem_cache_free(block_cache, buffer);
+        return;
+    }
+    memset(snapshot, 0, sizeof(struct ext2_fs));
+    snapshot->sb = *(struct ext2_superblock *)buffer;
+    kmem_cache_free(block_cache, buffer);
+
+    mutex_lock(&ext2_lock);
+    fs_publish(snapshot);
+
+    const struct ext2_superblock *sb = &snapshot->sb;
     
     terminal_set_color(0x00FF00);
     terminal_write("✓ Valid ext2 filesystem detected!\n");
@@ -835,34 +1256,34 @@ void parse_superblock(void) {
     terminal_write("\n=== ext2 Superblock Information ===\n");
     
     terminal_write("Total Inodes: ");
-    terminal_write_dec(sb.total_inodes);
+    terminal_write_dec(sb->total_inodes);
     terminal_write("\n");
     
     terminal_write("Inodes per Group: ");
-    terminal_write_dec(sb.inodes_per_group);
+    terminal_write_dec(sb->inodes_per_group);
     terminal_write("\n");
     
     terminal_write("Free Inodes: ");
-    terminal_write_dec(sb.total_unallocated_inodes);
+    terminal_write_dec(sb->total_unallocated_inodes);
     terminal_write("\n");
     
     terminal_write("Total Blocks: ");
-    terminal_write_dec(sb.total_blocks);
+    terminal_write_dec(sb->total_blocks);
     terminal_write("\n");
     
     terminal_write("Blocks per Group: ");
-    terminal_write_dec(sb.blocks_per_group);
+    terminal_write_dec(sb->blocks_per_group);
     terminal_write("\n");
     
     terminal_write("Free Blocks: ");
-    terminal_write_dec(sb.total_unallocated_blocks);
+    terminal_write_dec(sb->total_unallocated_blocks);
     terminal_write("\n");
 
-    uint32_t block_size_bytes = 1024 << sb.block_size;
+    uint32_t block_size_bytes = ext2_block_size();
     terminal_write("Block Size: ");
     terminal_write_dec(block_size_bytes);
     terminal_write(" bytes (log2: ");
-    terminal_write_dec(sb.block_size);
+    terminal_write_dec(sb->block_size);
     terminal_write(")\n");
     
     uint32_t sectors_per_block = block_size_bytes / 512;
@@ -870,13 +1291,13 @@ void parse_superblock(void) {
     terminal_write_dec(sectors_per_block);
     terminal_write("\n");
 
-    uint64_t total_bytes = (uint64_t)sb.total_blocks * block_size_bytes;
+    uint64_t total_bytes = (uint64_t)sb->total_blocks * block_size_bytes;
     uint64_t total_mb = total_bytes / (1024 * 1024);
     terminal_write("Total Size: ");
     terminal_write_dec(total_mb);
     terminal_write(" MB\n");
     
-    uint64_t free_bytes = (uint64_t)sb.total_unallocated_blocks * block_size_bytes;
+    uint64_t free_bytes = (uint64_t)sb->total_unallocated_blocks * block_size_bytes;
     uint64_t free_mb = free_bytes / (1024 * 1024);
     terminal_write("Free Space: ");
     terminal_write_dec(free_mb);
@@ -884,8 +1305,28 @@ void parse_superblock(void) {
     
     terminal_write("\n");
 
+    mutex_unlock(&ext2_lock);
 }
 
 uint32_t find_block_group_from_inode(uint32_t inode){
-    return (inode - 1) / sb.inodes_per_group;
+    return (inode - 1) / ext2_inodes_per_group();
+}
+
+void create_file(uint32_t parent_inode, const char *filename) {
+    mutex_lock(&ext2_lock);
+    do_create_file(parent_inode, filename);
+    mutex_unlock(&ext2_lock);
 }
+
+void delete_file(uint32_t inode_number) {
+    mutex_lock(&ext2_lock);
+    do_delete_file(inode_number);
+    mutex_unlock(&ext2_lock);
+}
+
+void write_file(uint32_t inode_number, const char* data) {
+    mutex_lock(&ext2_lock);
+    do_write_file(inode_number, data);
+    mutex_unlock(&ext2_lock);
+}
+
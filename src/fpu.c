@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "memory.h"
+#include "slab.h"
+#include "terminal.h"
+#include "percpu.h"
+#include "fpu.h"
+
+#define CR0_MP         (1ULL << 1)
+#define CR0_EM         (1ULL << 2)
+#define CR0_TS         (1ULL << 3)
+#define CR0_NE         (1ULL << 5)
+#define CR4_OSFXSR     (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_OSXSAVE    (1ULL << 18)
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+
+#define FXSAVE_AREA_SIZE 512
+
+static bool has_xsave = false;
+static bool has_xsaveopt = false;
+static bool has_avx2 = false;
+static bool has_avx = false;
+static uint64_t xcr0 = 0;
+static uint32_t area_size = FXSAVE_AREA_SIZE;
+
+// Only kernel code touches the vector registers, so the outermost section
+// has nothing to preserve. State is saved lazily: only when a section
+// starts while another one is already live, into the slot of the outer
+// one. The depth and save slots live in each CPU's percpu area.
+
+static inline uint64_t read_cr0(void) {
+    uint64_t value;
+    asm volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint64_t value) {
+    asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint64_t value) {
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void xsetbv(uint32_t index, uint64_t value) {
+    asm volatile("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)xcr0;
+    uint32_t hi = (uint32_t)(xcr0 >> 32);
+
+    if (has_xsaveopt) {
+        asm volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else if (has_xsave) {
+        asm volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+static void fpu_restore(void *area) {
+    uint32_t lo = (uint32_t)xcr0;
+    uint32_t hi = (uint32_t)(xcr0 >> 32);
+
+    if (has_xsave) {
+        asm volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+    }
+}
+
+// control register setup every CPU needs before it may touch SSE
+static void fpu_enable(void) {
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (has_xsave) {
+        cr4 |= CR4_OSXSAVE;
+    }
+    write_cr4(cr4);
+
+    if (has_xsave) {
+        xsetbv(0, xcr0);
+    }
+
+    asm volatile("fninit");
+}
+
+void fpu_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    has_xsave = ecx & (1 << 26);
+    has_avx = ecx & (1 << 28);
+
+    if (has_xsave) {
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if (has_avx) {
+            xcr0 |= XCR0_AVX;
+        }
+    }
+    fpu_enable();
+
+    if (has_xsave) {
+        // EBX reports the area size for the features enabled in XCR0
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        area_size = ebx;
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        has_xsaveopt = eax & 1;
+
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        has_avx2 = has_avx && (ebx & (1 << 5));
+    }
+
+    fpu_alloc_state(this_cpu());
+}
+
+void fpu_init_ap(void) {
+    fpu_enable();
+}
+
+bool fpu_alloc_state(struct percpu *cpu) {
+    // kmalloc objects are at least 64 byte aligned, as XSAVE requires
+    for (int i = 0; i < FPU_MAX_DEPTH - 1; i++) {
+        cpu->fpu_save_areas[i] = kmalloc(area_size);
+        if (!cpu->fpu_save_areas[i]) {
+            return false;
+        }
+        // XRSTOR faults on a header with reserved bits set
+        memset(cpu->fpu_save_areas[i], 0, area_size);
+    }
+    return true;
+}
+
+void fpu_free_state(struct percpu *cpu) {
+    for (int i = 0; i < FPU_MAX_DEPTH - 1; i++) {
+        kfree(cpu->fpu_save_areas[i]);
+        cpu->fpu_save_areas[i] = NULL;
+    }
+}
+
+bool fpu_has_avx2(void) {
+    return has_avx2;
+}
+
+void kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    struct percpu *cpu = this_cpu();
+
+    if (cpu->fpu_depth >= FPU_MAX_DEPTH) {
+        terminal_write("ERROR: kernel_fpu_begin nested too deeply\n");
+    } else if (cpu->fpu_depth > 0 && cpu->fpu_save_areas[cpu->fpu_depth - 1]) {
+        fpu_save(cpu->fpu_save_areas[cpu->fpu_depth - 1]);
+    }
+    cpu->fpu_depth++;
+
+    irq_restore(flags);
+}
+
+void kernel_fpu_end(void) {
+    uint64_t flags = irq_save();
+    struct percpu *cpu = this_cpu();
+
+    cpu->fpu_depth--;
+    if (cpu->fpu_depth > 0 && cpu->fpu_depth < FPU_MAX_DEPTH && cpu->fpu_save_areas[cpu->fpu_depth - 1]) {
+        fpu_restore(cpu->fpu_save_areas[cpu->fpu_depth - 1]);
+    }
+
+    irq_restore(flags);
+}
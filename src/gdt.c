@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "memory.h"
+#include "gdt.h"
+
+struct gdtr {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+static struct gdt_cpu boot_gdt;
+
+static uint8_t boot_ist_stacks[IST_STACK_COUNT * IST_STACK_SIZE] __attribute__((aligned(16)));
+
+static uint64_t gdt_segment(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    return (limit & 0xFFFFULL)
+        | ((uint64_t)(base & 0xFFFFFF) << 16)
+        | ((uint64_t)access << 40)
+        | ((uint64_t)((limit >> 16) & 0xF) << 48)
+        | ((uint64_t)(flags & 0xF) << 52)
+        | ((uint64_t)((base >> 24) & 0xFF) << 56);
+}
+
+static void load_gdt(struct gdt_cpu *gdt) {
+    struct gdtr gdtr = {
+        .limit = sizeof(gdt->entries) - 1,
+        .base = (uint64_t)gdt->entries
+    };
+    asm volatile("lgdt %0" : : "m"(gdtr));
+
+    // reload CS with a far return, then the data segments; FS and GS are
+    // left alone since loading them would clear the per-CPU GS base
+    asm volatile(
+        "pushq %0\n"
+        "leaq 1f(%%rip), %%rax\n"
+        "pushq %%rax\n"
+        "lretq\n"
+        "1:\n"
+        "mov %1, %%ds\n"
+        "mov %1, %%es\n"
+        "mov %1, %%ss\n"
+        : : "i"(GDT_KERNEL_CODE), "r"((uint64_t)GDT_KERNEL_DATA) : "rax", "memory");
+
+    asm volatile("ltr %w0" : : "r"((uint16_t)GDT_TSS));
+}
+
+void gdt_init_cpu(struct gdt_cpu *gdt, uint8_t *ist_stacks) {
+    uint64_t *entries = gdt->entries;
+    struct tss *tss = &gdt->tss;
+
+    entries[0] = 0;
+    entries[1] = gdt_segment(0, 0xFFFF, 0x9A, 0x0);
+    entries[2] = gdt_segment(0, 0xFFFF, 0x92, 0x0);
+    entries[3] = gdt_segment(0, 0xFFFFF, 0x9A, 0xC);
+    entries[4] = gdt_segment(0, 0xFFFFF, 0x92, 0xC);
+    entries[5] = gdt_segment(0, 0, 0x9A, 0x2);
+    entries[6] = gdt_segment(0, 0, 0x92, 0x0);
+
+    memset(tss, 0, sizeof(*tss));
+
+    // stacks grow down, so each IST slot points at the end of its stack
+    tss->ist[IST_NMI - 1] = (uint64_t)(ist_stacks + 1 * IST_STACK_SIZE);
+    tss->ist[IST_DOUBLE_FAULT - 1] = (uint64_t)(ist_stacks + 2 * IST_STACK_SIZE);
+    tss->ist[IST_MACHINE_CHECK - 1] = (uint64_t)(ist_stacks + 3 * IST_STACK_SIZE);
+    tss->iomap_base = sizeof(struct tss);
+
+    // a 64-bit TSS descriptor takes two slots, the second holds base 63:32
+    uint64_t base = (uint64_t)tss;
+    entries[7] = gdt_segment((uint32_t)base, sizeof(struct tss) - 1, 0x89, 0x0);
+    entries[8] = base >> 32;
+
+    load_gdt(gdt);
+}
+
+void gdt_init(void) {
+    gdt_init_cpu(&boot_gdt, boot_ist_stacks);
+}
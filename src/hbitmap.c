@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "hbitmap.h"
+
+static inline uint64_t words_for(uint64_t bits) {
+    return (bits + 63) / 64;
+}
+
+size_t hbitmap_storage_size(uint64_t nbits) {
+    uint64_t nwords = words_for(nbits);
+    uint64_t nsummary = words_for(nwords);
+    uint64_t ntop = words_for(nsummary);
+    return (nwords + nsummary + ntop) * sizeof(uint64_t);
+}
+
+void hbitmap_init(struct hbitmap *bm, void *storage, uint64_t nbits) {
+    bm->nbits = nbits;
+    bm->nwords = words_for(nbits);
+    bm->nsummary = words_for(bm->nwords);
+    bm->ntop = words_for(bm->nsummary);
+
+    bm->words = (uint64_t *)storage;
+    bm->summary = bm->words + bm->nwords;
+    bm->top = bm->summary + bm->nsummary;
+
+    uint64_t total = bm->nwords + bm->nsummary + bm->ntop;
+    for (uint64_t i = 0; i < total; i++) {
+        bm->words[i] = 0;
+    }
+}
+
+void hbitmap_set(struct hbitmap *bm, uint64_t bit) {
+    uint64_t w = bit / 64;
+    uint64_t s = w / 64;
+
+    bm->words[w] |= 1ULL << (bit % 64);
+    bm->summary[s] |= 1ULL << (w % 64);
+    bm->top[s / 64] |= 1ULL << (s % 64);
+}
+
+void hbitmap_clear(struct hbitmap *bm, uint64_t bit) {
+    uint64_t w = bit / 64;
+    uint64_t s = w / 64;
+
+    bm->words[w] &= ~(1ULL << (bit % 64));
+    if (bm->words[w]) {
+        return;
+    }
+
+    bm->summary[s] &= ~(1ULL << (w % 64));
+    if (bm->summary[s]) {
+        return;
+    }
+
+    bm->top[s / 64] &= ~(1ULL << (s % 64));
+}
+
+bool hbitmap_test(struct hbitmap *bm, uint64_t bit) {
+    if (bit >= bm->nbits) {
+        return false;
+    }
+    return (bm->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+void hbitmap_set_range(struct hbitmap *bm, uint64_t start, uint64_t count) {
+    if (start >= bm->nbits) {
+        return;
+    }
+    if (count > bm->nbits - start) {
+        count = bm->nbits - start;
+    }
+
+    // unaligned head and tail bit by bit, whole words in between
+    while (count > 0 && (start % 64)) {
+        hbitmap_set(bm, start++);
+        count--;
+    }
+    while (count >= 64) {
+        hbitmap_set(bm, start);
+        bm->words[start / 64] = ~0ULL;
+        start += 64;
+        count -= 64;
+    }
+    while (count > 0) {
+        hbitmap_set(bm, start++);
+        count--;
+    }
+}
+
+// first summary word at or after s with any bit set
+static uint64_t next_summary(struct hbitmap *bm, uint64_t s) {
+    if (s >= bm->nsummary) {
+        return HBITMAP_NONE;
+    }
+
+    uint64_t t = s / 64;
+    uint64_t mask = bm->top[t] & (~0ULL << (s % 64));
+    while (!mask) {
+        if (++t >= bm->ntop) {
+            return HBITMAP_NONE;
+        }
+        mask = bm->top[t];
+    }
+    return t * 64 + __builtin_ctzll(mask);
+}
+
+// first word at or after w with any bit set
+static uint64_t next_word(struct hbitmap *bm, uint64_t w) {
+    if (w >= bm->nwords) {
+        return HBITMAP_NONE;
+    }
+
+    uint64_t s = w / 64;
+    uint64_t mask = bm->summary[s] & (~0ULL << (w % 64));
+    if (mask) {
+        return s * 64 + __builtin_ctzll(mask);
+    }
+
+    s = next_summary(bm, s + 1);
+    if (s == HBITMAP_NONE) {
+        return HBITMAP_NONE;
+    }
+    return s * 64 + __builtin_ctzll(bm->summary[s]);
+}
+
+uint64_t hbitmap_find_next(struct hbitmap *bm, uint64_t from) {
+    if (from >= bm->nbits) {
+        return HBITMAP_NONE;
+    }
+
+    uint64_t w = from / 64;
+    uint64_t mask = bm->words[w] & (~0ULL << (from % 64));
+    if (mask) {
+        return w * 64 + __builtin_ctzll(mask);
+    }
+
+    w = next_word(bm, w + 1);
+    if (w == HBITMAP_NONE) {
+        return HBITMAP_NONE;
+    }
+    return w * 64 + __builtin_ctzll(bm->words[w]);
+}
+
+uint64_t hbitmap_find_first(struct hbitmap *bm) {
+    return hbitmap_find_next(bm, 0);
+}
+
+// length of the run of set bits starting at a set bit
+static uint64_t run_length(struct hbitmap *bm, uint64_t start, uint64_t limit) {
+    uint64_t length = 0;
+    uint64_t bit = start;
+
+    while (bit < bm->nbits && length < limit) {
+        uint64_t shift = bit % 64;
+        uint64_t inverted = ~(bm->words[bit / 64] >> shift);
+        uint64_t ones = inverted ? (uint64_t)__builtin_ctzll(inverted) : 64 - shift;
+
+        length += ones;
+        bit += ones;
+        if (ones < 64 - shift) {
+            break;
+        }
+    }
+    return length;
+}
+
+uint64_t hbitmap_find_run(struct hbitmap *bm, uint64_t count) {
+    if (count == 0) {
+        return HBITMAP_NONE;
+    }
+
+    uint64_t start = hbitmap_find_first(bm);
+    while (start != HBITMAP_NONE) {
+        uint64_t length = run_length(bm, start, count);
+        if (length >= count) {
+            return start;
+        }
+        start = hbitmap_find_next(bm, start + length);
+    }
+    return HBITMAP_NONE;
+}
@@ -0,0 +1,162 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "paging.h"
+#include "serial.h"
+#include "ktime.h"
+#include "acpi.h"
+#include "apic.h"
+#include "hpet.h"
+
+#define HPET_CAPABILITIES   0x000
+#define HPET_CONFIG         0x010
+#define HPET_COUNTER        0x0F0
+#define HPET_TIMER_CONFIG(n)     (0x100 + 0x20 * (n))
+#define HPET_TIMER_COMPARATOR(n) (0x108 + 0x20 * (n))
+
+#define HPET_CONFIG_ENABLE  (1ULL << 0)
+#define HPET_CAP_64BIT      (1ULL << 13)
+
+#define HPET_TN_INT_ENABLE  (1ULL << 2)
+#define HPET_TN_32BIT       (1ULL << 8)
+#define HPET_TN_ROUTE_SHIFT 9
+
+#define FEMTOSECONDS_PER_SEC 1000000000000000ULL
+// a 32-bit comparator is matched modulo 2^32, so a deadline further out
+// than half the range could not be told from one already gone by
+#define HPET_MAX_DELTA_32   0x7FFFFFFFULL
+
+static volatile uint64_t *hpet_regs = NULL;
+static uint64_t period_fs = 0;
+// 32.32 fixed point conversions between counter ticks and nanoseconds
+static uint64_t ns_per_tick = 0;
+static uint64_t ticks_per_ns = 0;
+static uint64_t frequency = 0;
+static bool counter_64bit = false;
+static bool event_ready = false;
+
+static inline uint64_t hpet_read(uint32_t reg) {
+    return hpet_regs[reg / 8];
+}
+
+static inline void hpet_write(uint32_t reg, uint64_t value) {
+    hpet_regs[reg / 8] = value;
+}
+
+bool hpet_init(void) {
+    struct acpi_hpet *table = (struct acpi_hpet *)acpi_find_table("HPET");
+    if (!table || table->address.address_space != 0) {
+        return false;
+    }
+
+    hpet_regs = map_physical(table->address.address, PAGE_SIZE, PAGE_PCD | PAGE_PWT);
+    if (!hpet_regs) {
+        return false;
+    }
+
+    uint64_t caps = hpet_read(HPET_CAPABILITIES);
+    period_fs = caps >> 32;
+    if (period_fs == 0 || period_fs > 100000000) {
+        // the spec caps the period at 100 ns
+        hpet_regs = NULL;
+        return false;
+    }
+    frequency = FEMTOSECONDS_PER_SEC / period_fs;
+    ns_per_tick = (period_fs << 32) / 1000000;
+    ticks_per_ns = (1000000ULL << 32) / period_fs;
+    counter_64bit = caps & HPET_CAP_64BIT;
+
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) | HPET_CONFIG_ENABLE);
+
+    serial_write("HPET: ");
+    serial_write_dec(frequency / 1000);
+    serial_write(counter_64bit ? " kHz, 64-bit counter\n" : " kHz, 32-bit counter\n");
+    return true;
+}
+
+bool hpet_available(void) {
+    return hpet_regs != NULL;
+}
+
+uint64_t hpet_read_counter(void) {
+    return hpet_read(HPET_COUNTER);
+}
+
+uint64_t hpet_counter_delta(uint64_t start, uint64_t end) {
+    return counter_64bit ? end - start : (uint32_t)(end - start);
+}
+
+uint64_t hpet_frequency(void) {
+    return frequency;
+}
+
+uint64_t hpet_ticks_to_ns(uint64_t ticks) {
+    return (uint64_t)(((unsigned __int128)ticks * ns_per_tick) >> 32);
+}
+
+bool hpet_event_init(uint8_t vector) {
+    if (!hpet_regs || !apic_enabled()) {
+        return false;
+    }
+
+    // pick an I/O APIC input this comparator can drive that no ISA device
+    // is using
+    uint64_t config = hpet_read(HPET_TIMER_CONFIG(0));
+    uint32_t routes = config >> 32;
+    uint32_t gsi = 32;
+    for (uint32_t i = 0; i < 32; i++) {
+        if ((routes & (1U << i)) && !ioapic_gsi_is_isa(i)) {
+            gsi = i;
+            break;
+        }
+    }
+    if (gsi == 32 || !ioapic_route_gsi(gsi, vector, lapic_id(), false, false)) {
+        return false;
+    }
+
+    config &= ~((0x1FULL << HPET_TN_ROUTE_SHIFT) | HPET_TN_32BIT);
+    config |= (uint64_t)gsi << HPET_TN_ROUTE_SHIFT;
+    hpet_write(HPET_TIMER_CONFIG(0), config);
+
+    event_ready = true;
+    return true;
+}
+
+void hpet_event_arm(uint64_t deadline_ns) {
+    if (!event_ready) {
+        return;
+    }
+
+    // ktime and the HPET drift apart, so convert from a fresh pair of
+    // readings rather than one taken at boot
+    uint64_t now = hpet_read_counter();
+    uint64_t now_ns = ktime_ns();
+
+    // the comparator matches on equality, so a target that has already
+    // gone by is pushed just past the current count
+    uint64_t delta = 0;
+    if (deadline_ns > now_ns) {
+        delta = (uint64_t)(((unsigned __int128)(deadline_ns - now_ns) * ticks_per_ns) >> 32);
+    }
+    if (delta < 16) {
+        delta = 16;
+    }
+    if (!counter_64bit && delta > HPET_MAX_DELTA_32) {
+        // the wheel re-arms when this fires early
+        delta = HPET_MAX_DELTA_32;
+    }
+
+    uint64_t ticks = now + delta;
+    if (!counter_64bit) {
+        ticks = (uint32_t)ticks;
+    }
+    hpet_write(HPET_TIMER_COMPARATOR(0), ticks);
+    hpet_write(HPET_TIMER_CONFIG(0), hpet_read(HPET_TIMER_CONFIG(0)) | HPET_TN_INT_ENABLE);
+}
+
+void hpet_event_stop(void) {
+    if (event_ready) {
+        hpet_write(HPET_TIMER_CONFIG(0), hpet_read(HPET_TIMER_CONFIG(0)) & ~HPET_TN_INT_ENABLE);
+    }
+}
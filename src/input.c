@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "input.h"
+
+#define INPUT_RING_MASK (INPUT_RING_SIZE - 1)
+
+_Static_assert((INPUT_RING_SIZE & INPUT_RING_MASK) == 0, "INPUT_RING_SIZE must be a power of two");
+
+void input_ring_init(struct input_ring *ring) {
+    for (uint64_t i = 0; i < INPUT_RING_SIZE; i++) {
+        ring->slots[i].seq = i;
+    }
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+}
+
+bool input_ring_push(struct input_ring *ring, const struct input_event *event) {
+    // the reader stalls on a claimed but unwritten slot, so a producer must
+    // not be preempted or interrupted between the two
+    uint64_t flags = irq_save();
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        struct input_slot *slot = &ring->slots[pos & INPUT_RING_MASK];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            // free and ours if nobody else claims this position first
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->event = *event;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                irq_restore(flags);
+                return true;
+            }
+        } else if (seq < pos) {
+            // still holds the event from one lap ago: the reader is behind
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            irq_restore(flags);
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+bool input_ring_pop(struct input_ring *ring, struct input_event *event) {
+    struct input_slot *slot = &ring->slots[ring->tail & INPUT_RING_MASK];
+
+    // a claimed slot whose producer has not finished writing reads as empty
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->tail + 1) {
+        return false;
+    }
+
+    *event = slot->event;
+    __atomic_store_n(&slot->seq, ring->tail + INPUT_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// safe from any CPU; the answer may be stale by the time it is used
+bool input_ring_empty(struct input_ring *ring) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    struct input_slot *slot = &ring->slots[tail & INPUT_RING_MASK];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1;
+}
@@ -36,6 +36,11 @@ global isr_stub_30
 global isr_stub_31
 
 extern exception_handler
+extern irqstat_account
+extern irq_exit
+
+; offset of int_no in struct interrupt_frame, after the 15 saved registers
+FRAME_INT_NO equ 15 * 8
 
 %macro isr_no_err_stub 1
 isr_stub_%+%1:
@@ -106,11 +111,21 @@ isr_common:
     mov rbp, rsp        ; Save original stack pointer
     and rsp, ~0xF       ; Align to 16 bytes (clear lower 4 bits)
     
+    ; Entry timestamp, kept in callee-saved r12 across the handler
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r12, rax
+    
     ; Pass original stack pointer to handler
     mov rdi, rbp
     cld
     call exception_handler
     
+    mov rdi, [rbp + FRAME_INT_NO]
+    mov rsi, r12
+    call irqstat_account
+    
     ; Restore stack pointer
     mov rsp, rbp
     
@@ -134,29 +149,34 @@ isr_common:
     add rsp, 16
     iretq
 
-global irq_stub_0
-global irq_stub_1
-global irq_stub_8
-global irq_stub_12
-global irq_stub_14
-global irq_stub_15
-
 extern irq_handler
 
+; one stub per vector from 32 up, each pushing a dummy error code and its
+; vector, and a table of their addresses for idt_init()
 %macro irq_stub_macro 1
 irq_stub_%+%1:
     push 0              ; Dummy error code
-    push %1 + 32        ; Push IRQ number as interrupt vector (32 + IRQ)
+    push %1             ; Interrupt vector
     jmp irq_common
 %endmacro
 
-irq_stub_macro 0        ; Timer (vector 32)
-irq_stub_macro 1        ; Keyboard (vector 33)
-irq_stub_macro 8        ; RTC (vector 40)
-irq_stub_macro 12       ; PS/2 Mouse (vector 44)
-irq_stub_macro 14       ; Primary ATA (vector 46)
-irq_stub_macro 15       ; Secondary ATA (vector 47)
+%assign vector 32
+%rep 224
+irq_stub_macro vector
+%assign vector vector + 1
+%endrep
 
+section .rodata
+
+global irq_stub_table
+irq_stub_table:
+%assign vector 32
+%rep 224
+    dq irq_stub_%+vector
+%assign vector vector + 1
+%endrep
+
+section .text
 
 irq_common:
     ; Save registers (same as exception handler)
@@ -179,10 +199,21 @@ irq_common:
     mov rbp, rsp
     and rsp, ~0xF
     
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r12, rax
+    
     mov rdi, rbp
     cld
     call irq_handler     ; Call IRQ handler (not exception_handler!)
     
+    ; account the hard IRQ only, then run the bottom halves
+    mov rdi, [rbp + FRAME_INT_NO]
+    mov rsi, r12
+    call irqstat_account
+    call irq_exit
+    
     mov rsp, rbp
     
     ; Restore registers
@@ -203,4 +234,12 @@ irq_common:
     pop rax
     
     add rsp, 16
-    iretq
\ No newline at end of file
+    iretq
+
+
+global spurious_stub
+
+; The local APIC raises this when an interrupt goes away before it is
+; delivered; it must not be acknowledged with an EOI.
+spurious_stub:
+    iretq
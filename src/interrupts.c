@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "cpu.h"
 #include "serial.h"
 #include "pic.h"
 #include "draw.h"     
@@ -11,7 +12,25 @@
 #include "interrupts.h"
 #include "io.h"
 #include "pit.h"
+#include "vmm.h"
+#include "apic.h"
+#include "softirq.h"
+#include "sched.h"
+#include "gdt.h"
 
+static void* isr_stubs[32] = {
+    isr_stub_0,  isr_stub_1,  isr_stub_2,  isr_stub_3,
+    isr_stub_4,  isr_stub_5,  isr_stub_6,  isr_stub_7,
+    isr_stub_8,  isr_stub_9,  isr_stub_10, isr_stub_11,
+    isr_stub_12, isr_stub_13, isr_stub_14, isr_stub_15,
+    isr_stub_16, isr_stub_17, isr_stub_18, isr_stub_19,
+    isr_stub_20, isr_stub_21, isr_stub_22, isr_stub_23,
+    isr_stub_24, isr_stub_25, isr_stub_26, isr_stub_27,
+    isr_stub_28, isr_stub_29, isr_stub_30, isr_stub_31
+};
+
+// shared by every CPU; each loads the same table in idt_load()
+__attribute__((used)) static idt_entry_t idt[256];
 
 void enable_interrupts(void) {
     asm volatile ("sti");
@@ -26,7 +45,7 @@ void set_idt_entry(uint8_t vector, void* isr, uint8_t flags) {
     uint64_t isr_addr = (uint64_t)isr;
 
     descriptor->isr_low   = isr_addr & 0xFFFF;
-    descriptor->selector  = 0x28;
+    descriptor->selector  = GDT_KERNEL_CODE;
     descriptor->ist       = 0;    
     descriptor->attributes = flags;
     descriptor->isr_mid   = (isr_addr >> 16) & 0xFFFF;
@@ -35,6 +54,22 @@ void set_idt_entry(uint8_t vector, void* isr, uint8_t flags) {
 }
 
 void exception_handler(struct interrupt_frame *frame) {
+    uint64_t cr2 = 0;
+    if (frame->int_no == 14) {
+        asm volatile("mov %%cr2, %0" : "=r"(cr2));
+        // the gate turned interrupts off; put them back if the faulting
+        // code had them, so this CPU keeps taking IPIs while it waits for
+        // the address space lock
+        if (frame->rflags & RFLAGS_IF) {
+            enable_interrupts();
+        }
+        bool handled = vmm_handle_fault(cr2, frame->error_code);
+        disable_interrupts();
+        if (handled) {
+            return;
+        }
+    }
+
     disable_interrupts();
     
     serial_write("\n\n");
@@ -149,58 +184,74 @@ void exception_handler(struct interrupt_frame *frame) {
     serial_write_hex(frame->r15);
     serial_write("\n");
     
-    serial_write("\n================================\n");
-    serial_write("===   SYSTEM HALTED          ===\n");
-    serial_write("================================\n");
-
-    
-
     if (frame->int_no == 14) {
-        uint64_t cr2;
-        asm volatile("mov %%cr2, %0" : "=r"(cr2));
-
-        serial_write("Faulting address (CR2): 0x");
+        serial_write("\nFaulting address (CR2): 0x");
         serial_write_hex(cr2);
         serial_write("\n");
-    
-        uint64_t virt_page = cr2 & ~0xFFF;
-        uint64_t phys_page = allocate_page();
-    
-        if (phys_page == 0) {
-            serial_write("ERROR: Cannot allocate page!\n");
-            serial_write("System halted.\n");
-            for(;;) asm("hlt");
-        }
-
-        
-    
-        map_page(virt_page, phys_page, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
-        return;
     }
+
+    serial_write("\n================================\n");
+    serial_write("===   SYSTEM HALTED          ===\n");
+    serial_write("================================\n");
     
     while (1) {
         asm volatile("hlt");
     }
 }
 
-void irq_handler(struct interrupt_frame *frame) {
-    // right now we only handle keyboard IRQ and timer IRQ
-    uint64_t irq_num = frame->int_no - 32;
-    
-    if (irq_num == 0) {
-        // timer IRQ
-        // we can add timer handling code here later
-    } else if (irq_num == 1) {
-        uint8_t scancode = inb(0x60);
-        keyboard_handle_irq(scancode);
+struct irq_action {
+    irq_handler_t handler;
+    void *ctx;
+};
+
+static struct irq_action irq_actions[MAX_NUM_IDT_ENTRIES];
+static uint64_t unhandled_irqs = 0;
+
+bool request_irq(uint8_t vector, irq_handler_t handler, void *ctx) {
+    if (vector < IRQ_VECTOR_BASE || !handler || irq_actions[vector].handler) {
+        return false;
     }
-    else if (irq_num == 8) {
-        rtc_handler();
+    irq_actions[vector].ctx = ctx;
+    irq_actions[vector].handler = handler;
+    return true;
+}
+
+void free_irq(uint8_t vector) {
+    irq_actions[vector].handler = NULL;
+    irq_actions[vector].ctx = NULL;
+}
+
+void irq_handler(struct interrupt_frame *frame) {
+    struct irq_action *action = &irq_actions[frame->int_no];
+    
+    if (action->handler) {
+        action->handler(frame, action->ctx);
+    } else {
+        unhandled_irqs++;
     }
-    else if (irq_num == 12) {
-        // mouse IRQ - not implemented yet
+    
+    if (apic_enabled()) {
+        lapic_eoi();
+    } else if (frame->int_no < ISA_IRQ_VECTOR(16)) {
+        send_eoi(frame->int_no - IRQ_VECTOR_BASE);
     }
-    send_eoi(irq_num);
+}
+
+// called from irq_common after the handler and its accounting; bottom
+// halves run after the EOI so further IRQs can come in, then the
+// interrupted thread may be preempted
+void irq_exit(void) {
+    do_softirq();
+    sched_preempt_irq();
+}
+
+// the table is shared; each CPU only has to point its IDTR at it
+void idt_load(void) {
+    struct idtr idtr;
+    idtr.limit = (sizeof(idt_entry_t) * MAX_NUM_IDT_ENTRIES) - 1;
+    idtr.base = (uint64_t)&idt;
+    
+    asm volatile("lidt %0" :: "m"(idtr));
 }
 
 void idt_init(void) {
@@ -219,21 +270,21 @@ void idt_init(void) {
         set_idt_entry(i, isr_stubs[i], 0x8E);
     }
     
-    struct idtr idtr;
-    idtr.limit = (sizeof(idt_entry_t) * MAX_NUM_IDT_ENTRIES) - 1;
-    idtr.base = (uint64_t)&idt;
+    // these can arrive with the current stack unusable (overflow, or in
+    // the middle of a switch) so they always get a known-good one
+    idt[2].ist = IST_NMI;
+    idt[8].ist = IST_DOUBLE_FAULT;
+    idt[18].ist = IST_MACHINE_CHECK;
     
-    asm volatile("lidt %0" :: "m"(idtr));
+    idt_load();
     
     serial_write("IDT loaded!\n");
 
     init_pic();
 
-    set_idt_entry(32, irq_stub_0, 0x8E);
-    set_idt_entry(33, irq_stub_1, 0x8E);
-    set_idt_entry(40, irq_stub_8, 0x8E);
-    set_idt_entry(46, irq_stub_14, 0x8E);
-    set_idt_entry(47, irq_stub_15, 0x8E);
+    for (int i = IRQ_VECTOR_BASE; i < MAX_NUM_IDT_ENTRIES; i++) {
+        set_idt_entry(i, irq_stub_table[i - IRQ_VECTOR_BASE], 0x8E);
+    }
 
     pic_unmask_irq(0);
     pic_unmask_irq(1); 
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "str.h"
+#include "memory.h"
+#include "serial.h"
+#include "terminal.h"
+#include "interrupts.h"
+#include "slab.h"
+#include "smp.h"
+#include "irqstat.h"
+
+#define IRQSTAT_TABLE_SIZE (MAX_NUM_IDT_ENTRIES * sizeof(struct irq_stat))
+
+static struct irq_stat boot_irq_stats[MAX_NUM_IDT_ENTRIES];
+
+void irqstat_init_boot(struct percpu *cpu) {
+    cpu->irq_stats = boot_irq_stats;
+}
+
+bool irqstat_alloc_cpu(struct percpu *cpu) {
+    cpu->irq_stats = kmalloc(IRQSTAT_TABLE_SIZE);
+    if (!cpu->irq_stats) {
+        return false;
+    }
+    memset(cpu->irq_stats, 0, IRQSTAT_TABLE_SIZE);
+    return true;
+}
+
+void irqstat_free_cpu(struct percpu *cpu) {
+    kfree(cpu->irq_stats);
+    cpu->irq_stats = NULL;
+}
+
+// each CPU counts into its own table, so handlers on different CPUs never
+// share a cache line; the tables are summed when printed
+void irqstat_account(uint64_t vector, uint64_t start) {
+    uint64_t cycles = rdtsc() - start;
+    struct irq_stat *stats = this_cpu()->irq_stats;
+    if (!stats) {
+        return;
+    }
+    struct irq_stat *stat = &stats[vector & (MAX_NUM_IDT_ENTRIES - 1)];
+
+    unsigned int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= IRQSTAT_BUCKETS) {
+        bucket = IRQSTAT_BUCKETS - 1;
+    }
+
+    stat->count++;
+    stat->total_cycles += cycles;
+    if (cycles > stat->max_cycles) {
+        stat->max_cycles = cycles;
+    }
+    stat->histogram[bucket]++;
+}
+
+// other CPUs keep counting while their tables are cleared, so a row can
+// come out slightly off; these are statistics, not accounting
+void irqstat_reset(void) {
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        struct percpu *cpu = cpu_data(id);
+        if (cpu && cpu->irq_stats) {
+            uint64_t flags = irq_save();
+            memset(cpu->irq_stats, 0, IRQSTAT_TABLE_SIZE);
+            irq_restore(flags);
+        }
+    }
+}
+
+static void sum_vector(int vector, struct irq_stat *sum) {
+    memset(sum, 0, sizeof(*sum));
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        struct percpu *cpu = cpu_data(id);
+        if (!cpu || !cpu->irq_stats) {
+            continue;
+        }
+        // copy first so an IRQ on this CPU cannot tear the row
+        uint64_t flags = irq_save();
+        struct irq_stat stat = cpu->irq_stats[vector];
+        irq_restore(flags);
+
+        sum->count += stat.count;
+        sum->total_cycles += stat.total_cycles;
+        if (stat.max_cycles > sum->max_cycles) {
+            sum->max_cycles = stat.max_cycles;
+        }
+        for (int bucket = 0; bucket < IRQSTAT_BUCKETS; bucket++) {
+            sum->histogram[bucket] += stat.histogram[bucket];
+        }
+    }
+}
+
+// the same table goes to the terminal or the serial port
+static void irqstat_print(void (*write)(const char *), void (*write_dec)(uint64_t)) {
+    write("vector\tcount\tavg\tmax\thistogram (log2 cycles:count)\n");
+
+    for (int vector = 0; vector < MAX_NUM_IDT_ENTRIES; vector++) {
+        struct irq_stat stat;
+        sum_vector(vector, &stat);
+
+        if (!stat.count) {
+            continue;
+        }
+
+        write_dec(vector);
+        write("\t");
+        write_dec(stat.count);
+        write("\t");
+        write_dec(stat.total_cycles / stat.count);
+        write("\t");
+        write_dec(stat.max_cycles);
+        write("\t");
+        for (int bucket = 0; bucket < IRQSTAT_BUCKETS; bucket++) {
+            if (stat.histogram[bucket]) {
+                write_dec(bucket);
+                write(":");
+                write_dec(stat.histogram[bucket]);
+                write(" ");
+            }
+        }
+        write("\n");
+    }
+}
+
+void irqstat_show(void) {
+    terminal_write("\n=== Interrupt Statistics ===\n");
+    irqstat_print(terminal_write, terminal_write_dec);
+}
+
+void irqstat_dump_serial(void) {
+    serial_write("\n=== Interrupt Statistics ===\n");
+    irqstat_print(serial_write, serial_write_dec);
+}
+
+void irqstat_command(const char *args) {
+    char option[16];
+    getfirststr(args, option, sizeof(option));
+
+    if (strcmp(option, "serial")) {
+        irqstat_dump_serial();
+        terminal_write("Interrupt statistics written to serial\n");
+    } else if (strcmp(option, "reset")) {
+        irqstat_reset();
+    } else {
+        irqstat_show();
+    }
+}
@@ -1,37 +1,128 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
-#include "serial.h"
+#include "cpu.h"
+#include "ktime.h"
+#include "str.h"
+#include "memory.h"
 #include "terminal.h"
 #include "keyboard.h"
+#include "interrupts.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "input.h"
+
+static const char scancode_to_ascii_lower[] = {
+    0,   0,   '1', '2', '3',  '4', '5', '6', '7', '8', '9', '0', '-',  '=',  '\b',
+    '\t','q', 'w', 'e', 'r',  't', 'y', 'u', 'i', 'o', 'p', '[', ']',  '\n',
+    0,   'a', 's', 'd', 'f',  'g', 'h', 'j', 'k', 'l', ';', '\'','`',
+    0,   '\\','z', 'x', 'c',  'v', 'b', 'n', 'm', ',', '.', '/',  0,
+    '*', 0,   ' '
+};
+
+static const char scancode_to_ascii_upper[] = {
+    0,   0,   '!', '@', '#',  '$', '%', '^', '&', '*', '(', ')', '_',  '+',  '\b',
+    '\t','Q', 'W', 'E', 'R',  'T', 'Y', 'U', 'I', 'O', 'P', '{', '}',  '\n',
+    0,   'A', 'S', 'D', 'F',  'G', 'H', 'J', 'K', 'L', ':', '"', '~',
+    0,   '|', 'Z', 'X', 'C',  'V', 'B', 'N', 'M', '<', '>', '?',  0,
+    '*', 0,   ' '
+};
+
+// modifier and prefix state; only the IRQ handler changes it
+static uint8_t modifiers = 0;
+static bool extended_prefix = false;
+static uint8_t pause_bytes_left = 0;
+
+// Events go from the IRQ straight into the ring and the IRQ wakes the
+// readers, so nothing sits between a key and whoever waits for it. The
+// ring takes one consumer at a time, which kb_read_lock enforces.
+static struct input_ring kb_events;
+static struct wait_queue kb_wait = WAIT_QUEUE_INIT("kb_wait");
+static struct spinlock kb_read_lock = SPINLOCK_INIT("kb_read");
+
+// IRQ to reader delay of every event read, kept under kb_read_lock
+static struct input_latency kb_latency;
+
+static void keyboard_irq(struct interrupt_frame *frame, void *ctx);
 
 void keyboard_init(void) {
-    shift_pressed = false;
-    caps_lock = false;
-    kb_buffer_read = 0;
-    kb_buffer_write = 0;
+    modifiers = 0;
+    extended_prefix = false;
+    pause_bytes_left = 0;
+    input_ring_init(&kb_events);
+    memset(&kb_latency, 0, sizeof(kb_latency));
+    request_irq(ISA_IRQ_VECTOR(1), keyboard_irq, NULL);
+}
+
+static void latency_account(uint64_t tsc) {
+    uint64_t cycles = rdtsc() - tsc;
+    unsigned int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if (bucket >= INPUT_LATENCY_BUCKETS) {
+        bucket = INPUT_LATENCY_BUCKETS - 1;
+    }
+
+    kb_latency.count++;
+    kb_latency.total_cycles += cycles;
+    if (cycles > kb_latency.max_cycles) {
+        kb_latency.max_cycles = cycles;
+    }
+    kb_latency.histogram[bucket]++;
 }
 
-static void kb_buffer_put(char c) {
-    int next = (kb_buffer_write + 1) % KB_BUFFER_SIZE;
-    if (next != kb_buffer_read) {
-        kb_buffer[kb_buffer_write] = c;
-        kb_buffer_write = next;
+bool keyboard_poll_event(struct input_event *event) {
+    uint64_t flags = spin_lock_irqsave(&kb_read_lock);
+    bool got = input_ring_pop(&kb_events, event);
+    if (got) {
+        latency_account(event->tsc);
+    }
+    spin_unlock_irqrestore(&kb_read_lock, flags);
+    return got;
+}
+
+bool keyboard_has_event(void) {
+    return !input_ring_empty(&kb_events);
+}
+
+static bool kb_ready(void *ctx) {
+    (void)ctx;
+    return keyboard_has_event();
+}
+
+bool keyboard_read_event(struct input_event *event, uint64_t timeout_ns) {
+    uint64_t deadline = timeout_ns == WAIT_FOREVER ? WAIT_FOREVER : ktime_ns() + timeout_ns;
+
+    // another reader may take the event first, so wait again
+    for (;;) {
+        if (keyboard_poll_event(event)) {
+            return true;
+        }
+        uint64_t now = ktime_ns();
+        if (now >= deadline) {
+            return false;
+        }
+        wait_until(&kb_wait, kb_ready, NULL, deadline == WAIT_FOREVER ? WAIT_FOREVER : deadline - now);
     }
 }
 
 char keyboard_get_char(void) {
-    if (kb_buffer_read == kb_buffer_write) {
-        return 0;
+    struct input_event event;
+    while (keyboard_poll_event(&event)) {
+        if (event.down && event.ascii) {
+            return event.ascii;
+        }
     }
-    
-    char c = kb_buffer[kb_buffer_read];
-    kb_buffer_read = (kb_buffer_read + 1) % KB_BUFFER_SIZE;
-    return c;
+    return 0;
 }
 
-bool keyboard_has_char(void) {
-    return kb_buffer_read != kb_buffer_write;
+char keyboard_read_char(void) {
+    struct input_event event;
+    for (;;) {
+        keyboard_read_event(&event, WAIT_FOREVER);
+        if (event.down && event.ascii) {
+            return event.ascii;
+        }
+    }
 }
 
 static inline uint8_t inb_t(uint16_t port) {
@@ -40,38 +131,141 @@ static inline uint8_t inb_t(uint16_t port) {
     return ret;
 }
 
-void keyboard_handle_irq(uint8_t scancode) {
-    
-    if (scancode == SCANCODE_LSHIFT_PRESS || scancode == SCANCODE_RSHIFT_PRESS) {
-        shift_pressed = true;
+static uint8_t modifier_bit(uint8_t code) {
+    switch (code) {
+    case SCANCODE_LSHIFT_PRESS:
+    case SCANCODE_RSHIFT_PRESS:
+        return INPUT_MOD_SHIFT;
+    case SCANCODE_CTRL_PRESS:
+        return INPUT_MOD_CTRL;
+    case SCANCODE_ALT_PRESS:
+        return INPUT_MOD_ALT;
+    }
+    return 0;
+}
+
+// the keypad keys that share a code with a main key but keep a character
+static char extended_ascii(uint8_t code) {
+    switch (code) {
+    case SCANCODE_KEYPAD_ENTER:
+        return '\n';
+    case SCANCODE_KEYPAD_SLASH:
+        return '/';
+    }
+    return 0;
+}
+
+void keyboard_handle_scancode(uint8_t scancode, uint64_t tsc) {
+    // Pause sends E1 1D 45 E1 9D C5 and no break code; report it as one
+    // press of its final make code
+    if (pause_bytes_left) {
+        pause_bytes_left--;
+        if (pause_bytes_left) {
+            return;
+        }
+        scancode = SCANCODE_PAUSE;
+    } else if (scancode == SCANCODE_PAUSE_PREFIX) {
+        pause_bytes_left = 5;
         return;
     }
-    if (scancode == SCANCODE_LSHIFT_RELEASE || scancode == SCANCODE_RSHIFT_RELEASE) {
-        shift_pressed = false;
+
+    // extended keys arrive as a prefix and then a normal code
+    if (scancode == SCANCODE_EXTENDED) {
+        extended_prefix = true;
         return;
     }
-    
-    if (scancode == SCANCODE_CAPS_LOCK) {
-        caps_lock = !caps_lock;
+    bool extended = extended_prefix;
+    extended_prefix = false;
+
+    struct input_event event;
+    event.tsc = tsc;
+    event.scancode = scancode & 0x7F;
+    event.down = !(scancode & 0x80);
+    event.extended = extended;
+    event.ascii = 0;
+
+    // E0 2A / E0 36 and their breaks are shifts the keyboard fakes around
+    // Print Screen and the navigation keys, not real shift presses
+    if (extended && (event.scancode == SCANCODE_LSHIFT_PRESS || event.scancode == SCANCODE_RSHIFT_PRESS)) {
         return;
     }
-    
-    if (!(scancode & 0x80)) {
-        char c = 0;
-        
-        if (scancode < sizeof(scancode_to_ascii_lower)) {
-            bool uppercase = shift_pressed ^ caps_lock;
-            
-            if (uppercase) {
-                c = scancode_to_ascii_upper[scancode];
-            } else {
-                c = scancode_to_ascii_lower[scancode];
-            }
+
+    uint8_t bit = modifier_bit(event.scancode);
+    if (bit) {
+        if (event.down) {
+            modifiers |= bit;
+        } else {
+            modifiers &= ~bit;
         }
-        
-        if (c != 0) {
-            kb_buffer_put(c);
-            terminal_putchar(c);
+    } else if (event.scancode == SCANCODE_CAPS_LOCK && event.down) {
+        modifiers ^= INPUT_MOD_CAPS;
+    } else if (extended) {
+        event.ascii = event.down ? extended_ascii(event.scancode) : 0;
+    } else if (event.scancode < sizeof(scancode_to_ascii_lower)) {
+        bool uppercase = !(modifiers & INPUT_MOD_SHIFT) != !(modifiers & INPUT_MOD_CAPS);
+        event.ascii = uppercase ? scancode_to_ascii_upper[event.scancode] : scancode_to_ascii_lower[event.scancode];
+    }
+    event.modifiers = modifiers;
+
+    if (input_ring_push(&kb_events, &event)) {
+        wake_up_all(&kb_wait);
+    }
+}
+
+static void keyboard_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+
+    uint64_t tsc = rdtsc();
+    keyboard_handle_scancode(inb_t(0x60), tsc);
+}
+
+void keyboard_latency_show(void) {
+    uint64_t flags = spin_lock_irqsave(&kb_read_lock);
+    struct input_latency stat = kb_latency;
+    spin_unlock_irqrestore(&kb_read_lock, flags);
+
+    terminal_write("\n=== Input Latency (IRQ to reader) ===\n");
+    terminal_write("events: ");
+    terminal_write_dec(stat.count);
+    terminal_write(", dropped: ");
+    terminal_write_dec(kb_events.dropped);
+    terminal_write("\n");
+    if (!stat.count) {
+        return;
+    }
+
+    terminal_write("avg: ");
+    terminal_write_dec(cycles_to_ns(stat.total_cycles / stat.count) / 1000);
+    terminal_write(" us, max: ");
+    terminal_write_dec(cycles_to_ns(stat.max_cycles) / 1000);
+    terminal_write(" us\n");
+    terminal_write("histogram (log2 cycles:count): ");
+    for (int bucket = 0; bucket < INPUT_LATENCY_BUCKETS; bucket++) {
+        if (stat.histogram[bucket]) {
+            terminal_write_dec(bucket);
+            terminal_write(":");
+            terminal_write_dec(stat.histogram[bucket]);
+            terminal_write(" ");
         }
     }
-}
\ No newline at end of file
+    terminal_write("\n");
+}
+
+void keyboard_latency_reset(void) {
+    uint64_t flags = spin_lock_irqsave(&kb_read_lock);
+    memset(&kb_latency, 0, sizeof(kb_latency));
+    spin_unlock_irqrestore(&kb_read_lock, flags);
+    __atomic_store_n(&kb_events.dropped, 0, __ATOMIC_RELAXED);
+}
+
+void inputstat_command(const char *args) {
+    char option[16];
+    getfirststr(args, option, sizeof(option));
+
+    if (strcmp(option, "reset")) {
+        keyboard_latency_reset();
+    } else {
+        keyboard_latency_show();
+    }
+}
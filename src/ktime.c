@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "io.h"
+#include "pit.h"
+#include "serial.h"
+#include "hpet.h"
+#include "rtc.h"
+#include "ktime.h"
+
+#define PIT_HZ             1193182
+#define PIT_GATE_PORT      0x61
+// longest one-shot the 16-bit counter allows in whole milliseconds
+#define CALIBRATE_MS       50
+#define CALIBRATE_ROUNDS   3
+
+#define KTIME_SHIFT        32
+
+static uint64_t boot_tsc = 0;
+static uint64_t tsc_hz = 0;
+static uint64_t ns_mult = 0;
+static uint64_t cycles_mult = 0;
+static bool tsc_invariant = false;
+// wall-clock nanoseconds at boot_tsc
+static uint64_t realtime_base = 0;
+
+// Count TSC ticks across CALIBRATE_MS of PIT channel 2 in one-shot mode,
+// polling its output on port 0x61 so no interrupt handler is involved.
+static uint64_t pit_calibrate(void) {
+    uint16_t count = PIT_HZ * CALIBRATE_MS / 1000;
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
+
+    outb(CMD_PORT, 0xB0);
+    outb(DATA_PORT_2, count & 0xFF);
+    outb(DATA_PORT_2, count >> 8);
+
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    outb(PIT_GATE_PORT, gate);
+    return cycles * 1000 / CALIBRATE_MS;
+}
+
+// same measurement against the HPET main counter, which has a far finer
+// period than the PIT and no port I/O in the loop
+static uint64_t hpet_calibrate(void) {
+    uint64_t target = hpet_frequency() * CALIBRATE_MS / 1000;
+
+    uint64_t start_ticks = hpet_read_counter();
+    uint64_t start = rdtsc();
+    uint64_t ticks;
+    do {
+        ticks = hpet_counter_delta(start_ticks, hpet_read_counter());
+    } while (ticks < target);
+    uint64_t cycles = rdtsc() - start;
+
+    return cycles * NSEC_PER_SEC / hpet_ticks_to_ns(ticks);
+}
+
+void ktime_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = edx & (1 << 8);
+    }
+    if (!tsc_invariant) {
+        serial_write("ktime: TSC is not invariant, times may drift\n");
+    }
+
+    // an SMI or emulator hiccup can only stretch a round, so keep the
+    // shortest
+    tsc_hz = UINT64_MAX;
+    for (int i = 0; i < CALIBRATE_ROUNDS; i++) {
+        uint64_t hz = hpet_available() ? hpet_calibrate() : pit_calibrate();
+        if (hz < tsc_hz) {
+            tsc_hz = hz;
+        }
+    }
+
+    ns_mult = (NSEC_PER_SEC << KTIME_SHIFT) / tsc_hz;
+    // tsc_hz << 32 overflows past 4.29 GHz, so shift the quotient and the
+    // remainder separately; no 128-bit division without libgcc
+    cycles_mult = ((tsc_hz / NSEC_PER_SEC) << KTIME_SHIFT) +
+                  ((tsc_hz % NSEC_PER_SEC) << KTIME_SHIFT) / NSEC_PER_SEC;
+    boot_tsc = rdtsc();
+
+    // the RTC was read once in rtc_init(); carry it forward to boot_tsc
+    // rather than touching CMOS again
+    realtime_base = rtc_time_to_unix(rtc_boot_time()) * NSEC_PER_SEC +
+                    cycles_to_ns(boot_tsc - rtc_boot_tsc());
+
+    serial_write("ktime: TSC ");
+    serial_write_dec(tsc_hz / 1000);
+    serial_write(hpet_available() ? " kHz (HPET)\n" : " kHz (PIT)\n");
+}
+
+uint64_t cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * ns_mult) >> KTIME_SHIFT);
+}
+
+uint64_t ns_to_cycles(uint64_t ns) {
+    return (uint64_t)(((unsigned __int128)ns * cycles_mult) >> KTIME_SHIFT);
+}
+
+uint64_t ktime_ns_to_tsc(uint64_t ns) {
+    return boot_tsc + ns_to_cycles(ns);
+}
+
+uint64_t ktime_cycles(void) {
+    return rdtsc() - boot_tsc;
+}
+
+uint64_t ktime_ns(void) {
+    return cycles_to_ns(ktime_cycles());
+}
+
+uint64_t ktime_tsc_hz(void) {
+    return tsc_hz;
+}
+
+bool ktime_tsc_invariant(void) {
+    return tsc_invariant;
+}
+
+uint64_t clock_realtime(void) {
+    return realtime_base + ktime_ns();
+}
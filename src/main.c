@@ -10,8 +10,20 @@
 #include "rtc.h"
 #include "ata.h"
 #include "ext2.h"
+#include "rcu.h"
 #include "serial.h"
 #include "memory.h"
+#include "slab.h"
+#include "vmm.h"
+#include "fpu.h"
+#include "acpi.h"
+#include "apic.h"
+#include "gdt.h"
+#include "ktime.h"
+#include "timer.h"
+#include "hpet.h"
+#include "smp.h"
+#include "sched.h"
 
 __attribute__((used, section(".limine_requests")))
 volatile uint64_t limine_base_revision[] = LIMINE_BASE_REVISION(4);
@@ -62,7 +74,9 @@ static volatile uint64_t limine_requests_start_marker[] = LIMINE_REQUESTS_START_
 __attribute__((used, section(".limine_requests_end")))
 static volatile uint64_t limine_requests_end_marker[] = LIMINE_REQUESTS_END_MARKER;
 
+// early boot failure, before there is anything to idle for
 static void hcf(void) {
+    asm ("cli");
     for (;;) {
         asm ("hlt");
     }
@@ -92,8 +106,11 @@ static struct limine_file *find_module(const char *name) {
 }
 
 void kmain(void) {
+    // locks disable preemption through the per-CPU area, so it has to be
+    // reachable before anything takes one
+    percpu_init_boot();
 
-
+    memory_init();
     serial_init();
     rtc_init();
     
@@ -131,17 +148,19 @@ void kmain(void) {
     terminal_write("Hello from ShibliOS!\n");
     terminal_set_color(0x00FF00);
 
-    uint8_t hour;
-    uint8_t minute;
-    uint8_t second;
-
-    rtc_read_time(&hour, &minute, &second);
+    const struct rtc_time *now = rtc_boot_time();
     terminal_write("Current Time: ");
-    terminal_write_dec(hour);
+    terminal_write_dec(now->year);
+    terminal_write("-");
+    terminal_write_dec(now->month);
+    terminal_write("-");
+    terminal_write_dec(now->day);
+    terminal_write(" ");
+    terminal_write_dec(now->hour);
     terminal_write(":");
-    terminal_write_dec(minute);
+    terminal_write_dec(now->minute);
     terminal_write(":");
-    terminal_write_dec(second);
+    terminal_write_dec(now->second);
     terminal_write("\n");
 
 
@@ -152,21 +171,36 @@ void kmain(void) {
     terminal_enable_prompt(true);
     terminal_set_cursor(10, 75);
 
+    gdt_init();
     idt_init();
     setup_paging();
     pmm_init();
+    slab_init();
+    vmm_init();
+    fpu_init();
+    if (acpi_init()) {
+        hpet_init();
+    }
+    ktime_init();
+    apic_init();
+    serial_irq_init();
+    timer_subsystem_init();
+    sched_init();
+    rcu_init();
+    smp_init();
     
+    ata_init();
     ata_identify();
+    ext2_init_caches();
     parse_superblock();
     parse_blockgroup_descriptors();
 
     terminal_set_color(0xFFFFFF);
 
     terminal_prompt();
+    terminal_start_shell();
 
-    
-
-    hcf();
+    cpu_idle();
     
 
 
@@ -1,21 +1,106 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
+#include "cpu.h"
 #include "memory.h"
 
-void* memcpy(void *restrict dest, const void *restrict src, size_t n) {
-    uint8_t *restrict pdest = (uint8_t *restrict)dest;
-    const uint8_t *restrict psrc = (const uint8_t *restrict)src;
-    for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+// below this size the rep string startup cost outweighs the word loop
+// unless the CPU advertises fast short rep movsb
+#define REP_STRING_THRESHOLD 256
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef uint64_t __attribute__((may_alias)) aligned_u64;
+
+static bool has_erms = false;
+static bool has_fsrm = false;
+
+void memory_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) {
+        return;
+    }
+
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    has_erms = ebx & (1 << 9);
+    has_fsrm = edx & (1 << 4);
+}
+
+static inline bool use_rep_movsb(size_t n) {
+    return has_fsrm || (has_erms && n >= REP_STRING_THRESHOLD);
+}
+
+// forward copy shared by memcpy and the non-overlapping memmove case;
+// the destination is word aligned first so the stores never split a line
+static void copy_forward(uint8_t *d, const uint8_t *s, size_t n) {
+    if (use_rep_movsb(n)) {
+        asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+        return;
+    }
+
+    while (n && ((uintptr_t)d & 7)) {
+        *d++ = *s++;
+        n--;
+    }
+    while (n >= 8) {
+        *(aligned_u64 *)d = *(const unaligned_u64 *)s;
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+    while (n) {
+        *d++ = *s++;
+        n--;
+    }
+}
+
+static void copy_backward(uint8_t *d, const uint8_t *s, size_t n) {
+    d += n;
+    s += n;
+
+    while (n && ((uintptr_t)d & 7)) {
+        *--d = *--s;
+        n--;
+    }
+    while (n >= 8) {
+        d -= 8;
+        s -= 8;
+        *(aligned_u64 *)d = *(const unaligned_u64 *)s;
+        n -= 8;
+    }
+    while (n) {
+        *--d = *--s;
+        n--;
     }
+}
+
+void* memcpy(void *restrict dest, const void *restrict src, size_t n) {
+    copy_forward((uint8_t *)dest, (const uint8_t *)src, n);
     return dest;
 }
 
 void* memset(void *s, int c, size_t n) {
     uint8_t *p = (uint8_t *)s;
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+
+    if (has_erms && n >= REP_STRING_THRESHOLD) {
+        asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+        return s;
+    }
+
+    uint64_t pattern = (uint8_t)c * 0x0101010101010101ULL;
+    while (n && ((uintptr_t)p & 7)) {
+        *p++ = (uint8_t)c;
+        n--;
+    }
+    while (n >= 8) {
+        *(aligned_u64 *)p = pattern;
+        p += 8;
+        n -= 8;
+    }
+    while (n) {
+        *p++ = (uint8_t)c;
+        n--;
     }
     return s;
 }
@@ -23,14 +108,12 @@ void* memset(void *s, int c, size_t n) {
 void* memmove(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+
+    // a forward copy is safe unless the destination starts inside the source
+    if (pdest <= psrc || pdest >= psrc + n) {
+        copy_forward(pdest, psrc, n);
+    } else {
+        copy_backward(pdest, psrc, n);
     }
     return dest;
 }
@@ -38,10 +121,17 @@ void* memmove(void *dest, const void *src, size_t n) {
 int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
+
+    // skip equal words; the first differing word is settled bytewise below
+    while (n >= 8 && *(const unaligned_u64 *)p1 == *(const unaligned_u64 *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
         }
     }
     return 0;
-}
\ No newline at end of file
+}
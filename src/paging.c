@@ -1,15 +1,45 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "limine.h"
 #include "terminal.h"
 #include "paging.h"
 #include "memory.h"
+#include "buddy.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "percpu.h"
+#include "smp.h"
+
+static struct pml4_entry *pml4 = NULL;
+static uint64_t hhdm_offset = 0;
+
+static uint64_t total_pages = 0;
+static uint64_t used_pages = 0;
+
+// Lock order is page tables, then zero pool, then pmm: building a table
+// takes a zeroed page, and a pool miss falls through to the buddy
+// allocator. All three are taken with interrupts off since slab frees and
+// table updates can come from interrupt context.
+static struct mcs_lock pmm_lock = MCS_LOCK_INIT("pmm");
+static struct spinlock zero_pool_lock = SPINLOCK_INIT("zero_pool");
+static struct spinlock page_table_lock = SPINLOCK_INIT("page_tables");
+
+static void tlb_flush_irq(struct interrupt_frame *frame, void *ctx);
 
 void *phys_to_virt(uint64_t phys_addr) {
     return (void *)(hhdm_offset + phys_addr);
 }
 
+uint64_t virt_to_phys(void *virt_addr) {
+    return (uint64_t)virt_addr - hhdm_offset;
+}
+
+static bool gb_pages_supported = false;
+
 void setup_paging(void) {
 
     if (!hhdm_request.response) {
@@ -23,6 +53,33 @@ void setup_paging(void) {
     uint64_t pml4_phys = cr3 & ~0xFFF;
     
     pml4 = (struct pml4_entry *)(hhdm_offset + pml4_phys);
+    
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        gb_pages_supported = (edx >> 26) & 1;
+    }
+
+    request_irq(TLB_FLUSH_VECTOR, tlb_flush_irq, NULL);
+}
+
+static uint64_t pmm_max_pfn = 0;
+static uint64_t pmm_meta_pages = 0;
+
+static bool usable_page_range(struct limine_memmap_entry *entry, uint64_t *base_page, uint64_t *end_page) {
+    if (entry->type != LIMINE_MEMMAP_USABLE) {
+        return false;
+    }
+    
+    *base_page = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+    *end_page = (entry->base + entry->length) / PAGE_SIZE;
+
+    // physical page 0 doubles as the allocation failure value
+    if (*base_page == 0) {
+        *base_page = 1;
+    }
+    return *base_page < *end_page;
 }
 
 void pmm_init(void) {
@@ -31,94 +88,410 @@ void pmm_init(void) {
         return;
     }
     
-    memset(page_bitmap, 0xFF, sizeof(page_bitmap));
-    
     struct limine_memmap_response *memmap = memmap_request.response;
+    uint64_t base_page;
+    uint64_t end_page;
 
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        if (usable_page_range(memmap->entries[i], &base_page, &end_page) && end_page > pmm_max_pfn) {
+            pmm_max_pfn = end_page;
+        }
+    }
     
+    // the allocator metadata is carved from the front of the first usable
+    // region large enough to hold it and reached through the HHDM
+    pmm_meta_pages = (buddy_metadata_size(pmm_max_pfn) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t meta_page = 0;
+
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap->entries[i];
-        
-        if (entry->type != LIMINE_MEMMAP_USABLE) {
-            continue;
+        if (usable_page_range(memmap->entries[i], &base_page, &end_page) && end_page - base_page >= pmm_meta_pages) {
+            meta_page = base_page;
+            break;
         }
-        
-        uint64_t base_page = entry->base / PAGE_SIZE;
-        uint64_t num_pages = entry->length / PAGE_SIZE;
+    }
     
+    if (!meta_page) {
+        terminal_write("ERROR: No room for PMM metadata\n");
+        return;
+    }
+    
+    buddy_init(phys_to_virt(meta_page * PAGE_SIZE), pmm_max_pfn);
+    
+    for (uint64_t i = 0; i < memmap->entry_count; i++) {
+        if (!usable_page_range(memmap->entries[i], &base_page, &end_page)) {
+            continue;
+        }
         
-        for (uint64_t p = 0; p < num_pages; p++) {
-            uint64_t page_num = base_page + p;
-            
-            if (page_num >= BITMAP_SIZE * 8) {
-                break;
+        if (base_page == meta_page) {
+            base_page += pmm_meta_pages;
+            if (base_page >= end_page) {
+                continue;
             }
-            
-            uint64_t byte_index = page_num / 8;
-            uint64_t bit_index = page_num % 8;
-            page_bitmap[byte_index] &= ~(1 << bit_index);
-            total_pages++;
         }
+        
+        buddy_add_range(base_page, end_page - base_page);
+        total_pages += end_page - base_page;
     }
 }
 
-uint64_t allocate_page(void) {
-    for (uint64_t i = next_free_page; i < BITMAP_SIZE * 8; i++) {
-        uint64_t byte_index = i / 8;
-        uint64_t bit_index = i % 8;
-        
-        if (!(page_bitmap[byte_index] & (1 << bit_index))) {
-            page_bitmap[byte_index] |= (1 << bit_index);
-            used_pages++;
-            next_free_page = i + 1;
-            
-            uint64_t phys_addr = i * PAGE_SIZE;
-            return phys_addr;
-        }
+uint64_t alloc_pages(unsigned int order) {
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+    uint64_t pfn = buddy_alloc(order);
+    if (pfn != BUDDY_NONE) {
+        used_pages += 1ULL << order;
     }
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
     
-    terminal_set_color(0xFF0000);
-    terminal_write("ERROR: Out of physical memory!\n");
-    terminal_set_color(0xFFFFFF);
-    return 0;
+    if (pfn == BUDDY_NONE) {
+        terminal_set_color(0xFF0000);
+        terminal_write("ERROR: Out of physical memory!\n");
+        terminal_set_color(0xFFFFFF);
+        return 0;
+    }
+    return pfn * PAGE_SIZE;
 }
 
-void free_page(uint64_t phys_addr) {
+void free_pages(uint64_t phys_addr, unsigned int order) {
     uint64_t page_num = phys_addr / PAGE_SIZE;
     
-    if (page_num >= BITMAP_SIZE * 8) {
+    if (page_num == 0 || page_num >= pmm_max_pfn) {
         return;
     }
     
-    uint64_t byte_index = page_num / 8;
-    uint64_t bit_index = page_num % 8;
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+    buddy_free(page_num, order);
+    used_pages -= 1ULL << order;
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+uint64_t alloc_contig_pages(uint64_t count) {
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+    uint64_t pfn = buddy_alloc_contig(count);
+    if (pfn != BUDDY_NONE) {
+        used_pages += count;
+    }
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+    
+    if (pfn == BUDDY_NONE) {
+        terminal_set_color(0xFF0000);
+        terminal_write("ERROR: No contiguous run of ");
+        terminal_write_dec(count);
+        terminal_write(" pages!\n");
+        terminal_set_color(0xFFFFFF);
+        return 0;
+    }
+    return pfn * PAGE_SIZE;
+}
+
+void free_contig_pages(uint64_t phys_addr, uint64_t count) {
+    uint64_t page_num = phys_addr / PAGE_SIZE;
     
-    page_bitmap[byte_index] &= ~(1 << bit_index);
-    used_pages--;
+    if (page_num == 0 || page_num >= pmm_max_pfn) {
+        return;
+    }
     
-    if (page_num < next_free_page) {
-        next_free_page = page_num;
+    struct mcs_node node;
+    uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+    buddy_free_contig(page_num, count);
+    used_pages -= count;
+    mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+}
+
+uint64_t allocate_page(void) {
+    return alloc_pages(0);
+}
+
+void free_page(uint64_t phys_addr) {
+    free_pages(phys_addr, 0);
+}
+
+// Pages zeroed ahead of time by the idle loop, so page table creation and
+// demand-zero faults do not pay for the memset.
+static uint64_t zero_pool[ZERO_POOL_PAGES];
+static uint32_t zero_pool_count = 0;
+static uint64_t zero_pool_hits = 0;
+static uint64_t zero_pool_misses = 0;
+
+uint64_t allocate_zeroed_page(void) {
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+    if (zero_pool_count > 0) {
+        uint64_t phys = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+        return phys;
     }
+    zero_pool_misses++;
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+    uint64_t phys = allocate_page();
+    if (phys) {
+        memset(phys_to_virt(phys), 0, PAGE_SIZE);
+    }
+    return phys;
 }
 
-void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
-    if (!pml4) {
-        terminal_write("ERROR: Paging not initialized\n");
+void zero_pool_refill(void) {
+    if (!pmm_max_pfn) {
         return;
     }
+
+    while (zero_pool_count < ZERO_POOL_PAGES) {
+        struct mcs_node node;
+        uint64_t flags = mcs_lock_irqsave(&pmm_lock, &node);
+        uint64_t phys = buddy_alloc(0);
+        if (phys != BUDDY_NONE) {
+            used_pages++;
+        }
+        mcs_unlock_irqrestore(&pmm_lock, &node, flags);
+
+        if (phys == BUDDY_NONE) {
+            return;
+        }
+
+        // zero with no lock held; nobody else can see this page yet
+        memset(phys_to_virt(phys * PAGE_SIZE), 0, PAGE_SIZE);
+
+        flags = spin_lock_irqsave(&zero_pool_lock);
+        bool stored = zero_pool_count < ZERO_POOL_PAGES;
+        if (stored) {
+            zero_pool[zero_pool_count++] = phys * PAGE_SIZE;
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        if (!stored) {
+            free_page(phys * PAGE_SIZE);
+            return;
+        }
+    }
+}
+
+// Invalidations are gathered while page table entries are rewritten and
+// issued once at the end: one invlpg per page for small batches, a CR3
+// reload once more than TLB_FLUSH_THRESHOLD pages changed. Entries that
+// were not present before are never cached, so they need no invalidation.
+// Tables unlinked from the hierarchy are freed only once every CPU has
+// flushed, since paging-structure caches may still point at them until then.
+#define TLB_BATCH_TABLES 8
+
+struct tlb_batch {
+    uint64_t addrs[TLB_FLUSH_THRESHOLD];
+    uint32_t count;
+    bool flush_all;
+    uint64_t tables[TLB_BATCH_TABLES];
+    int table_levels[TLB_BATCH_TABLES];
+    uint32_t table_count;
+};
+
+// release a table and every table below it; level 1 is a PT, 2 a PD
+static void free_table(uint64_t table_phys, int level) {
+    if (level > 1) {
+        struct pd_entry *entries = (struct pd_entry *)phys_to_virt(table_phys);
+        for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+            if (entries[i].present && !entries[i].page_size) {
+                free_table(entries[i].address << 12, level - 1);
+            }
+        }
+    }
+    free_page(table_phys);
+}
+
+static void flush_tlb_all(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+static void tlb_batch_add(struct tlb_batch *batch, uint64_t virtual_addr) {
+    if (batch->flush_all) {
+        return;
+    }
+    if (batch->count == TLB_FLUSH_THRESHOLD) {
+        batch->flush_all = true;
+        return;
+    }
+    batch->addrs[batch->count++] = virtual_addr;
+}
+
+static void tlb_flush_local(const uint64_t *addrs, uint32_t count, bool flush_all) {
+    if (flush_all) {
+        flush_tlb_all();
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            asm volatile("invlpg (%0)" : : "r"(addrs[i]) : "memory");
+        }
+    }
+}
+
+// Every CPU shares the kernel page tables, so each batch is also sent to
+// the other online CPUs as a shootdown. There is one request slot; it is
+// only written under page_table_lock, which every flush is issued under.
+static struct {
+    uint64_t addrs[TLB_FLUSH_THRESHOLD];
+    uint32_t count;
+    bool flush_all;
+    // CPUs, by percpu id, that have not flushed yet
+    volatile uint64_t pending;
+} shootdown;
+
+static void tlb_shootdown_ack(void) {
+    uint64_t bit = 1ULL << smp_processor_id();
+    if (!(__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) & bit)) {
+        return;
+    }
+    tlb_flush_local(shootdown.addrs, shootdown.count, shootdown.flush_all);
+    __atomic_and_fetch(&shootdown.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+static void tlb_flush_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    tlb_shootdown_ack();
+}
+
+// A CPU spinning for the lock may be one the holder waits on for an ack,
+// and it has interrupts off, so it answers shootdowns from the loop.
+static uint64_t page_tables_lock(void) {
+    uint64_t flags = irq_save();
+    while (!spin_trylock(&page_table_lock)) {
+        tlb_shootdown_ack();
+        asm volatile("pause");
+    }
+    return flags;
+}
+
+static void page_tables_unlock(uint64_t flags) {
+    spin_unlock(&page_table_lock);
+    irq_restore(flags);
+}
+
+static void tlb_shootdown(struct tlb_batch *batch) {
+    uint32_t self = smp_processor_id();
+    uint64_t targets = 0;
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        if (id != self && cpu_data(id)) {
+            targets |= 1ULL << id;
+        }
+    }
+    if (!targets || !apic_enabled()) {
+        return;
+    }
+
+    shootdown.count = batch->count;
+    shootdown.flush_all = batch->flush_all;
+    memcpy(shootdown.addrs, batch->addrs, batch->count * sizeof(uint64_t));
+    __atomic_store_n(&shootdown.pending, targets, __ATOMIC_RELEASE);
+
+    // the ICR write is fenced, so the request is visible before the IPI
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        if (targets & (1ULL << id)) {
+            lapic_send_ipi(cpu_data(id)->apic_id, TLB_FLUSH_VECTOR);
+        }
+    }
+    while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+}
+
+// caller holds page_table_lock
+static void tlb_batch_flush(struct tlb_batch *batch) {
+    if (!batch->flush_all && !batch->count) {
+        return;
+    }
+    tlb_flush_local(batch->addrs, batch->count, batch->flush_all);
+    tlb_shootdown(batch);
+    batch->count = 0;
+    batch->flush_all = false;
+
+    // no CPU can walk into these any more
+
+    for (uint32_t i = 0; i < batch->table_count; i++) {
+        free_table(batch->tables[i], batch->table_levels[i]);
+    }
+    batch->table_count = 0;
+}
+
+// unlinking a table drops every translation below it, so this always
+// ends in a full flush
+static void tlb_batch_free_table(struct tlb_batch *batch, uint64_t table_phys, int level) {
+    batch->flush_all = true;
+    if (batch->table_count == TLB_BATCH_TABLES) {
+        tlb_batch_flush(batch);
+        batch->flush_all = true;
+    }
+    batch->tables[batch->table_count] = table_phys;
+    batch->table_levels[batch->table_count] = level;
+    batch->table_count++;
+}
+
+static uint64_t new_table(void) {
+    return allocate_zeroed_page();
+}
+
+// replace a 1 GiB mapping by a PD of 2 MiB mappings of the same memory
+static bool split_1g_page(struct pdpt_entry *pdpte, uint64_t virtual_addr, struct tlb_batch *batch) {
+    uint64_t pd_phys = new_table();
+    if (!pd_phys) return false;
     
-    uint64_t pml4_i = (virtual_addr >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virtual_addr >> 30) & 0x1FF;
-    uint64_t pd_i = (virtual_addr >> 21) & 0x1FF;
-    uint64_t pt_i = (virtual_addr >> 12) & 0x1FF;
+    struct pd_entry *pd = (struct pd_entry *)phys_to_virt(pd_phys);
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        struct pd_entry entry = {0};
+        entry.present = 1;
+        entry.rw = pdpte->rw;
+        entry.user = pdpte->user;
+        entry.pwt = pdpte->pwt;
+        entry.pcd = pdpte->pcd;
+        entry.page_size = 1;
+        entry.address = pdpte->address + i * (PAGE_SIZE_2M >> 12);
+        pd[i] = entry;
+    }
     
-    struct pml4_entry *pml4e = &pml4[pml4_i];
+    struct pdpt_entry table = {0};
+    table.present = 1;
+    table.rw = 1;
+    table.user = pdpte->user;
+    table.address = pd_phys >> 12;
+    *pdpte = table;
+    
+    tlb_batch_add(batch, virtual_addr & ~(PAGE_SIZE_1G - 1));
+    return true;
+}
+
+// replace a 2 MiB mapping by a PT of 4 KiB mappings of the same memory
+static bool split_2m_page(struct pd_entry *pde, uint64_t virtual_addr, struct tlb_batch *batch) {
+    uint64_t pt_phys = new_table();
+    if (!pt_phys) return false;
+    
+    struct pt_entry *pt = (struct pt_entry *)phys_to_virt(pt_phys);
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        struct pt_entry entry = {0};
+        entry.present = 1;
+        entry.rw = pde->rw;
+        entry.user = pde->user;
+        entry.pwt = pde->pwt;
+        entry.pcd = pde->pcd;
+        entry.address = pde->address + i;
+        pt[i] = entry;
+    }
+    
+    struct pd_entry table = {0};
+    table.present = 1;
+    table.rw = 1;
+    table.user = pde->user;
+    table.address = pt_phys >> 12;
+    *pde = table;
+    
+    tlb_batch_add(batch, virtual_addr & ~(PAGE_SIZE_2M - 1));
+    return true;
+}
+
+static struct pdpt_entry *walk_pdpt(uint64_t virtual_addr, uint64_t flags) {
+    struct pml4_entry *pml4e = &pml4[(virtual_addr >> 39) & 0x1FF];
     if (!pml4e->present) {
-        uint64_t new_pdpt_phys = allocate_page();
-        if (!new_pdpt_phys) return;
-        
-        struct pdpt_entry *new_pdpt = (struct pdpt_entry *)phys_to_virt(new_pdpt_phys);
-        memset(new_pdpt, 0, PAGE_SIZE);
+        uint64_t new_pdpt_phys = new_table();
+        if (!new_pdpt_phys) return NULL;
         
         pml4e->present = 1;
         pml4e->rw = 1;
@@ -126,85 +499,339 @@ void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
         pml4e->address = new_pdpt_phys >> 12;
     }
     
-    uint64_t pdpt_phys = pml4e->address << 12;
-    struct pdpt_entry *pdpt = (struct pdpt_entry *)phys_to_virt(pdpt_phys);
-    struct pdpt_entry *pdpte = &pdpt[pdpt_i];
+    struct pdpt_entry *pdpt = (struct pdpt_entry *)phys_to_virt(pml4e->address << 12);
+    return &pdpt[(virtual_addr >> 30) & 0x1FF];
+}
+
+static struct pd_entry *walk_pd(uint64_t virtual_addr, uint64_t flags, struct tlb_batch *batch) {
+    struct pdpt_entry *pdpte = walk_pdpt(virtual_addr, flags);
+    if (!pdpte) return NULL;
     
     if (!pdpte->present) {
-        uint64_t new_pd_phys = allocate_page();
-        if (!new_pd_phys) return;
-        
-        struct pd_entry *new_pd = (struct pd_entry *)phys_to_virt(new_pd_phys);
-        memset(new_pd, 0, PAGE_SIZE);
+        uint64_t new_pd_phys = new_table();
+        if (!new_pd_phys) return NULL;
         
         pdpte->present = 1;
         pdpte->rw = 1;
         pdpte->user = (flags & PAGE_USER) ? 1 : 0;
         pdpte->page_size = 0;
         pdpte->address = new_pd_phys >> 12;
+    } else if (pdpte->page_size && !split_1g_page(pdpte, virtual_addr, batch)) {
+        return NULL;
     }
     
-    uint64_t pd_phys = pdpte->address << 12;
-    struct pd_entry *pd = (struct pd_entry *)phys_to_virt(pd_phys);
-    struct pd_entry *pde = &pd[pd_i];
+    struct pd_entry *pd = (struct pd_entry *)phys_to_virt(pdpte->address << 12);
+    return &pd[(virtual_addr >> 21) & 0x1FF];
+}
+
+// returns the PT covering virtual_addr; its entries for the rest of the
+// 2 MiB region follow the returned one
+static struct pt_entry *walk_pt(uint64_t virtual_addr, uint64_t flags, struct tlb_batch *batch) {
+    struct pd_entry *pde = walk_pd(virtual_addr, flags, batch);
+    if (!pde) return NULL;
     
     if (!pde->present) {
-        uint64_t new_pt_phys = allocate_page();
-        if (!new_pt_phys) return;
-        
-        struct pt_entry *new_pt = (struct pt_entry *)phys_to_virt(new_pt_phys);
-        memset(new_pt, 0, PAGE_SIZE);
+        uint64_t new_pt_phys = new_table();
+        if (!new_pt_phys) return NULL;
         
         pde->present = 1;
         pde->rw = 1;
         pde->user = (flags & PAGE_USER) ? 1 : 0;
         pde->page_size = 0;
         pde->address = new_pt_phys >> 12;
+    } else if (pde->page_size && !split_2m_page(pde, virtual_addr, batch)) {
+        return NULL;
     }
     
-    uint64_t pt_phys = pde->address << 12;
-    struct pt_entry *pt = (struct pt_entry *)phys_to_virt(pt_phys);
-    struct pt_entry *pte = &pt[pt_i];
+    struct pt_entry *pt = (struct pt_entry *)phys_to_virt(pde->address << 12);
+    return &pt[(virtual_addr >> 12) & 0x1FF];
+}
+
+static void set_pte(struct pt_entry *pte, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags, struct tlb_batch *batch) {
+    if (pte->present) {
+        tlb_batch_add(batch, virtual_addr);
+    }
     
-    pte->present = 1;
-    pte->rw = (flags & PAGE_WRITE) ? 1 : 0;
-    pte->user = (flags & PAGE_USER) ? 1 : 0;
-    pte->address = physical_addr >> 12;
+    struct pt_entry entry = {0};
+    entry.present = 1;
+    entry.rw = (flags & PAGE_WRITE) ? 1 : 0;
+    entry.user = (flags & PAGE_USER) ? 1 : 0;
+    entry.pwt = (flags & PAGE_PWT) ? 1 : 0;
+    entry.pcd = (flags & PAGE_PCD) ? 1 : 0;
+    entry.address = physical_addr >> 12;
+    *pte = entry;
+}
+
+static bool set_1g_entry(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags, struct tlb_batch *batch) {
+    struct pdpt_entry *pdpte = walk_pdpt(virtual_addr, flags);
+    if (!pdpte) return false;
+    
+    bool had_table = pdpte->present && !pdpte->page_size;
+    bool had_page = pdpte->present && pdpte->page_size;
+    uint64_t old_table = pdpte->address << 12;
+    
+    struct pdpt_entry entry = {0};
+    entry.present = 1;
+    entry.rw = (flags & PAGE_WRITE) ? 1 : 0;
+    entry.user = (flags & PAGE_USER) ? 1 : 0;
+    entry.pwt = (flags & PAGE_PWT) ? 1 : 0;
+    entry.pcd = (flags & PAGE_PCD) ? 1 : 0;
+    entry.page_size = 1;
+    entry.address = physical_addr >> 12;
+    *pdpte = entry;
+    
+    if (had_table) {
+        tlb_batch_free_table(batch, old_table, 2);
+    } else if (had_page) {
+        tlb_batch_add(batch, virtual_addr);
+    }
+    return true;
+}
+
+static bool set_2m_entry(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags, struct tlb_batch *batch) {
+    struct pd_entry *pde = walk_pd(virtual_addr, flags, batch);
+    if (!pde) return false;
+    
+    bool had_table = pde->present && !pde->page_size;
+    bool had_page = pde->present && pde->page_size;
+    uint64_t old_table = pde->address << 12;
+    
+    struct pd_entry entry = {0};
+    entry.present = 1;
+    entry.rw = (flags & PAGE_WRITE) ? 1 : 0;
+    entry.user = (flags & PAGE_USER) ? 1 : 0;
+    entry.pwt = (flags & PAGE_PWT) ? 1 : 0;
+    entry.pcd = (flags & PAGE_PCD) ? 1 : 0;
+    entry.page_size = 1;
+    entry.address = physical_addr >> 12;
+    *pde = entry;
+    
+    if (had_table) {
+        tlb_batch_free_table(batch, old_table, 1);
+    } else if (had_page) {
+        tlb_batch_add(batch, virtual_addr);
+    }
+    return true;
+}
+
+// bytes from addr up to the next multiple of boundary, capped at length
+static uint64_t span_to_boundary(uint64_t addr, uint64_t boundary, uint64_t length) {
+    uint64_t span = boundary - (addr & (boundary - 1));
+    return span < length ? span : length;
+}
+
+void map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    if (!pml4) {
+        terminal_write("ERROR: Paging not initialized\n");
+        return;
+    }
     
-    asm volatile("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    struct tlb_batch batch = {0};
+    uint64_t irq_flags = page_tables_lock();
+    struct pt_entry *pte = walk_pt(virtual_addr, flags, &batch);
+    if (pte) {
+        set_pte(pte, virtual_addr, physical_addr, flags, &batch);
+    }
+    tlb_batch_flush(&batch);
+    page_tables_unlock(irq_flags);
 }
 
-void unmap_page(uint64_t virtual_addr) {
-    if (!pml4) return;
+bool map_large_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t page_size, uint64_t flags) {
+    if (!pml4) {
+        terminal_write("ERROR: Paging not initialized\n");
+        return false;
+    }
     
-    uint64_t pml4_i = (virtual_addr >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virtual_addr >> 30) & 0x1FF;
-    uint64_t pd_i = (virtual_addr >> 21) & 0x1FF;
-    uint64_t pt_i = (virtual_addr >> 12) & 0x1FF;
+    if ((virtual_addr | physical_addr) & (page_size - 1)) {
+        return false;
+    }
     
-    struct pml4_entry *pml4e = &pml4[pml4_i];
-    if (!pml4e->present) return;
+    struct tlb_batch batch = {0};
+    bool mapped = false;
+    uint64_t irq_flags = page_tables_lock();
+    
+    if (page_size == PAGE_SIZE_1G && gb_pages_supported) {
+        mapped = set_1g_entry(virtual_addr, physical_addr, flags, &batch);
+    } else if (page_size == PAGE_SIZE_2M) {
+        mapped = set_2m_entry(virtual_addr, physical_addr, flags, &batch);
+    } else if (page_size == PAGE_SIZE) {
+        struct pt_entry *pte = walk_pt(virtual_addr, flags, &batch);
+        if (pte) {
+            set_pte(pte, virtual_addr, physical_addr, flags, &batch);
+            mapped = true;
+        }
+    }
     
-    struct pdpt_entry *pdpt = (struct pdpt_entry *)phys_to_virt(pml4e->address << 12);
-    struct pdpt_entry *pdpte = &pdpt[pdpt_i];
-    if (!pdpte->present || pdpte->page_size) return;
+    tlb_batch_flush(&batch);
+    page_tables_unlock(irq_flags);
+    return mapped;
+}
+
+bool map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t length, uint64_t flags) {
+    if (!pml4) {
+        terminal_write("ERROR: Paging not initialized\n");
+        return false;
+    }
     
-    struct pd_entry *pd = (struct pd_entry *)phys_to_virt(pdpte->address << 12);
-    struct pd_entry *pde = &pd[pd_i];
-    if (!pde->present || pde->page_size) return;
+    if ((virtual_addr | physical_addr) & (PAGE_SIZE - 1)) {
+        return false;
+    }
+    length = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
     
-    struct pt_entry *pt = (struct pt_entry *)phys_to_virt(pde->address << 12);
-    struct pt_entry *pte = &pt[pt_i];
+    struct tlb_batch batch = {0};
+    bool mapped = true;
+    uint64_t irq_flags = page_tables_lock();
     
-    pte->present = 0;
-    pte->address = 0;
+    // biggest page size both addresses are aligned to and that still fits;
+    // 4 KiB runs fill a whole PT per walk
+    while (length > 0) {
+        uint64_t alignment = virtual_addr | physical_addr;
+        uint64_t step;
+        
+        if (gb_pages_supported && !(alignment & (PAGE_SIZE_1G - 1)) && length >= PAGE_SIZE_1G) {
+            step = PAGE_SIZE_1G;
+            mapped = set_1g_entry(virtual_addr, physical_addr, flags, &batch);
+        } else if (!(alignment & (PAGE_SIZE_2M - 1)) && length >= PAGE_SIZE_2M) {
+            step = PAGE_SIZE_2M;
+            mapped = set_2m_entry(virtual_addr, physical_addr, flags, &batch);
+        } else {
+            step = span_to_boundary(virtual_addr, PAGE_SIZE_2M, length);
+            struct pt_entry *pte = walk_pt(virtual_addr, flags, &batch);
+            mapped = pte != NULL;
+            
+            for (uint64_t offset = 0; mapped && offset < step; offset += PAGE_SIZE) {
+                set_pte(pte++, virtual_addr + offset, physical_addr + offset, flags, &batch);
+            }
+        }
+        
+        if (!mapped) {
+            break;
+        }
+        virtual_addr += step;
+        physical_addr += step;
+        length -= step;
+    }
     
-    asm volatile("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+    tlb_batch_flush(&batch);
+    page_tables_unlock(irq_flags);
+    return mapped;
 }
 
-uint64_t get_physical_address(uint64_t virtual_addr) {
-    if (!pml4) return 0;
+bool map_pages(uint64_t virtual_addr, const uint64_t *physical_pages, uint64_t count, uint64_t flags) {
+    if (!pml4) {
+        terminal_write("ERROR: Paging not initialized\n");
+        return false;
+    }
+    
+    struct tlb_batch batch = {0};
+    bool mapped = true;
+    uint64_t index = 0;
+    uint64_t irq_flags = page_tables_lock();
+    
+    while (index < count) {
+        uint64_t step = span_to_boundary(virtual_addr, PAGE_SIZE_2M, (count - index) * PAGE_SIZE);
+        struct pt_entry *pte = walk_pt(virtual_addr, flags, &batch);
+        if (!pte) {
+            mapped = false;
+            break;
+        }
+        
+        for (uint64_t offset = 0; offset < step; offset += PAGE_SIZE) {
+            set_pte(pte++, virtual_addr + offset, physical_pages[index++], flags, &batch);
+        }
+        virtual_addr += step;
+    }
+    
+    tlb_batch_flush(&batch);
+    page_tables_unlock(irq_flags);
+    return mapped;
+}
+
+void unmap_range(uint64_t virtual_addr, uint64_t length) {
+    if (!pml4) return;
+    
+    virtual_addr &= ~(uint64_t)(PAGE_SIZE - 1);
+    length = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    
+    struct tlb_batch batch = {0};
+    uint64_t irq_flags = page_tables_lock();
+    
+    while (length > 0) {
+        uint64_t step;
+        
+        struct pml4_entry *pml4e = &pml4[(virtual_addr >> 39) & 0x1FF];
+        if (!pml4e->present) {
+            step = span_to_boundary(virtual_addr, 1ULL << 39, length);
+            virtual_addr += step;
+            length -= step;
+            continue;
+        }
+        
+        struct pdpt_entry *pdpt = (struct pdpt_entry *)phys_to_virt(pml4e->address << 12);
+        struct pdpt_entry *pdpte = &pdpt[(virtual_addr >> 30) & 0x1FF];
+        if (!pdpte->present) {
+            step = span_to_boundary(virtual_addr, PAGE_SIZE_1G, length);
+            virtual_addr += step;
+            length -= step;
+            continue;
+        }
+        
+        if (pdpte->page_size) {
+            if (!(virtual_addr & (PAGE_SIZE_1G - 1)) && length >= PAGE_SIZE_1G) {
+                *pdpte = (struct pdpt_entry){0};
+                tlb_batch_add(&batch, virtual_addr);
+                virtual_addr += PAGE_SIZE_1G;
+                length -= PAGE_SIZE_1G;
+                continue;
+            }
+            if (!split_1g_page(pdpte, virtual_addr, &batch)) break;
+        }
+        
+        struct pd_entry *pd = (struct pd_entry *)phys_to_virt(pdpte->address << 12);
+        struct pd_entry *pde = &pd[(virtual_addr >> 21) & 0x1FF];
+        if (!pde->present) {
+            step = span_to_boundary(virtual_addr, PAGE_SIZE_2M, length);
+            virtual_addr += step;
+            length -= step;
+            continue;
+        }
+        
+        if (pde->page_size) {
+            if (!(virtual_addr & (PAGE_SIZE_2M - 1)) && length >= PAGE_SIZE_2M) {
+                *pde = (struct pd_entry){0};
+                tlb_batch_add(&batch, virtual_addr);
+                virtual_addr += PAGE_SIZE_2M;
+                length -= PAGE_SIZE_2M;
+                continue;
+            }
+            if (!split_2m_page(pde, virtual_addr, &batch)) break;
+        }
+        
+        // clear the rest of this PT in one pass
+        struct pt_entry *pt = (struct pt_entry *)phys_to_virt(pde->address << 12);
+        struct pt_entry *pte = &pt[(virtual_addr >> 12) & 0x1FF];
+        step = span_to_boundary(virtual_addr, PAGE_SIZE_2M, length);
+        
+        for (uint64_t offset = 0; offset < step; offset += PAGE_SIZE, pte++) {
+            if (pte->present) {
+                pte->present = 0;
+                pte->address = 0;
+                tlb_batch_add(&batch, virtual_addr + offset);
+            }
+        }
+        virtual_addr += step;
+        length -= step;
+    }
     
+    tlb_batch_flush(&batch);
+    page_tables_unlock(irq_flags);
+}
+
+void unmap_page(uint64_t virtual_addr) {
+    unmap_range(virtual_addr, PAGE_SIZE);
+}
+
+static uint64_t translate(uint64_t virtual_addr) {
     uint64_t pml4_i = (virtual_addr >> 39) & 0x1FF;
     uint64_t pdpt_i = (virtual_addr >> 30) & 0x1FF;
     uint64_t pd_i = (virtual_addr >> 21) & 0x1FF;
@@ -237,6 +864,39 @@ uint64_t get_physical_address(uint64_t virtual_addr) {
     return (pte->address << 12) + offset;
 }
 
+uint64_t get_physical_address(uint64_t virtual_addr) {
+    if (!pml4) return 0;
+    
+    // held so a concurrent remap cannot free a table under the walk
+    uint64_t flags = page_tables_lock();
+    uint64_t phys = translate(virtual_addr);
+    page_tables_unlock(flags);
+    return phys;
+}
+
+// Make physical memory the HHDM does not cover (firmware tables, MMIO)
+// reachable at its usual HHDM address. Missing pages are mapped with the
+// given flags; an uncached request remaps the whole range since device
+// registers must never sit behind a write-back mapping.
+void *map_physical(uint64_t physical_addr, uint64_t length, uint64_t flags) {
+    uint64_t base = physical_addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (physical_addr + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    flags |= PAGE_PRESENT | PAGE_WRITE;
+    
+    if (flags & PAGE_PCD) {
+        if (!map_range(hhdm_offset + base, base, end - base, flags)) {
+            return NULL;
+        }
+    } else {
+        for (uint64_t page = base; page < end; page += PAGE_SIZE) {
+            if (!get_physical_address(hhdm_offset + page)) {
+                map_page(hhdm_offset + page, page, flags);
+            }
+        }
+    }
+    return phys_to_virt(physical_addr);
+}
+
 void pmm_stats(void) {
     terminal_write("\n=== Memory Statistics ===\n");
     terminal_write("Total pages: ");
@@ -256,4 +916,25 @@ void pmm_stats(void) {
     terminal_write(" (");
     terminal_write_dec((total_pages - used_pages) * 4);
     terminal_write(" KB)\n");
+    
+    terminal_write("PMM metadata: ");
+    terminal_write_dec(pmm_meta_pages * 4);
+    terminal_write(" KB for ");
+    terminal_write_dec(pmm_max_pfn);
+    terminal_write(" page frames\n");
+    
+    terminal_write("Zero pool: ");
+    terminal_write_dec(zero_pool_count);
+    terminal_write(" pages (");
+    terminal_write_dec(zero_pool_hits);
+    terminal_write(" hits, ");
+    terminal_write_dec(zero_pool_misses);
+    terminal_write(" misses)\n");
+    
+    terminal_write("Free blocks by order:");
+    for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        terminal_write(" ");
+        terminal_write_dec(buddy_free_blocks(order));
+    }
+    terminal_write("\n");
 }
\ No newline at end of file
@@ -52,3 +52,8 @@ void send_eoi(uint8_t irq){
     outb_b(MASTER_PIC_CMD, 0x20);
 }
 
+// mask every line once the I/O APIC has taken over the ISA IRQs
+void pic_disable(void) {
+    outb_b(MASTER_PIC_DATA, 0xFF);
+    outb_b(SLAVE_PIC_DATA, 0xFF);
+}
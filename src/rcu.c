@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "percpu.h"
+#include "smp.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "rcu.h"
+
+// Bumped by each grace period. A CPU whose recorded epoch is older than
+// the one a writer bumped to may still hold a pointer it unpublished.
+static volatile uint64_t rcu_global_epoch = 1;
+
+static struct spinlock rcu_cb_lock = SPINLOCK_INIT("rcu_cb");
+static struct rcu_head *rcu_pending = NULL;
+static struct rcu_head **rcu_pending_tail = &rcu_pending;
+static struct wait_queue rcu_wait = WAIT_QUEUE_INIT("rcu_wait");
+
+void rcu_read_lock(void) {
+    preempt_disable();
+
+    // an interrupt between the two would read under a nesting count that
+    // has no epoch behind it yet
+    uint64_t flags = irq_save();
+    struct percpu *cpu = this_cpu();
+    if (cpu->rcu_nesting++ == 0) {
+        // full barrier: the pointer loads that follow cannot be satisfied
+        // before a writer scanning the CPUs can see this epoch
+        __atomic_store_n(&cpu->rcu_epoch, __atomic_load_n(&rcu_global_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+    }
+    irq_restore(flags);
+}
+
+void rcu_read_unlock(void) {
+    uint64_t flags = irq_save();
+    struct percpu *cpu = this_cpu();
+    if (--cpu->rcu_nesting == 0) {
+        __atomic_store_n(&cpu->rcu_epoch, 0, __ATOMIC_RELEASE);
+    }
+    irq_restore(flags);
+
+    preempt_enable();
+}
+
+void synchronize_rcu(void) {
+    // readers that start after this sees the new epoch, or that a scan
+    // below finds idle, load the pointers published before the call
+    uint64_t target = __atomic_add_fetch(&rcu_global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        struct percpu *cpu = cpu_data(id);
+        if (!cpu) {
+            continue;
+        }
+
+        for (;;) {
+            uint64_t epoch = __atomic_load_n(&cpu->rcu_epoch, __ATOMIC_ACQUIRE);
+            if (epoch == 0 || epoch >= target) {
+                break;
+            }
+            // read sections are short and never sleep, so this is brief
+            if (sched_can_block()) {
+                sched_yield();
+            } else {
+                asm volatile("pause");
+            }
+        }
+    }
+}
+
+void call_rcu(struct rcu_head *head, rcu_callback_t fn) {
+    head->fn = fn;
+    head->next = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&rcu_cb_lock);
+    *rcu_pending_tail = head;
+    rcu_pending_tail = &head->next;
+    spin_unlock_irqrestore(&rcu_cb_lock, flags);
+
+    wake_up_one(&rcu_wait);
+}
+
+static bool rcu_has_pending(void *ctx) {
+    (void)ctx;
+    return rcu_pending != NULL;
+}
+
+// Takes everything queued so far and frees it after one grace period, so
+// a burst of updates costs one wait rather than one each.
+static void rcu_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        wait_until(&rcu_wait, rcu_has_pending, NULL, WAIT_FOREVER);
+
+        uint64_t flags = spin_lock_irqsave(&rcu_cb_lock);
+        struct rcu_head *batch = rcu_pending;
+        rcu_pending = NULL;
+        rcu_pending_tail = &rcu_pending;
+        spin_unlock_irqrestore(&rcu_cb_lock, flags);
+
+        synchronize_rcu();
+
+        while (batch) {
+            struct rcu_head *next = batch->next;
+            batch->fn(batch);
+            batch = next;
+        }
+    }
+}
+
+void rcu_init(void) {
+    thread_create("rcu", rcu_thread, NULL, SCHED_PRIO_DEFAULT, SCHED_ANY_CPU);
+}
@@ -1,40 +1,137 @@
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
-#include "interrupts.h"
+#include "cpu.h"
 #include "io.h"
+#include "ktime.h"
 #include "rtc.h"
 
+#define RTC_SECONDS  0x00
+#define RTC_MINUTES  0x02
+#define RTC_HOURS    0x04
+#define RTC_DAY      0x07
+#define RTC_MONTH    0x08
+#define RTC_YEAR     0x09
+#define RTC_STATUS_A 0x0A
+#define RTC_STATUS_B 0x0B
+
+#define RTC_A_UIP    0x80
+#define RTC_B_24H    0x02
+#define RTC_B_BINARY 0x04
+#define RTC_HOUR_PM  0x80
+
+#define SECS_PER_DAY 86400
+
+static struct rtc_time boot_time;
+static uint64_t boot_tsc = 0;
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(RTC_COMMAND, reg);
+    return inb(RTC_DATA);
+}
+
+static uint8_t bcd_to_bin(uint8_t value) {
+    return (value & 0x0F) + ((value >> 4) * 10);
+}
+
+static void read_raw(struct rtc_time *time) {
+    while (cmos_read(RTC_STATUS_A) & RTC_A_UIP) {
+    }
+    time->second = cmos_read(RTC_SECONDS);
+    time->minute = cmos_read(RTC_MINUTES);
+    time->hour = cmos_read(RTC_HOURS);
+    time->day = cmos_read(RTC_DAY);
+    time->month = cmos_read(RTC_MONTH);
+    time->year = cmos_read(RTC_YEAR);
+}
+
+void rtc_read(struct rtc_time *time) {
+    // an update can still start between the UIP check and the last read,
+    // so repeat until two reads agree
+    struct rtc_time prev;
+    read_raw(time);
+    do {
+        prev = *time;
+        read_raw(time);
+    } while (prev.second != time->second || prev.minute != time->minute ||
+             prev.hour != time->hour || prev.day != time->day ||
+             prev.month != time->month || prev.year != time->year);
+
+    uint8_t status = cmos_read(RTC_STATUS_B);
+    bool pm = time->hour & RTC_HOUR_PM;
+    time->hour &= ~RTC_HOUR_PM;
+
+    if (!(status & RTC_B_BINARY)) {
+        time->second = bcd_to_bin(time->second);
+        time->minute = bcd_to_bin(time->minute);
+        time->hour = bcd_to_bin(time->hour);
+        time->day = bcd_to_bin(time->day);
+        time->month = bcd_to_bin(time->month);
+        time->year = bcd_to_bin(time->year);
+    }
+    if (!(status & RTC_B_24H)) {
+        time->hour %= 12;
+        if (pm) {
+            time->hour += 12;
+        }
+    }
+    // the century register is not at a fixed CMOS offset; assume 20xx
+    time->year += 2000;
+}
+
 void rtc_init(void) {
-    outb(RTC_COMMAND, 0x8B);
-    uint8_t prev = inb(RTC_DATA);
-    
-    outb(RTC_COMMAND, 0x8B);
-    outb(RTC_DATA, prev | 0x40);
-    
-    outb(RTC_COMMAND, 0x8A);
-    prev = inb(RTC_DATA);
-    outb(RTC_COMMAND, 0x8A);
-    outb(RTC_DATA, (prev & 0xF0) | 0x06);
+    rtc_read(&boot_time);
+    // wall time comes from the TSC from here on, so the periodic interrupt
+    // stays off and IRQ 8 stays masked
+    boot_tsc = rdtsc();
 }
 
-void rtc_handler(void) {
-    outb(RTC_COMMAND, 0x0C);
-    inb(RTC_DATA);
+const struct rtc_time *rtc_boot_time(void) {
+    return &boot_time;
 }
 
+uint64_t rtc_boot_tsc(void) {
+    return boot_tsc;
+}
+
+// civil date <-> days since 1970-01-01, counting in 400-year eras that
+// start on March 1st so the leap day falls at the end of each year
+uint64_t rtc_time_to_unix(const struct rtc_time *time) {
+    uint64_t year = time->year - (time->month <= 2);
+    uint64_t era = year / 400;
+    uint64_t yoe = year - era * 400;
+    uint64_t doy = (153 * (time->month + (time->month > 2 ? -3 : 9)) + 2) / 5 + time->day - 1;
+    uint64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    uint64_t days = era * 146097 + doe - 719468;
+
+    return days * SECS_PER_DAY + time->hour * 3600 + time->minute * 60 + time->second;
+}
+
+void rtc_unix_to_time(uint64_t seconds, struct rtc_time *time) {
+    uint64_t days = seconds / SECS_PER_DAY;
+    uint64_t rem = seconds % SECS_PER_DAY;
+    time->hour = rem / 3600;
+    time->minute = (rem / 60) % 60;
+    time->second = rem % 60;
+
+    days += 719468;
+    uint64_t era = days / 146097;
+    uint64_t doe = days - era * 146097;
+    uint64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint64_t mp = (5 * doy + 2) / 153;
+
+    time->day = doy - (153 * mp + 2) / 5 + 1;
+    time->month = mp < 10 ? mp + 3 : mp - 9;
+    time->year = yoe + era * 400 + (time->month <= 2);
+}
+
+// served from the cached boot time and the TSC, no CMOS access
 void rtc_read_time(uint8_t *hour, uint8_t *minute, uint8_t *second) {
-    outb(RTC_COMMAND, 0x04);
-    *hour = inb(RTC_DATA);
-    
-    outb(RTC_COMMAND, 0x02);
-    *minute = inb(RTC_DATA);
-    
-    outb(RTC_COMMAND, 0x00);
-    *second = inb(RTC_DATA);
-    
-    if (!(*hour & 0x80)) {
-        *hour = (*hour & 0x0F) + ((*hour / 16) * 10);
-        *minute = (*minute & 0x0F) + ((*minute / 16) * 10);
-        *second = (*second & 0x0F) + ((*second / 16) * 10);
-    }
+    struct rtc_time now;
+    rtc_unix_to_time(clock_realtime() / NSEC_PER_SEC, &now);
+    *hour = now.hour;
+    *minute = now.minute;
+    *second = now.second;
 }
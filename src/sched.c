@@ -0,0 +1,561 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "ktime.h"
+#include "memory.h"
+#include "paging.h"
+#include "slab.h"
+#include "terminal.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "timer.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "sched.h"
+
+#define SCHED_WEIGHT_DEFAULT 1024
+
+static const uint32_t prio_weights[SCHED_PRIO_LEVELS] = {
+    256, 362, 512, 724, 1024, 1448, 2048, 2896
+};
+
+// Ready threads are kept sorted by vruntime, the CPU time they have had
+// scaled down by their weight; the head is the one that has had the
+// smallest fair share so far. The lock is only taken with interrupts off
+// and never together with another run queue's.
+struct runqueue {
+    struct spinlock lock;
+    struct thread *head;
+    volatile uint32_t nr_ready;
+    uint64_t min_vruntime;
+    struct thread *idle;
+    uint64_t switches;
+    uint64_t steals;
+};
+
+static struct runqueue runqueues[MAX_CPUS];
+static struct thread idle_threads[MAX_CPUS];
+
+// every live thread, and the exited ones waiting for their stacks to be freed
+static struct spinlock threads_lock = SPINLOCK_INIT("threads");
+static struct thread *all_threads = NULL;
+static struct thread *zombies = NULL;
+static uint32_t next_thread_id = 1;
+
+// The slice tick runs only while some run queue has a thread waiting for
+// a CPU; with every thread blocked, or one per CPU, no CPU is interrupted.
+// Taken inside a run queue lock, never the other way round.
+static struct spinlock tick_lock = SPINLOCK_INIT("sched_tick");
+static bool tick_armed = false;
+static struct timer tick_timer;
+
+extern void context_switch(uint64_t *prev_rsp, uint64_t next_rsp);
+extern void thread_trampoline(void);
+
+static void enqueue(struct runqueue *rq, struct thread *thread) {
+    // a thread that slept does not get to bank the time it was away
+    if (thread->vruntime < rq->min_vruntime) {
+        thread->vruntime = rq->min_vruntime;
+    }
+
+    struct thread **link = &rq->head;
+    while (*link && (*link)->vruntime <= thread->vruntime) {
+        link = &(*link)->rq_next;
+    }
+    thread->rq_next = *link;
+    *link = thread;
+    rq->nr_ready++;
+
+    // a thread now waits for a CPU, so slices need ending
+    spin_lock(&tick_lock);
+    if (!tick_armed) {
+        tick_armed = true;
+        timer_add(&tick_timer, ktime_ns() + SCHED_TICK_NS);
+    }
+    spin_unlock(&tick_lock);
+}
+
+static bool tick_needed(void) {
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        if (runqueues[id].nr_ready) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// an enqueue that raced with the check re-arms the tick after us, since
+// it only looks at tick_armed under tick_lock after bumping nr_ready
+static void tick_stop_if_unneeded(void) {
+    spin_lock(&tick_lock);
+    if (tick_armed && !tick_needed()) {
+        tick_armed = false;
+        timer_del(&tick_timer);
+    }
+    spin_unlock(&tick_lock);
+}
+
+static struct thread *dequeue_next(struct runqueue *rq) {
+    struct thread *thread = rq->head;
+    if (thread) {
+        rq->head = thread->rq_next;
+        thread->rq_next = NULL;
+        rq->nr_ready--;
+        if (thread->vruntime > rq->min_vruntime) {
+            rq->min_vruntime = thread->vruntime;
+        }
+    }
+    return thread;
+}
+
+static void update_curr(struct runqueue *rq, struct thread *thread, uint64_t now) {
+    uint64_t delta = now - thread->exec_start;
+    thread->exec_start = now;
+    thread->runtime_ns += delta;
+    if (thread != rq->idle) {
+        thread->vruntime += delta * SCHED_WEIGHT_DEFAULT / thread->weight;
+    }
+}
+
+static void kick_cpu(uint32_t id) {
+    struct percpu *cpu = cpu_data(id);
+    if (!cpu) {
+        return;
+    }
+
+    cpu->need_resched = true;
+    if (id != smp_processor_id() && apic_enabled()) {
+        uint64_t flags = irq_save();
+        lapic_send_ipi(cpu->apic_id, RESCHED_VECTOR);
+        irq_restore(flags);
+    }
+}
+
+// Take the most deserving thread another CPU has queued but is not
+// running. The victim's vruntime is rebased onto ours so it neither jumps
+// the queue nor falls to the back of it.
+static struct thread *steal(uint32_t self) {
+    struct runqueue *own = &runqueues[self];
+
+    for (uint32_t i = 1; i < MAX_CPUS; i++) {
+        uint32_t id = (self + i) % MAX_CPUS;
+        struct runqueue *rq = &runqueues[id];
+        if (!rq->nr_ready || !cpu_data(id)) {
+            continue;
+        }
+
+        spin_lock(&rq->lock);
+        struct thread **link = &rq->head;
+        while (*link && ((*link)->pinned || (*link)->on_cpu)) {
+            link = &(*link)->rq_next;
+        }
+        struct thread *thread = *link;
+        if (thread) {
+            *link = thread->rq_next;
+            thread->rq_next = NULL;
+            rq->nr_ready--;
+            thread->vruntime = thread->vruntime > rq->min_vruntime ? thread->vruntime - rq->min_vruntime : 0;
+            // changed under the lock of the queue it leaves, so sched_wake()
+            // can tell whether the queue it locked is still the right one
+            thread->cpu = self;
+        }
+        spin_unlock(&rq->lock);
+
+        if (thread) {
+            spin_lock(&own->lock);
+            thread->vruntime += own->min_vruntime;
+            own->steals++;
+            spin_unlock(&own->lock);
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// runs on the new thread's stack, after context_switch()
+static void finish_switch(void) {
+    struct percpu *cpu = this_cpu();
+    struct thread *prev = cpu->switch_prev;
+    cpu->switch_prev = NULL;
+
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if (prev->state == THREAD_DEAD) {
+        spin_lock(&threads_lock);
+        prev->rq_next = zombies;
+        zombies = prev;
+        spin_unlock(&threads_lock);
+    }
+}
+
+void schedule(void) {
+    uint64_t flags = irq_save();
+    struct percpu *cpu = this_cpu();
+    struct runqueue *rq = &runqueues[cpu->id];
+    struct thread *prev = cpu->current;
+    uint64_t now = ktime_ns();
+
+    cpu->need_resched = false;
+
+    spin_lock(&rq->lock);
+    update_curr(rq, prev, now);
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        prev->state = THREAD_READY;
+        enqueue(rq, prev);
+    }
+    struct thread *next = dequeue_next(rq);
+    spin_unlock(&rq->lock);
+
+    if (!next) {
+        next = steal(cpu->id);
+    }
+    if (!next) {
+        next = rq->idle;
+        tick_stop_if_unneeded();
+    }
+
+    next->state = THREAD_RUNNING;
+    next->exec_start = now;
+    if (next != prev) {
+        next->on_cpu = true;
+        cpu->current = next;
+        cpu->switch_prev = prev;
+        rq->switches++;
+
+        // prev may be stolen while switched out and resume elsewhere, so
+        // nothing cached from this CPU is used afterwards
+        context_switch(&prev->rsp, next->rsp);
+        finish_switch();
+    }
+
+    irq_restore(flags);
+}
+
+void sched_yield(void) {
+    schedule();
+}
+
+void sched_block(void) {
+    struct percpu *cpu = this_cpu();
+    struct runqueue *rq = &runqueues[cpu->id];
+    struct thread *self = cpu->current;
+
+    // a wake-up that came in since the last block is used up instead
+    spin_lock(&rq->lock);
+    bool woken = self->wake_pending;
+    self->wake_pending = false;
+    if (!woken) {
+        self->state = THREAD_BLOCKED;
+    }
+    spin_unlock(&rq->lock);
+
+    if (!woken) {
+        schedule();
+    }
+}
+
+void sched_wake(struct thread *thread) {
+    uint64_t flags = irq_save();
+    uint32_t id;
+    struct runqueue *rq;
+
+    // the thread may be stolen while we wait for the lock
+    for (;;) {
+        id = thread->cpu;
+        rq = &runqueues[id];
+        spin_lock(&rq->lock);
+        if (thread->cpu == id) {
+            break;
+        }
+        spin_unlock(&rq->lock);
+    }
+
+    bool woken = false;
+    if (thread->state == THREAD_BLOCKED) {
+        thread->state = THREAD_READY;
+        enqueue(rq, thread);
+        woken = true;
+    } else {
+        thread->wake_pending = true;
+    }
+    spin_unlock(&rq->lock);
+
+    // A busy CPU picks the thread up at its next tick, unless the thread
+    // outranks what it is running: input and I/O waiters should not sit
+    // behind a compute thread for most of a tick.
+    struct percpu *cpu = cpu_data(id);
+    if (woken && cpu) {
+        struct thread *current = cpu->current;
+        if (current == rq->idle || thread->priority > current->priority) {
+            kick_cpu(id);
+        }
+    }
+    irq_restore(flags);
+}
+
+bool sched_can_block(void) {
+    struct percpu *cpu = this_cpu();
+    struct thread *self = cpu->current;
+    return self && self != runqueues[cpu->id].idle && irqs_enabled() && cpu->preempt_count == 0 &&
+        !cpu->softirq_running && cpu->fpu_depth == 0;
+}
+
+static void sleep_timeout(struct timer *timer, void *ctx) {
+    (void)timer;
+    sched_wake((struct thread *)ctx);
+}
+
+void thread_sleep_ns(uint64_t ns) {
+    uint64_t deadline = ktime_ns() + ns;
+    struct thread *self = thread_current();
+
+    struct timer timer;
+    timer_init(&timer, sleep_timeout, self);
+
+    uint64_t flags = irq_save();
+    timer_add(&timer, deadline);
+    while (ktime_ns() < deadline) {
+        sched_block();
+    }
+    timer_cancel(&timer);
+    irq_restore(flags);
+}
+
+void sched_preempt_irq(void) {
+    struct percpu *cpu = this_cpu();
+    // a softirq or FPU section on this stack must finish first
+    if (cpu->need_resched && !cpu->softirq_running && cpu->preempt_count == 0 && cpu->fpu_depth == 0) {
+        schedule();
+    }
+}
+
+// Slices end on a tick from the BSP timer wheel: every CPU with something
+// waiting is told to reschedule, and idle CPUs are woken to steal.
+static void sched_tick(struct timer *timer, void *ctx) {
+    (void)ctx;
+    bool waiting = false;
+
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        struct percpu *cpu = cpu_data(id);
+        if (cpu && runqueues[id].nr_ready) {
+            waiting = true;
+            kick_cpu(id);
+        }
+    }
+    if (waiting) {
+        for (uint32_t id = 0; id < MAX_CPUS; id++) {
+            struct percpu *cpu = cpu_data(id);
+            if (cpu && cpu->current == runqueues[id].idle && !runqueues[id].nr_ready) {
+                kick_cpu(id);
+            }
+        }
+    }
+
+    uint64_t flags = spin_lock_irqsave(&tick_lock);
+    if (tick_needed()) {
+        timer_add(timer, ktime_ns() + SCHED_TICK_NS);
+    } else {
+        tick_armed = false;
+    }
+    spin_unlock_irqrestore(&tick_lock, flags);
+}
+
+static void resched_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+}
+
+static void init_idle(struct percpu *cpu) {
+    struct thread *idle = &idle_threads[cpu->id];
+    idle->id = 0;
+    memcpy(idle->name, "idle", 5);
+    idle->state = THREAD_RUNNING;
+    idle->on_cpu = true;
+    idle->priority = 0;
+    idle->weight = prio_weights[0];
+    idle->cpu = cpu->id;
+    idle->pinned = true;
+    idle->exec_start = ktime_ns();
+
+    runqueues[cpu->id].idle = idle;
+    cpu->current = idle;
+}
+
+void sched_init(void) {
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        spin_lock_init(&runqueues[id].lock, "runqueue");
+    }
+    init_idle(this_cpu());
+    timer_init(&tick_timer, sched_tick, NULL);
+    request_irq(RESCHED_VECTOR, resched_irq, NULL);
+}
+
+void sched_init_ap(void) {
+    init_idle(this_cpu());
+}
+
+struct thread *thread_current(void) {
+    return this_cpu()->current;
+}
+
+void thread_entry(thread_fn_t fn, void *arg) {
+    finish_switch();
+    asm volatile("sti");
+    fn(arg);
+    thread_exit();
+}
+
+struct thread *thread_create(const char *name, thread_fn_t fn, void *arg, uint32_t priority, int cpu) {
+    if (priority >= SCHED_PRIO_LEVELS) {
+        priority = SCHED_PRIO_LEVELS - 1;
+    }
+    if (cpu != SCHED_ANY_CPU && !cpu_data(cpu)) {
+        return NULL;
+    }
+
+    // the allocators must not be re-entered by a thread preempting this one
+    preempt_disable();
+    struct thread *thread = kmalloc(sizeof(struct thread));
+    if (!thread) {
+        preempt_enable();
+        return NULL;
+    }
+    memset(thread, 0, sizeof(struct thread));
+
+    thread->stack_phys = alloc_contig_pages(THREAD_STACK_PAGES);
+    if (!thread->stack_phys) {
+        kfree(thread);
+        preempt_enable();
+        return NULL;
+    }
+    preempt_enable();
+
+    size_t len = 0;
+    while (name[len] && len < THREAD_NAME_LEN - 1) {
+        thread->name[len] = name[len];
+        len++;
+    }
+    thread->priority = priority;
+    thread->weight = prio_weights[priority];
+    thread->pinned = cpu != SCHED_ANY_CPU;
+    thread->cpu = thread->pinned ? (uint32_t)cpu : smp_processor_id();
+
+    // a frame for context_switch() to pop, returning into the trampoline
+    uint64_t *sp = (uint64_t *)((uint8_t *)phys_to_virt(thread->stack_phys) + THREAD_STACK_PAGES * PAGE_SIZE);
+    *--sp = (uint64_t)thread_trampoline;
+    *--sp = 0;              // rbp
+    *--sp = 0;              // rbx
+    *--sp = (uint64_t)fn;   // r12
+    *--sp = (uint64_t)arg;  // r13
+    *--sp = 0;              // r14
+    *--sp = 0;              // r15
+    thread->rsp = (uint64_t)sp;
+
+    uint64_t flags = irq_save();
+    spin_lock(&threads_lock);
+    thread->id = next_thread_id++;
+    thread->all_next = all_threads;
+    all_threads = thread;
+    spin_unlock(&threads_lock);
+
+    struct runqueue *rq = &runqueues[thread->cpu];
+    thread->state = THREAD_READY;
+    spin_lock(&rq->lock);
+    enqueue(rq, thread);
+    spin_unlock(&rq->lock);
+
+    irq_restore(flags);
+
+    kick_cpu(thread->cpu);
+    return thread;
+}
+
+void thread_exit(void) {
+    asm volatile("cli");
+    this_cpu()->current->state = THREAD_DEAD;
+    schedule();
+    __builtin_unreachable();
+}
+
+void thread_reap(void) {
+    uint64_t flags = irq_save();
+    spin_lock(&threads_lock);
+    struct thread *dead = zombies;
+    zombies = NULL;
+
+    for (struct thread *thread = dead; thread; thread = thread->rq_next) {
+        struct thread **link = &all_threads;
+        while (*link != thread) {
+            link = &(*link)->all_next;
+        }
+        *link = thread->all_next;
+    }
+    spin_unlock(&threads_lock);
+    irq_restore(flags);
+
+    // runs in the idle thread, which any woken thread preempts
+    preempt_disable();
+    while (dead) {
+        struct thread *next = dead->rq_next;
+        free_contig_pages(dead->stack_phys, THREAD_STACK_PAGES);
+        kfree(dead);
+        dead = next;
+    }
+    preempt_enable();
+}
+
+static const char *state_name(enum thread_state state) {
+    switch (state) {
+    case THREAD_RUNNING:
+        return "run";
+    case THREAD_READY:
+        return "ready";
+    case THREAD_BLOCKED:
+        return "block";
+    case THREAD_DEAD:
+        return "dead";
+    }
+    return "?";
+}
+
+void sched_stats(void) {
+    terminal_write("cpu\tready\tswitch\tsteals\tcurrent\n");
+    for (uint32_t id = 0; id < MAX_CPUS; id++) {
+        struct percpu *cpu = cpu_data(id);
+        if (!cpu) {
+            continue;
+        }
+        struct runqueue *rq = &runqueues[id];
+        terminal_write_dec(id);
+        terminal_write("\t");
+        terminal_write_dec(rq->nr_ready);
+        terminal_write("\t");
+        terminal_write_dec(rq->switches);
+        terminal_write("\t");
+        terminal_write_dec(rq->steals);
+        terminal_write("\t");
+        terminal_write(cpu->current->name);
+        terminal_write("\n");
+    }
+
+    terminal_write("tid\tname\tstate\tcpu\tprio\tms\n");
+    uint64_t flags = irq_save();
+    spin_lock(&threads_lock);
+    for (struct thread *thread = all_threads; thread; thread = thread->all_next) {
+        terminal_write_dec(thread->id);
+        terminal_write("\t");
+        terminal_write(thread->name);
+        terminal_write("\t");
+        terminal_write(state_name(thread->state));
+        terminal_write("\t");
+        terminal_write_dec(thread->cpu);
+        terminal_write(thread->pinned ? "*\t" : "\t");
+        terminal_write_dec(thread->priority);
+        terminal_write("\t");
+        terminal_write_dec(thread->runtime_ns / 1000000);
+        terminal_write("\n");
+    }
+    spin_unlock(&threads_lock);
+    irq_restore(flags);
+}
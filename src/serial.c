@@ -4,6 +4,29 @@
 
 #include "serial.h"
 #include "io.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "wait.h"
+
+#define SERIAL_TX_RING_SIZE 1024
+#define SERIAL_FIFO_SIZE    16
+
+#define SERIAL_IER_THRE     0x02
+
+// keeps lines written from different CPUs from interleaving
+static struct spinlock serial_lock = SPINLOCK_INIT("serial");
+
+// Once the transmit interrupt is on, output is queued here and fed to the
+// 16-byte FIFO from the IRQ, so writers no longer wait out the line rate.
+// Writers with interrupts off still go straight to the port.
+static char tx_ring[SERIAL_TX_RING_SIZE];
+static uint32_t tx_head = 0;
+static uint32_t tx_tail = 0;
+static bool tx_irq = false;
+static struct wait_queue tx_wait = WAIT_QUEUE_INIT("serial_tx");
 
 void serial_init(void) {
     outb(SERIAL_PORT + 1, 0x00);
@@ -19,46 +42,141 @@ bool serial_transmit_empty(void) {
     return inb(SERIAL_PORT + 5) & 0x20;
 }
 
-void serial_putchar(char c) {
-    while (!serial_transmit_empty());
+static void serial_out(char c) {
+    while (!serial_transmit_empty()) {
+        asm volatile("pause");
+    }
     outb(SERIAL_PORT, c);
 }
 
+// refill the FIFO if it has run dry; caller holds serial_lock
+static void tx_kick(void) {
+    if (tx_tail == tx_head || !serial_transmit_empty()) {
+        return;
+    }
+    for (int i = 0; i < SERIAL_FIFO_SIZE && tx_tail != tx_head; i++) {
+        outb(SERIAL_PORT, tx_ring[tx_tail % SERIAL_TX_RING_SIZE]);
+        tx_tail++;
+    }
+}
+
+static uint32_t tx_free(void) {
+    return SERIAL_TX_RING_SIZE - (__atomic_load_n(&tx_head, __ATOMIC_RELAXED) - __atomic_load_n(&tx_tail, __ATOMIC_RELAXED));
+}
+
+static bool tx_has_room(void *ctx) {
+    return tx_free() >= *(uint32_t *)ctx;
+}
+
+// Take serial_lock once the ring can hold the whole write, sleeping for
+// room beforehand, so the lock is never dropped part-way through it.
+// Writes bigger than the ring, or from callers that cannot sleep, hold
+// the lock and drain the ring by hand instead.
+static uint64_t tx_lock(uint32_t bytes, bool can_sleep) {
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+    while (can_sleep && tx_irq && bytes <= SERIAL_TX_RING_SIZE && tx_free() < bytes) {
+        spin_unlock_irqrestore(&serial_lock, flags);
+        wait_until(&tx_wait, tx_has_room, &bytes, WAIT_FOREVER);
+        flags = spin_lock_irqsave(&serial_lock);
+    }
+    return flags;
+}
+
+// queue one byte, or send it directly when the IRQ cannot be relied on;
+// caller holds serial_lock
+static void tx_put(char c, uint64_t flags) {
+    if (!tx_irq || !(flags & RFLAGS_IF)) {
+        // earlier queued output goes first
+        while (tx_tail != tx_head) {
+            serial_out(tx_ring[tx_tail % SERIAL_TX_RING_SIZE]);
+            tx_tail++;
+        }
+        serial_out(c);
+        return;
+    }
+
+    while (tx_free() == 0) {
+        serial_out(tx_ring[tx_tail % SERIAL_TX_RING_SIZE]);
+        tx_tail++;
+    }
+    tx_ring[tx_head % SERIAL_TX_RING_SIZE] = c;
+    tx_head++;
+}
+
+static void serial_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+    // reading IIR acknowledges the transmitter-empty interrupt
+    inb(SERIAL_PORT + 2);
+    tx_kick();
+    spin_unlock_irqrestore(&serial_lock, flags);
+
+    wake_up_all(&tx_wait);
+}
+
+void serial_irq_init(void) {
+    // with only the 8259 the line is not routed, and queued output would
+    // sit in the ring for good
+    if (!apic_enabled() || !request_irq(ISA_IRQ_VECTOR(4), serial_irq, NULL)) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
+    tx_irq = true;
+    outb(SERIAL_PORT + 1, SERIAL_IER_THRE);
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+void serial_putchar(char c) {
+    uint64_t flags = tx_lock(1, sched_can_block());
+    tx_put(c, flags);
+    tx_kick();
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
 void serial_write(const char* str) {
+    uint32_t bytes = 0;
+    for (const char *p = str; *p; p++) {
+        bytes += *p == '\n' ? 2 : 1;
+    }
+
+    uint64_t flags = tx_lock(bytes, sched_can_block());
     while (*str) {
         if (*str == '\n') {
-            serial_putchar('\r');
+            tx_put('\r', flags);
         }
-        serial_putchar(*str++);
+        tx_put(*str++, flags);
     }
+    tx_kick();
+    spin_unlock_irqrestore(&serial_lock, flags);
 }
 
+// numbers are formatted first and written in one go, so they stay whole
 void serial_write_hex(uint64_t value) {
     const char* hex_chars = "0123456789ABCDEF";
-    serial_write("0x");
+    char buffer[19];
+    buffer[0] = '0';
+    buffer[1] = 'x';
     
-    for (int i = 60; i >= 0; i -= 4) {
-        uint8_t digit = (value >> i) & 0xF;
-        serial_putchar(hex_chars[digit]);
+    for (int i = 0; i < 16; i++) {
+        buffer[2 + i] = hex_chars[(value >> (60 - 4 * i)) & 0xF];
     }
+    buffer[18] = '\0';
+    serial_write(buffer);
 }
 
 void serial_write_dec(uint64_t value) {
-    if (value == 0) {
-        serial_putchar('0');
-        return;
-    }
-    
-    char buffer[20];
-    int pos = 0;
+    char buffer[21];
+    int pos = sizeof(buffer) - 1;
+    buffer[pos] = '\0';
     
-    while (value > 0) {
-        buffer[pos++] = '0' + (value % 10);
+    do {
+        buffer[--pos] = '0' + (value % 10);
         value /= 10;
-    }
+    } while (value > 0);
     
-    for (int i = pos - 1; i >= 0; i--) {
-        serial_putchar(buffer[i]);
-    }
+    serial_write(&buffer[pos]);
 }
 
@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+#include "simd.h"
+
+// only this file is compiled with -msse2, see GNUmakefile; AVX2 code is
+// enabled per function so nothing here runs it without the caller checking
+
+void simd_copy_sse2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    while (n >= 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), e);
+        d += 64;
+        s += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        d += 16;
+        s += 16;
+        n -= 16;
+    }
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+__attribute__((target("avx2")))
+void simd_copy_avx2(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    const uint8_t *s = (const uint8_t *)src;
+
+    while (n >= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_storeu_si256((__m256i *)d, a);
+        _mm256_storeu_si256((__m256i *)(d + 32), b);
+        _mm256_storeu_si256((__m256i *)(d + 64), c);
+        _mm256_storeu_si256((__m256i *)(d + 96), e);
+        d += 128;
+        s += 128;
+        n -= 128;
+    }
+    while (n >= 32) {
+        _mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+    // leave the upper halves clean so later SSE code pays no transition
+    _mm256_zeroupper();
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+void simd_fill_sse2(void *dest, uint32_t value, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    __m128i v = _mm_set1_epi32((int)value);
+
+    while (n >= 64) {
+        _mm_storeu_si128((__m128i *)d, v);
+        _mm_storeu_si128((__m128i *)(d + 16), v);
+        _mm_storeu_si128((__m128i *)(d + 32), v);
+        _mm_storeu_si128((__m128i *)(d + 48), v);
+        d += 64;
+        n -= 64;
+    }
+    while (n >= 4) {
+        *(uint32_t *)d = value;
+        d += 4;
+        n -= 4;
+    }
+}
+
+__attribute__((target("avx2")))
+void simd_fill_avx2(void *dest, uint32_t value, size_t n) {
+    uint8_t *d = (uint8_t *)dest;
+    __m256i v = _mm256_set1_epi32((int)value);
+
+    while (n >= 128) {
+        _mm256_storeu_si256((__m256i *)d, v);
+        _mm256_storeu_si256((__m256i *)(d + 32), v);
+        _mm256_storeu_si256((__m256i *)(d + 64), v);
+        _mm256_storeu_si256((__m256i *)(d + 96), v);
+        d += 128;
+        n -= 128;
+    }
+    _mm256_zeroupper();
+    while (n >= 4) {
+        *(uint32_t *)d = value;
+        d += 4;
+        n -= 4;
+    }
+}
+
+size_t simd_find_nonzero_sse2(const uint64_t *words, size_t count) {
+    size_t i = 0;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(words + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(words + i + 2));
+        __m128i any = _mm_or_si128(a, b);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF) {
+            break;
+        }
+    }
+    while (i < count && !words[i]) {
+        i++;
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t simd_find_nonzero_avx2(const uint64_t *words, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(words + i + 4));
+        __m256i any = _mm256_or_si256(a, b);
+        if (!_mm256_testz_si256(any, any)) {
+            break;
+        }
+    }
+    _mm256_zeroupper();
+    while (i < count && !words[i]) {
+        i++;
+    }
+    return i;
+}
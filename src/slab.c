@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "paging.h"
+#include "terminal.h"
+#include "slab.h"
+
+#define SLAB_MAGIC        0x534C4142
+#define LARGE_MAGIC       0x4C524745
+#define SLAB_HEADER_SIZE  64
+#define KMALLOC_CLASSES   9
+
+// Lives at the start of every slab, followed by the objects. Free objects
+// are chained through their first word.
+struct slab {
+    uint32_t magic;
+    uint32_t in_use;
+    struct kmem_cache *cache;
+    void *free_list;
+    struct slab *next;
+    struct slab *prev;
+};
+
+// header of a kmalloc() allocation too big for the size classes
+struct large_alloc {
+    uint32_t magic;
+    uint32_t order;
+};
+
+static struct kmem_cache cache_pool[SLAB_MAX_CACHES];
+static uint32_t cache_count = 0;
+static struct kmem_cache *cache_list = NULL;
+// guards creation; cache_list only ever grows at the head, so walkers
+// read it without the lock
+static struct spinlock cache_create_lock = SPINLOCK_INIT("slab_caches");
+static struct kmem_cache *kmalloc_caches[KMALLOC_CLASSES];
+
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16",   "kmalloc-32",   "kmalloc-64",
+    "kmalloc-128",  "kmalloc-256",  "kmalloc-512",
+    "kmalloc-1024", "kmalloc-2048", "kmalloc-4096"
+};
+
+static void slab_list_add(struct slab **list, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(struct slab **list, struct slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static struct slab *slab_new(struct kmem_cache *cache) {
+    uint64_t phys = alloc_pages(SLAB_ORDER);
+    if (!phys) {
+        return NULL;
+    }
+
+    struct slab *slab = (struct slab *)phys_to_virt(phys);
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    uint8_t *object = (uint8_t *)slab + SLAB_HEADER_SIZE;
+    void **link = &slab->free_list;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        *link = object;
+        link = (void **)object;
+        object += cache->object_size;
+    }
+    *link = NULL;
+
+    cache->slab_count++;
+    return slab;
+}
+
+static void slab_release(struct kmem_cache *cache, struct slab *slab) {
+    slab->magic = 0;
+    free_pages(virt_to_phys(slab), SLAB_ORDER);
+    cache->slab_count--;
+}
+
+void slab_init(void) {
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN_SIZE << i);
+    }
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, uint32_t object_size) {
+    if (object_size == 0 || object_size > KMALLOC_MAX_SIZE) {
+        return NULL;
+    }
+
+    if (object_size < KMALLOC_MIN_SIZE) {
+        object_size = KMALLOC_MIN_SIZE;
+    }
+    object_size = (object_size + 7) & ~7U;
+
+    spin_lock(&cache_create_lock);
+    if (cache_count >= SLAB_MAX_CACHES) {
+        spin_unlock(&cache_create_lock);
+        return NULL;
+    }
+
+    struct kmem_cache *cache = &cache_pool[cache_count++];
+    ticket_lock_init(&cache->lock, name);
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->objects_per_slab = (SLAB_BYTES - SLAB_HEADER_SIZE) / object_size;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->spare = NULL;
+    cache->slab_count = 0;
+    cache->active_objects = 0;
+    cache->alloc_count = 0;
+    cache->free_count = 0;
+
+    cache->next = cache_list;
+    __atomic_store_n(&cache_list, cache, __ATOMIC_RELEASE);
+    spin_unlock(&cache_create_lock);
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+    if (!cache) {
+        return NULL;
+    }
+
+    // interrupts off, since softirq handlers free into the same caches
+    uint64_t flags = ticket_lock_irqsave(&cache->lock);
+    struct slab *slab = cache->partial;
+    if (!slab) {
+        if (cache->spare) {
+            slab = cache->spare;
+            cache->spare = NULL;
+        } else {
+            slab = slab_new(cache);
+            if (!slab) {
+                ticket_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    slab->in_use++;
+
+    if (!slab->free_list) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    cache->active_objects++;
+    cache->alloc_count++;
+    ticket_unlock_irqrestore(&cache->lock, flags);
+    return object;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *object) {
+    if (!cache || !object) {
+        return;
+    }
+
+    struct slab *slab = (struct slab *)((uint64_t)object & ~(uint64_t)(SLAB_BYTES - 1));
+    if (slab->magic != SLAB_MAGIC || slab->cache != cache) {
+        terminal_write("ERROR: kmem_cache_free of a foreign object\n");
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&cache->lock);
+    bool was_full = slab->free_list == NULL;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+
+    if (was_full) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    // keep one empty slab around so a cache hovering at a slab boundary
+    // does not bounce pages through the buddy allocator
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (!cache->spare) {
+            cache->spare = slab;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+
+    cache->active_objects--;
+    cache->free_count++;
+    ticket_unlock_irqrestore(&cache->lock, flags);
+}
+
+void *kmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size <= KMALLOC_MAX_SIZE) {
+        int index = 0;
+        while ((size_t)(KMALLOC_MIN_SIZE << index) < size) {
+            index++;
+        }
+        return kmem_cache_alloc(kmalloc_caches[index]);
+    }
+
+    unsigned int order = SLAB_ORDER;
+    while (((size_t)PAGE_SIZE << order) < size + SLAB_HEADER_SIZE) {
+        order++;
+    }
+
+    uint64_t phys = alloc_pages(order);
+    if (!phys) {
+        return NULL;
+    }
+
+    struct large_alloc *header = (struct large_alloc *)phys_to_virt(phys);
+    header->magic = LARGE_MAGIC;
+    header->order = order;
+    return (uint8_t *)header + SLAB_HEADER_SIZE;
+}
+
+void kfree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    uint64_t base = (uint64_t)ptr & ~(uint64_t)(SLAB_BYTES - 1);
+    struct slab *slab = (struct slab *)base;
+
+    if (slab->magic == SLAB_MAGIC) {
+        kmem_cache_free(slab->cache, ptr);
+    } else if (slab->magic == LARGE_MAGIC) {
+        struct large_alloc *header = (struct large_alloc *)base;
+        header->magic = 0;
+        free_pages(virt_to_phys(header), header->order);
+    } else {
+        terminal_write("ERROR: kfree of an unknown pointer\n");
+    }
+}
+
+void slab_stats(void) {
+    terminal_write("\n=== Slab Caches ===\n");
+    terminal_write("name\t\tsize\tactive\tslabs\tallocs\tfrees\n");
+
+    for (struct kmem_cache *cache = cache_list; cache; cache = cache->next) {
+        terminal_write(cache->name);
+        terminal_write("\t");
+        terminal_write_dec(cache->object_size);
+        terminal_write("\t");
+        terminal_write_dec(cache->active_objects);
+        terminal_write("\t");
+        terminal_write_dec(cache->slab_count);
+        terminal_write("\t");
+        terminal_write_dec(cache->alloc_count);
+        terminal_write("\t");
+        terminal_write_dec(cache->free_count);
+        terminal_write("\n");
+    }
+}
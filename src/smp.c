@@ -0,0 +1,174 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "limine.h"
+#include "cpu.h"
+#include "ktime.h"
+#include "memory.h"
+#include "paging.h"
+#include "serial.h"
+#include "slab.h"
+#include "interrupts.h"
+#include "apic.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "irqstat.h"
+#include "sched.h"
+#include "smp.h"
+
+#define IA32_GS_BASE         0xC0000101
+#define SMP_START_TIMEOUT_NS 100000000ULL
+#define IST_PAGES            (IST_STACK_COUNT * IST_STACK_SIZE / PAGE_SIZE)
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .flags = 0
+};
+
+static struct percpu boot_cpu;
+static struct percpu *cpus[MAX_CPUS];
+static uint32_t cpus_online = 1;
+
+void percpu_init_boot(void) {
+    boot_cpu.self = &boot_cpu;
+    boot_cpu.id = 0;
+    boot_cpu.online = true;
+    irqstat_init_boot(&boot_cpu);
+    cpus[0] = &boot_cpu;
+    wrmsr(IA32_GS_BASE, (uint64_t)&boot_cpu);
+}
+
+static void ap_entry(struct limine_mp_info *info) {
+    struct percpu *cpu = (struct percpu *)info->extra_argument;
+
+    // Limine leaves each AP on its own GDT, no IDT and the BSP's page
+    // tables; the tables are shared, everything else is set up here
+    gdt_init_cpu(cpu->gdt, cpu->ist_stacks);
+    wrmsr(IA32_GS_BASE, (uint64_t)cpu);
+    idt_load();
+    fpu_init_ap();
+    lapic_init_ap();
+    sched_init_ap();
+
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    cpu_idle();
+}
+
+// everything an AP needs is allocated here on the BSP, before the AP
+// starts running on it
+static struct percpu *alloc_cpu(uint32_t id, uint32_t apic_id) {
+    struct percpu *cpu = kmalloc(sizeof(struct percpu));
+    if (!cpu) {
+        return NULL;
+    }
+    memset(cpu, 0, sizeof(struct percpu));
+
+    cpu->gdt = kmalloc(sizeof(struct gdt_cpu));
+    uint64_t ist_phys = alloc_contig_pages(IST_PAGES);
+    if (!cpu->gdt || !ist_phys || !fpu_alloc_state(cpu) || !irqstat_alloc_cpu(cpu)) {
+        if (ist_phys) {
+            free_contig_pages(ist_phys, IST_PAGES);
+        }
+        fpu_free_state(cpu);
+        irqstat_free_cpu(cpu);
+        kfree(cpu->gdt);
+        kfree(cpu);
+        return NULL;
+    }
+
+    cpu->self = cpu;
+    cpu->id = id;
+    cpu->apic_id = apic_id;
+    cpu->ist_stacks = (uint8_t *)phys_to_virt(ist_phys);
+    return cpu;
+}
+
+void smp_init(void) {
+    boot_cpu.apic_id = apic_enabled() ? lapic_id() : 0;
+
+    struct limine_mp_response *resp = mp_request.response;
+    if (!resp) {
+        serial_write("SMP: no MP response, running on the BSP only\n");
+        return;
+    }
+    if (!apic_enabled()) {
+        serial_write("SMP: no local APIC, running on the BSP only\n");
+        return;
+    }
+
+    // start every AP before waiting on any, so their bring-up overlaps
+    uint32_t started = 1;
+    for (uint64_t i = 0; i < resp->cpu_count && started < MAX_CPUS; i++) {
+        struct limine_mp_info *info = resp->cpus[i];
+        if (info->lapic_id == resp->bsp_lapic_id) {
+            continue;
+        }
+
+        struct percpu *cpu = alloc_cpu(started, info->lapic_id);
+        if (!cpu) {
+            serial_write("SMP: out of memory for AP ");
+            serial_write_dec(info->lapic_id);
+            serial_write("\n");
+            break;
+        }
+        cpus[started++] = cpu;
+
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+    }
+
+    uint64_t deadline = ktime_ns() + SMP_START_TIMEOUT_NS;
+    while (__atomic_load_n(&cpus_online, __ATOMIC_RELAXED) < started && ktime_ns() < deadline) {
+        asm volatile("pause");
+    }
+
+    for (uint32_t id = 1; id < started; id++) {
+        if (!__atomic_load_n(&cpus[id]->online, __ATOMIC_ACQUIRE)) {
+            serial_write("SMP: AP ");
+            serial_write_dec(cpus[id]->apic_id);
+            serial_write(" did not come up\n");
+        }
+    }
+
+    serial_write("SMP: ");
+    serial_write_dec(cpus_online);
+    serial_write(" of ");
+    serial_write_dec(resp->cpu_count);
+    serial_write(" CPUs online\n");
+}
+
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpus_online, __ATOMIC_RELAXED);
+}
+
+struct percpu *cpu_data(uint32_t id) {
+    if (id >= MAX_CPUS || !cpus[id] || !cpus[id]->online) {
+        return NULL;
+    }
+    return cpus[id];
+}
+
+void cpu_idle(void) {
+    for (;;) {
+        // one CPU is enough to keep the zero pool topped up and the
+        // exited threads reaped
+        if (smp_processor_id() == 0) {
+            zero_pool_refill();
+            thread_reap();
+        }
+        schedule();
+
+        // sti only takes effect after the next instruction, so a wakeup
+        // arriving after the check still ends the hlt
+        asm volatile("cli");
+        if (this_cpu()->need_resched) {
+            asm volatile("sti");
+        } else {
+            asm volatile("sti; hlt");
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "percpu.h"
+#include "softirq.h"
+
+// how often do_softirq() picks up newly raised work before giving up and
+// leaving it for the next interrupt, so an IRQ storm cannot starve kmain
+#define SOFTIRQ_MAX_RESTART 10
+
+// pending bits and the recursion guard live in each CPU's percpu area, so
+// a softirq runs on the CPU that raised it
+static softirq_handler_t softirq_handlers[NR_SOFTIRQS];
+
+void open_softirq(unsigned int nr, softirq_handler_t handler) {
+    if (nr < NR_SOFTIRQS) {
+        softirq_handlers[nr] = handler;
+    }
+}
+
+void raise_softirq(unsigned int nr) {
+    __atomic_or_fetch(&this_cpu()->softirq_pending, 1U << nr, __ATOMIC_RELAXED);
+}
+
+void do_softirq(void) {
+    struct percpu *cpu = this_cpu();
+
+    // an interrupt taken while softirqs run returns straight to them
+    if (cpu->softirq_running || !cpu->softirq_pending) {
+        return;
+    }
+    cpu->softirq_running = true;
+
+    for (int restart = 0; restart < SOFTIRQ_MAX_RESTART; restart++) {
+        uint32_t pending = __atomic_exchange_n(&cpu->softirq_pending, 0, __ATOMIC_RELAXED);
+        if (!pending) {
+            break;
+        }
+
+        asm volatile("sti");
+        while (pending) {
+            unsigned int nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_handlers[nr]) {
+                softirq_handlers[nr]();
+            }
+        }
+        asm volatile("cli");
+    }
+
+    cpu->softirq_running = false;
+}
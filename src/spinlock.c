@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "str.h"
+#include "terminal.h"
+#include "sched.h"
+#include "spinlock.h"
+
+#ifdef LOCKSTAT
+static struct lock_stat *volatile lock_stats = NULL;
+
+// locks register themselves on their first acquisition, so statically
+// initialised ones need no setup call
+static void lock_stat_register(struct lock_stat *stat) {
+    if (__atomic_exchange_n(&stat->registered, true, __ATOMIC_RELAXED)) {
+        return;
+    }
+    struct lock_stat *head = __atomic_load_n(&lock_stats, __ATOMIC_RELAXED);
+    do {
+        stat->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_stats, &head, stat, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void lock_stat_acquired(struct lock_stat *stat, uint64_t wait_start) {
+    if (!stat->registered) {
+        lock_stat_register(stat);
+    }
+    stat->acquisitions++;
+    if (wait_start) {
+        uint64_t wait = rdtsc() - wait_start;
+        stat->contended++;
+        stat->wait_cycles += wait;
+        if (wait > stat->max_wait_cycles) {
+            stat->max_wait_cycles = wait;
+        }
+    }
+}
+
+#define WAIT_START()                 rdtsc()
+#define STAT_ACQUIRED(lock, start)   lock_stat_acquired(&(lock)->stat, (start))
+#define STAT_INIT(lock, lock_name)   ((lock)->stat = (struct lock_stat){ .name = (lock_name) })
+#else
+#define WAIT_START()                 1
+#define STAT_ACQUIRED(lock, start)   ((void)(start))
+#define STAT_INIT(lock, lock_name)   ((void)(lock_name))
+#endif
+
+void spin_lock_init(struct spinlock *lock, const char *name) {
+    lock->locked = 0;
+    STAT_INIT(lock, name);
+}
+
+static void raw_spin_lock(struct spinlock *lock) {
+    if (!__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        STAT_ACQUIRED(lock, 0);
+        return;
+    }
+
+    // spin on a plain load so waiters share the line until it is released
+    uint64_t start = WAIT_START();
+    do {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
+            asm volatile("pause");
+        }
+    } while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE));
+    STAT_ACQUIRED(lock, start);
+}
+
+void spin_lock(struct spinlock *lock) {
+    preempt_disable();
+    raw_spin_lock(lock);
+}
+
+bool spin_trylock(struct spinlock *lock) {
+    preempt_disable();
+    if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        preempt_enable();
+        return false;
+    }
+    STAT_ACQUIRED(lock, 0);
+    return true;
+}
+
+void spin_unlock(struct spinlock *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+uint64_t spin_lock_irqsave(struct spinlock *lock) {
+    uint64_t flags = irq_save();
+    raw_spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, uint64_t flags) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+void ticket_lock_init(struct ticket_lock *lock, const char *name) {
+    lock->next = 0;
+    lock->owner = 0;
+    STAT_INIT(lock, name);
+}
+
+static void raw_ticket_lock(struct ticket_lock *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket) {
+        STAT_ACQUIRED(lock, 0);
+        return;
+    }
+
+    uint64_t start = WAIT_START();
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile("pause");
+    }
+    STAT_ACQUIRED(lock, start);
+}
+
+static void raw_ticket_unlock(struct ticket_lock *lock) {
+    // only the holder writes owner, so a plain increment is enough
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+void ticket_lock(struct ticket_lock *lock) {
+    preempt_disable();
+    raw_ticket_lock(lock);
+}
+
+void ticket_unlock(struct ticket_lock *lock) {
+    raw_ticket_unlock(lock);
+    preempt_enable();
+}
+
+uint64_t ticket_lock_irqsave(struct ticket_lock *lock) {
+    uint64_t flags = irq_save();
+    raw_ticket_lock(lock);
+    return flags;
+}
+
+void ticket_unlock_irqrestore(struct ticket_lock *lock, uint64_t flags) {
+    raw_ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+void mcs_lock_init(struct mcs_lock *lock, const char *name) {
+    lock->tail = NULL;
+    STAT_INIT(lock, name);
+}
+
+static void raw_mcs_lock(struct mcs_lock *lock, struct mcs_node *node) {
+    node->next = NULL;
+    node->locked = true;
+
+    struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (!prev) {
+        STAT_ACQUIRED(lock, 0);
+        return;
+    }
+
+    uint64_t start = WAIT_START();
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+    STAT_ACQUIRED(lock, start);
+}
+
+static void raw_mcs_unlock(struct mcs_lock *lock, struct mcs_node *node) {
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        struct mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // a waiter swapped itself in but has not linked behind us yet
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE))) {
+            asm volatile("pause");
+        }
+    }
+    __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
+
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node) {
+    preempt_disable();
+    raw_mcs_lock(lock, node);
+}
+
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node) {
+    raw_mcs_unlock(lock, node);
+    preempt_enable();
+}
+
+uint64_t mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_node *node) {
+    uint64_t flags = irq_save();
+    raw_mcs_lock(lock, node);
+    return flags;
+}
+
+void mcs_unlock_irqrestore(struct mcs_lock *lock, struct mcs_node *node, uint64_t flags) {
+    raw_mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+void lockstat_show(void) {
+#ifdef LOCKSTAT
+    terminal_write("\n=== Lock Statistics ===\n");
+    terminal_write("lock\tacquired\tcontended\tavg wait\tmax wait (cycles)\n");
+    for (struct lock_stat *stat = lock_stats; stat; stat = stat->next) {
+        terminal_write(stat->name ? stat->name : "?");
+        terminal_write("\t");
+        terminal_write_dec(stat->acquisitions);
+        terminal_write("\t");
+        terminal_write_dec(stat->contended);
+        terminal_write("\t");
+        terminal_write_dec(stat->contended ? stat->wait_cycles / stat->contended : 0);
+        terminal_write("\t");
+        terminal_write_dec(stat->max_wait_cycles);
+        terminal_write("\n");
+    }
+#else
+    terminal_write("Lock statistics are not built in; rebuild with make LOCKSTAT=1\n");
+#endif
+}
+
+void lockstat_reset(void) {
+#ifdef LOCKSTAT
+    // racy against concurrent holders, which only skews the next sample
+    for (struct lock_stat *stat = lock_stats; stat; stat = stat->next) {
+        stat->acquisitions = 0;
+        stat->contended = 0;
+        stat->wait_cycles = 0;
+        stat->max_wait_cycles = 0;
+    }
+#endif
+}
+
+void lockstat_command(const char *args) {
+    char option[16];
+    getfirststr(args, option, sizeof(option));
+
+    if (strcmp(option, "reset")) {
+        lockstat_reset();
+    } else {
+        lockstat_show();
+    }
+}
@@ -0,0 +1,38 @@
+[BITS 64]
+
+section .text
+
+global context_switch
+global thread_trampoline
+
+extern thread_entry
+
+; void context_switch(uint64_t *prev_rsp, uint64_t next_rsp)
+; Only the callee-saved registers need keeping; the caller already treats
+; everything else as clobbered. Returns on the next thread's stack.
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    
+    mov [rdi], rsp
+    mov rsp, rsi
+    
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; first context_switch into a new thread returns here, with the entry
+; function in r12 and its argument in r13
+thread_trampoline:
+    mov rdi, r12
+    mov rsi, r13
+    call thread_entry
+    ud2
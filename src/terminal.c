@@ -9,7 +9,199 @@
 #include "str.h"
 #include "terminal.h"
 #include "ext2.h"
+#include "bench.h"
+#include "slab.h"
+#include "vmm.h"
+#include "irqstat.h"
+#include "ktime.h"
+#include "rtc.h"
+#include "cpu.h"
+#include "memory.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "keyboard.h"
+
+static struct limine_framebuffer *g_fb = NULL;
+static void *g_glyphs = NULL;
+static struct psf1_header *g_hdr = NULL;
+static uint64_t cursor_x = 10;
+static uint64_t cursor_y = 50;
+static uint32_t text_color = 0xFFFFFF;
+static size_t fb_height = 0;
+static size_t fb_width = 0;
+static bool auto_prompt = false;
+static bool accept_input = false;
+static char cmd[CMD_MAX];
+static size_t cmd_len = 0;
+
+// Guards the cursor, colour and command line. Input is echoed from the
+// input thread, so only thread context draws and interrupts stay on while
+// a whole line is rendered; commands run without it.
+static struct spinlock terminal_lock = SPINLOCK_INIT("terminal");
+
+static void write_two_digits(uint64_t value) {
+    char buf[3] = { '0' + (value / 10) % 10, '0' + value % 10, '\0' };
+    terminal_write(buf);
+}
+
+// skip the command word and the whitespace around it
+static const char *command_args(const char *line) {
+    while (*line && (*line == ' ' || *line == '\t')) {
+        line++;
+    }
+    while (*line && *line != ' ' && *line != '\t') {
+        line++;
+    }
+    while (*line && (*line == ' ' || *line == '\t')) {
+        line++;
+    }
+    return line;
+}
+
+static void run_command(const char *line) {
+    char cmd_trimmed[64];
+    getfirststr(line, cmd_trimmed, sizeof(cmd_trimmed));
+
+
+    serial_write(cmd_trimmed);
+    serial_write("\n");
+
+    if (strcmp(cmd_trimmed, "clear")) {
+        terminal_clear();
+    }
+    else if (strcmp(cmd_trimmed, "dir")) {
+        read_directory_entries(2);
+    }
+    else if (strcmp(cmd_trimmed, "echo")) {
+        terminal_write(command_args(line));
+        terminal_write("\n");
+    }
+
+    else if(strcmp(cmd_trimmed, "cat")) {
+        const char *name = command_args(line);
+        uint32_t inode_number = *name ? ext2_lookup(2, name) : 12;
+        if (inode_number) {
+            print_file(inode_number);
+        } else {
+            terminal_write("cat: no such file\n");
+        }
+    }
+
+    else if (strcmp(cmd_trimmed, "bench")) {
+        bench_run(command_args(line));
+    }
+
+    else if (strcmp(cmd_trimmed, "slabinfo")) {
+        slab_stats();
+    }
+
+    else if (strcmp(cmd_trimmed, "vmstat")) {
+        vmm_stats();
+    }
+
+    else if (strcmp(cmd_trimmed, "irqstat")) {
+        irqstat_command(command_args(line));
+    }
+
+    else if (strcmp(cmd_trimmed, "date")) {
+        struct rtc_time now;
+        rtc_unix_to_time(clock_realtime() / NSEC_PER_SEC, &now);
+        write_two_digits(now.year / 100);
+        write_two_digits(now.year % 100);
+        terminal_write("-");
+        write_two_digits(now.month);
+        terminal_write("-");
+        write_two_digits(now.day);
+        terminal_write(" ");
+        write_two_digits(now.hour);
+        terminal_write(":");
+        write_two_digits(now.minute);
+        terminal_write(":");
+        write_two_digits(now.second);
+        terminal_write(" UTC\n");
+    }
+
+    else if (strcmp(cmd_trimmed, "threads")) {
+        sched_stats();
+    }
+
+    else if (strcmp(cmd_trimmed, "lockstat")) {
+        lockstat_command(command_args(line));
+    }
+
+    else if (strcmp(cmd_trimmed, "inputstat")) {
+        inputstat_command(command_args(line));
+    }
+
+    else if (strcmp(cmd_trimmed, "help")) {
+        terminal_write("Available commands:\n");
+        terminal_write(" - clear : Clear the terminal screen\n");
+        terminal_write(" - dir   : List directory entries of root\n");
+        terminal_write(" - echo  : Echo input text\n");
+        terminal_write(" - bench : Run a benchmark (bitmap, mem, simd, clock, sched)\n");
+        terminal_write(" - slabinfo : Show slab cache statistics\n");
+        terminal_write(" - vmstat : Show page fault statistics\n");
+        terminal_write(" - irqstat [serial|reset] : Show interrupt counts and latency\n");
+        terminal_write(" - date  : Show the current date and time\n");
+        terminal_write(" - threads : Show run queues and kernel threads\n");
+        terminal_write(" - lockstat [reset] : Show lock contention statistics\n");
+        terminal_write(" - inputstat [reset] : Show keyboard event latency\n");
+        terminal_write(" - help  : Show this help message\n");
+    }
+}
+
+// commands run here instead of in the keyboard softirq, so a long one is
+// preemptible and input, timers and other threads keep going meanwhile
+static struct thread *shell = NULL;
+static char shell_line[CMD_MAX];
+static volatile bool shell_pending = false;
+static struct spinlock shell_lock = SPINLOCK_INIT("shell");
+static struct wait_queue shell_wait = WAIT_QUEUE_INIT("shell_wait");
+
+static bool shell_has_line(void *ctx) {
+    (void)ctx;
+    return shell_pending;
+}
+
+static void shell_thread(void *arg) {
+    (void)arg;
+    char line[CMD_MAX];
 
+    for (;;) {
+        wait_until(&shell_wait, shell_has_line, NULL, WAIT_FOREVER);
+
+        uint64_t flags = spin_lock_irqsave(&shell_lock);
+        memcpy(line, shell_line, CMD_MAX);
+        shell_pending = false;
+        spin_unlock_irqrestore(&shell_lock, flags);
+
+        run_command(line);
+
+        if (auto_prompt) {
+            terminal_prompt();
+        }
+    }
+}
+
+// Echoes keys and edits the command line. It runs at the top priority so
+// a wakeup from the keyboard IRQ preempts whatever else is running.
+static void input_thread(void *arg) {
+    (void)arg;
+    struct input_event event;
+
+    for (;;) {
+        keyboard_read_event(&event, WAIT_FOREVER);
+        if (event.down && event.ascii) {
+            terminal_putchar(event.ascii);
+        }
+    }
+}
+
+void terminal_start_shell(void) {
+    shell = thread_create("shell", shell_thread, NULL, SCHED_PRIO_DEFAULT + 1, SCHED_ANY_CPU);
+    thread_create("input", input_thread, NULL, SCHED_PRIO_LEVELS - 1, SCHED_ANY_CPU);
+}
 
 void terminal_init(struct limine_framebuffer *fb, void *glyphs, struct psf1_header *hdr) {
     g_fb = fb;
@@ -22,37 +214,36 @@ void terminal_init(struct limine_framebuffer *fb, void *glyphs, struct psf1_head
 }
 
 void terminal_clear(void) {
+    spin_lock(&terminal_lock);
     for (size_t i = 0; i < fb_height * fb_width; i++) {
         ((uint32_t*)g_fb->address)[i] = 0x000000;
     }
     cursor_x = 10;
     cursor_y = 10;
+    spin_unlock(&terminal_lock);
 }
 
 void terminal_set_color(uint32_t color) {
+    spin_lock(&terminal_lock);
     text_color = color;
+    spin_unlock(&terminal_lock);
 }
 
 void terminal_set_cursor(int x, int y) {
+    spin_lock(&terminal_lock);
     cursor_x = x;
     cursor_y = y;
+    spin_unlock(&terminal_lock);
 }
 
 void terminal_enable_prompt(bool enable) {
     auto_prompt = enable;
 }
 
-void terminal_putchar(char c) {
-    if (!g_fb || !g_glyphs || !g_hdr) {
-        return;
-    }
-
+// draw one character and advance the cursor; caller holds terminal_lock
+static void draw_char(char c) {
     if (c == '\b') {
         if (cursor_x > 26) {
-            if (cmd_len > 0) {
-                cmd_len--;
-                cmd[cmd_len] = '\0';
-            }
             cursor_x -= 8;
             for (int y = 0; y < g_hdr->charsize; y++) {
                 for (int x = 0; x < 8; x++) {
@@ -67,55 +258,6 @@ void terminal_putchar(char c) {
             cursor_y = 10;
         }
 
-        cmd[cmd_len] = '\0';
-        accept_input = false; 
-
-        char cmd_trimmed[64];
-        getfirststr(cmd, cmd_trimmed, sizeof(cmd_trimmed));
-
-
-        serial_write(cmd_trimmed);
-        serial_write("\n");
-
-        if (strcmp(cmd_trimmed, "clear")) {
-            terminal_clear();
-        }
-        else if (strcmp(cmd_trimmed, "dir")) {
-            read_directory_entries(2);
-        }
-        else if (strcmp(cmd_trimmed, "echo")) {
-            const char* to_echo = cmd;
-            while (*to_echo && (*to_echo == ' ' || *to_echo == '\t')) {
-                to_echo++;
-            }
-            while (*to_echo && *to_echo != ' ' && *to_echo != '\t') {
-                to_echo++;
-            }
-            while (*to_echo && (*to_echo == ' ' || *to_echo == '\t')) {
-                to_echo++;
-            }
-            terminal_write(to_echo);
-            terminal_write("\n");
-        }
-
-        else if(strcmp(cmd_trimmed, "cat")) {
-            print_file(12);
-        }
-
-        else if (strcmp(cmd_trimmed, "help")) {
-            terminal_write("Available commands:\n");
-            terminal_write(" - clear : Clear the terminal screen\n");
-            terminal_write(" - dir   : List directory entries of root\n");
-            terminal_write(" - echo  : Echo input text\n");
-            terminal_write(" - help  : Show this help message\n");
-        }
-        cmd_len = 0;
-
-        if (auto_prompt) {
-            terminal_prompt();
-        }
-
-
     } else if (c == '\t') {
         cursor_x = ((cursor_x / 32) + 1) * 32;
         if (cursor_x >= g_fb->width - 8) {
@@ -123,10 +265,6 @@ void terminal_putchar(char c) {
             cursor_y += g_hdr->charsize;
         }
     } else {
-        if (accept_input && cmd_len < CMD_MAX - 1) {
-            cmd[cmd_len++] = c;
-            cmd[cmd_len] = '\0';
-        }
         DrawChar(cursor_x, cursor_y, c, text_color, g_fb, g_glyphs, g_hdr);
         cursor_x += 8;
         if (cursor_x >= g_fb->width - 8) {
@@ -139,44 +277,64 @@ void terminal_putchar(char c) {
     }
 }
 
-void terminal_putchar_external(char c) {
+static void submit_command(const char *line) {
+    if (shell) {
+        // the shell thread runs it; the prompt comes back when it is done
+        uint64_t flags = spin_lock_irqsave(&shell_lock);
+        memcpy(shell_line, line, CMD_MAX);
+        shell_pending = true;
+        spin_unlock_irqrestore(&shell_lock, flags);
+        wake_up_one(&shell_wait);
+    } else {
+        run_command(line);
+
+        if (auto_prompt) {
+            terminal_prompt();
+        }
+    }
+}
+
+void terminal_putchar(char c) {
     if (!g_fb || !g_glyphs || !g_hdr) {
         return;
     }
 
+    spin_lock(&terminal_lock);
+    if (c == '\n') {
+        draw_char(c);
+
+        char line[CMD_MAX];
+        cmd[cmd_len] = '\0';
+        memcpy(line, cmd, cmd_len + 1);
+        cmd_len = 0;
+        accept_input = false;
+        spin_unlock(&terminal_lock);
+
+        submit_command(line);
+        return;
+    }
+
     if (c == '\b') {
-        if (cursor_x > 26) {
-            cursor_x -= 8;
-            for (int y = 0; y < g_hdr->charsize; y++) {
-                for (int x = 0; x < 8; x++) {
-                    DrawPixel(cursor_x + x, cursor_y + y, 0x000000, g_fb);
-                }
-            }
-        }
-    } else if (c == '\n') {
-        cursor_x = 10;
-        cursor_y += g_hdr->charsize;
-        if (cursor_y >= g_fb->height - g_hdr->charsize) {
-            cursor_y = 10;
+        if (cursor_x > 26 && cmd_len > 0) {
+            cmd_len--;
+            cmd[cmd_len] = '\0';
         }
+    } else if (c != '\t' && accept_input && cmd_len < CMD_MAX - 1) {
+        cmd[cmd_len++] = c;
+        cmd[cmd_len] = '\0';
+    }
+    draw_char(c);
+    spin_unlock(&terminal_lock);
+}
 
-    } else if (c == '\t') {
-        cursor_x = ((cursor_x / 32) + 1) * 32;
-        if (cursor_x >= g_fb->width - 8) {
-            cursor_x = 10;
-            cursor_y += g_hdr->charsize;
-        }
-    } else {
-        DrawChar(cursor_x, cursor_y, c, text_color, g_fb, g_glyphs, g_hdr);
-        cursor_x += 8;
-        if (cursor_x >= g_fb->width - 8) {
-            cursor_x = 10;
-            cursor_y += g_hdr->charsize;
-            if (cursor_y >= g_fb->height - g_hdr->charsize) {
-                cursor_y = 10;
-            }
-        }
+void terminal_putchar_external(char c) {
+    if (!g_fb || !g_glyphs || !g_hdr) {
+        return;
     }
+
+    spin_lock(&terminal_lock);
+    draw_char(c);
+    spin_unlock(&terminal_lock);
 }
 
 void terminal_draw_hline_single(uint32_t color, uint32_t x, uint32_t y, uint32_t length) {
@@ -210,20 +368,42 @@ void terminal_draw_vline(uint32_t color, uint32_t x, uint32_t y, uint32_t length
 }
 
 void terminal_prompt() {
-    terminal_putchar_external('>');
-    terminal_putchar_external(' ');
+    if (!g_fb || !g_glyphs || !g_hdr) {
+        return;
+    }
+
+    spin_lock(&terminal_lock);
+    draw_char('>');
+    draw_char(' ');
     accept_input = true;
+    spin_unlock(&terminal_lock);
 }
 
+// the whole string goes out under one hold so lines from different CPUs
+// do not interleave
 void terminal_write(const char* s) {
-    bool prev = accept_input;
-    accept_input = false;
+    if (!g_fb || !g_glyphs || !g_hdr) {
+        return;
+    }
 
+    spin_lock(&terminal_lock);
     while (*s) {
-        terminal_putchar_external(*s++);
+        draw_char(*s++);
     }
+    spin_unlock(&terminal_lock);
+}
 
-    accept_input = prev;
+// for text that is not NUL terminated, such as file contents
+void terminal_write_len(const char *s, size_t len) {
+    if (!g_fb || !g_glyphs || !g_hdr) {
+        return;
+    }
+
+    spin_lock(&terminal_lock);
+    for (size_t i = 0; i < len; i++) {
+        draw_char(s[i]);
+    }
+    spin_unlock(&terminal_lock);
 }
 
 void terminal_write_hex(uint64_t value) {
@@ -0,0 +1,339 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "ktime.h"
+#include "serial.h"
+#include "interrupts.h"
+#include "softirq.h"
+#include "apic.h"
+#include "hpet.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+
+#define TIMER_SLOT_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_NONE      UINT64_MAX
+
+// Hierarchical timer wheel. A timer due in fewer than 64^(L+1) ticks sits
+// in level L at the slot given by its expiry bits for that level. When the
+// clock crosses a level L boundary the matching slot one level up is
+// cascaded down, so arming and cancelling stay O(1) list operations.
+static struct timer *wheel[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static uint64_t occupied[TIMER_LEVELS];
+static uint64_t wheel_clock = 0;
+static uint64_t timer_count = 0;
+// guards the wheel and the armed state; timers may be added from any CPU
+static struct spinlock timer_lock = SPINLOCK_INIT("timers");
+// timer whose callback is running, and on which CPU; timer_cancel() waits
+// for it so callers can free a timer as soon as cancel returns
+static struct timer *volatile running_timer = NULL;
+static uint32_t running_cpu = 0;
+
+// tick the hardware is programmed for, TIMER_NONE when idle
+static uint64_t armed_tick = TIMER_NONE;
+// one-shot event device behind the wheel; NULL when only the periodic PIT
+// tick is available
+struct clock_event {
+    void (*arm)(uint64_t deadline_ns);
+    void (*stop)(void);
+};
+
+static const struct clock_event lapic_event = { lapic_timer_arm, lapic_timer_stop };
+static const struct clock_event hpet_event = { hpet_event_arm, hpet_event_stop };
+static const struct clock_event *clock_event = NULL;
+
+static inline uint64_t ns_to_tick(uint64_t ns) {
+    return ns >> TIMER_TICK_SHIFT;
+}
+
+static void wheel_insert(struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel_clock) {
+        expires = wheel_clock;
+    }
+
+    uint64_t delta = expires - wheel_clock;
+    unsigned int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS))) {
+        // beyond the last level; park it at the far end and let the
+        // cascade re-file it when that slot comes round
+        expires = wheel_clock + (1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    unsigned int slot = (expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+    struct timer **head = &wheel[level][slot];
+
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    timer->level = level;
+    timer->slot = slot;
+    *head = timer;
+    occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_unlink(struct timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (!wheel[timer->level][timer->slot]) {
+        occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void cascade(unsigned int level) {
+    unsigned int slot = (wheel_clock >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+    struct timer *timer = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+
+    while (timer) {
+        struct timer *next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+}
+
+// first tick at which something in the wheel needs attention: an expiry
+// in level 0 or a cascade from a higher level
+static uint64_t next_event_tick(void) {
+    uint64_t best = TIMER_NONE;
+
+    for (unsigned int level = 0; level < TIMER_LEVELS; level++) {
+        if (!occupied[level]) {
+            continue;
+        }
+
+        unsigned int shift = TIMER_LEVEL_BITS * level;
+        unsigned int pos = (wheel_clock >> shift) & TIMER_SLOT_MASK;
+        uint64_t rotated = (occupied[level] >> pos) | (pos ? occupied[level] << (TIMER_LEVEL_SIZE - pos) : 0);
+        uint64_t offset = __builtin_ctzll(rotated);
+
+        uint64_t tick;
+        if (level == 0) {
+            tick = wheel_clock + offset;
+        } else {
+            // the current slot of a higher level is cascaded on the tick
+            // that starts its period; once past that, anything left in it
+            // waits for the next wrap
+            if (offset == 0 && (wheel_clock & ((1ULL << shift) - 1))) {
+                offset = TIMER_LEVEL_SIZE;
+            }
+            tick = ((wheel_clock >> shift) + offset) << shift;
+        }
+        if (tick < best) {
+            best = tick;
+        }
+    }
+    return best;
+}
+
+static void program_hardware(void) {
+    if (!clock_event) {
+        return;
+    }
+
+    uint64_t tick = timer_count ? next_event_tick() : TIMER_NONE;
+    if (tick == armed_tick) {
+        return;
+    }
+
+    // the LAPIC timer is per CPU and only the BSP's drives the wheel, so
+    // other CPUs have the BSP run the wheel and reprogram it instead
+    if (clock_event == &lapic_event && smp_processor_id() != 0) {
+        armed_tick = TIMER_NONE;
+        lapic_send_ipi(cpu_data(0)->apic_id, TIMER_VECTOR);
+        return;
+    }
+    armed_tick = tick;
+
+    if (tick == TIMER_NONE) {
+        clock_event->stop();
+    } else {
+        clock_event->arm(tick << TIMER_TICK_SHIFT);
+    }
+}
+
+static void run_timers(void) {
+    uint64_t now = ns_to_tick(ktime_ns());
+
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    if (!timer_count) {
+        wheel_clock = now + 1;
+    }
+
+    while (wheel_clock <= now) {
+        // skip straight over ticks with nothing to expire or cascade, so
+        // catching up after a long idle costs nothing per empty tick
+        uint64_t next = next_event_tick();
+        if (next > now) {
+            wheel_clock = now + 1;
+            break;
+        }
+        if (next > wheel_clock) {
+            wheel_clock = next;
+        }
+
+        unsigned int slot = wheel_clock & TIMER_SLOT_MASK;
+
+        for (unsigned int level = 1; level < TIMER_LEVELS; level++) {
+            if (wheel_clock & ((1ULL << (TIMER_LEVEL_BITS * level)) - 1)) {
+                break;
+            }
+            cascade(level);
+        }
+
+        while (wheel[0][slot]) {
+            struct timer *timer = wheel[0][slot];
+            wheel_unlink(timer);
+            timer_count--;
+
+            // the owner may reuse the timer once it is off the wheel, so
+            // read it now; timer_cancel() waits while running_timer says so
+            timer_fn_t fn = timer->fn;
+            void *ctx = timer->ctx;
+            running_cpu = smp_processor_id();
+            __atomic_store_n(&running_timer, timer, __ATOMIC_RELEASE);
+
+            // callbacks run with interrupts on and may re-arm themselves
+            spin_unlock_irqrestore(&timer_lock, flags);
+            fn(timer, ctx);
+            flags = spin_lock_irqsave(&timer_lock);
+            __atomic_store_n(&running_timer, NULL, __ATOMIC_RELEASE);
+        }
+        wheel_clock++;
+    }
+
+    armed_tick = TIMER_NONE;
+    program_hardware();
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+static void timer_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    raise_softirq(SOFTIRQ_TIMER);
+}
+
+void timer_subsystem_init(void) {
+    wheel_clock = ns_to_tick(ktime_ns());
+    open_softirq(SOFTIRQ_TIMER, run_timers);
+
+    // a one-shot source replaces the periodic PIT tick
+    if (lapic_timer_init(TIMER_VECTOR)) {
+        clock_event = &lapic_event;
+        serial_write(lapic_timer_tsc_deadline() ? "timer: LAPIC TSC-deadline\n" : "timer: LAPIC one-shot\n");
+    } else if (hpet_event_init(TIMER_VECTOR)) {
+        clock_event = &hpet_event;
+        serial_write("timer: HPET one-shot\n");
+    }
+
+    if (clock_event) {
+        request_irq(TIMER_VECTOR, timer_irq, NULL);
+        ioapic_mask_irq(0);
+    } else {
+        request_irq(ISA_IRQ_VECTOR(0), timer_irq, NULL);
+        serial_write("timer: PIT periodic fallback\n");
+    }
+}
+
+void timer_init(struct timer *timer, timer_fn_t fn, void *ctx) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->fn = fn;
+    timer->ctx = ctx;
+}
+
+bool timer_pending(struct timer *timer) {
+    return timer->pprev != NULL;
+}
+
+void timer_add(struct timer *timer, uint64_t deadline_ns) {
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (timer_pending(timer)) {
+        wheel_unlink(timer);
+        timer_count--;
+    }
+
+    // round up so a timer never fires before its deadline
+    timer->expires = ns_to_tick(deadline_ns + (1ULL << TIMER_TICK_SHIFT) - 1);
+    wheel_insert(timer);
+    timer_count++;
+
+    program_hardware();
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+bool timer_del(struct timer *timer) {
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+
+    bool pending = timer_pending(timer);
+    if (pending) {
+        wheel_unlink(timer);
+        timer_count--;
+    }
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return pending;
+}
+
+bool timer_cancel(struct timer *timer) {
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+
+    bool pending = timer_pending(timer);
+    if (pending) {
+        wheel_unlink(timer);
+        timer_count--;
+    }
+    // a callback cancelling its own timer must not wait for itself
+    bool wait = !pending && running_timer == timer && running_cpu != smp_processor_id();
+
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    // the callback may still be running on the wheel's CPU; callers keep
+    // timers on the stack, so do not return until it is done with it
+    while (wait && __atomic_load_n(&running_timer, __ATOMIC_ACQUIRE) == timer) {
+        asm volatile("pause");
+    }
+    return pending;
+}
+
+static void sleep_wakeup(struct timer *timer, void *ctx) {
+    (void)timer;
+    (void)ctx;
+}
+
+void sleep_ns(uint64_t ns) {
+    uint64_t deadline = ktime_ns() + ns;
+
+    // the armed timer's interrupt is what ends each hlt
+    struct timer timer;
+    timer_init(&timer, sleep_wakeup, NULL);
+    timer_add(&timer, deadline);
+
+    bool can_halt = irqs_enabled();
+
+    while (ktime_ns() < deadline) {
+        if (can_halt) {
+            asm volatile("hlt");
+        } else {
+            asm volatile("pause");
+        }
+    }
+
+    timer_cancel(&timer);
+}
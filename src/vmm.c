@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "paging.h"
+#include "memory.h"
+#include "slab.h"
+#include "terminal.h"
+#include "ktime.h"
+#include "vmm.h"
+
+#define PF_PRESENT 0x1
+#define PF_WRITE   0x2
+
+#define VMA_UNMAP_BATCH 64
+
+struct address_space kernel_space = { .lock = SPINLOCK_INIT("kernel_space") };
+
+static struct kmem_cache *vma_cache = NULL;
+static uint64_t zero_page = 0;
+// faults are only resolved against kernel_space, under its lock
+static struct fault_stats fault_stats = {0};
+
+void vmm_init(void) {
+    vma_cache = kmem_cache_create("vma", sizeof(struct vma));
+
+    // every anonymous page starts out as a read-only view of this page
+    zero_page = allocate_page();
+    if (zero_page) {
+        memset(phys_to_virt(zero_page), 0, PAGE_SIZE);
+    }
+}
+
+static uint64_t vma_page_flags(struct vma *vma, bool writable) {
+    uint64_t flags = PAGE_PRESENT;
+    if (writable && (vma->flags & VMA_WRITE)) {
+        flags |= PAGE_WRITE;
+    }
+    if (vma->flags & VMA_USER) {
+        flags |= PAGE_USER;
+    }
+    return flags;
+}
+
+struct vma *vma_find(struct address_space *as, uint64_t addr) {
+    struct vma *vma = as->last_hit;
+    if (vma && addr >= vma->start && addr < vma->end) {
+        return vma;
+    }
+
+    for (vma = as->vmas; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) {
+            as->last_hit = vma;
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+struct vma *vma_create(struct address_space *as, uint64_t start, uint64_t length, uint32_t flags) {
+    uint64_t end = (start + length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    start &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (end <= start) {
+        return NULL;
+    }
+
+    struct vma **link = &as->vmas;
+    while (*link && (*link)->end <= start) {
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->start < end) {
+        return NULL;
+    }
+
+    struct vma *vma = kmem_cache_alloc(vma_cache);
+    if (!vma) {
+        return NULL;
+    }
+
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->next = *link;
+    *link = vma;
+    as->vma_count++;
+    return vma;
+}
+
+void vma_destroy(struct address_space *as, struct vma *vma) {
+    struct vma **link = &as->vmas;
+    while (*link && *link != vma) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        return;
+    }
+    *link = vma->next;
+    as->vma_count--;
+    if (as->last_hit == vma) {
+        as->last_hit = NULL;
+    }
+
+    // a frame may only be reused once no TLB can still reach it, so each
+    // chunk is unmapped and flushed before its frames are freed
+    uint64_t frames[VMA_UNMAP_BATCH];
+    for (uint64_t start = vma->start; start < vma->end; start += VMA_UNMAP_BATCH * PAGE_SIZE) {
+        uint64_t end = start + VMA_UNMAP_BATCH * PAGE_SIZE;
+        if (end > vma->end) {
+            end = vma->end;
+        }
+
+        uint32_t count = 0;
+        for (uint64_t addr = start; addr < end; addr += PAGE_SIZE) {
+            uint64_t phys = get_physical_address(addr);
+            if (phys && phys != zero_page) {
+                frames[count++] = phys;
+            }
+        }
+        unmap_range(start, end - start);
+        for (uint32_t i = 0; i < count; i++) {
+            free_page(frames[i]);
+        }
+    }
+
+    kmem_cache_free(vma_cache, vma);
+}
+
+void *vmm_alloc(struct address_space *as, uint64_t length, uint32_t flags) {
+    length = (length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    spin_lock(&as->lock);
+
+    // first fit, leaving an unmapped guard page after every region
+    uint64_t start = VMM_ARENA_START;
+    for (struct vma *vma = as->vmas; vma; vma = vma->next) {
+        if (vma->end <= VMM_ARENA_START) {
+            continue;
+        }
+        if (vma->start >= start + length + PAGE_SIZE) {
+            break;
+        }
+        if (vma->end + PAGE_SIZE > start) {
+            start = vma->end + PAGE_SIZE;
+        }
+    }
+
+    struct vma *vma = NULL;
+    if (start + length <= VMM_ARENA_END) {
+        vma = vma_create(as, start, length, flags);
+    }
+    spin_unlock(&as->lock);
+    return vma ? (void *)start : NULL;
+}
+
+void vmm_free(struct address_space *as, void *addr) {
+    spin_lock(&as->lock);
+    struct vma *vma = vma_find(as, (uint64_t)addr);
+    if (vma && vma->start == (uint64_t)addr) {
+        vma_destroy(as, vma);
+    }
+    spin_unlock(&as->lock);
+}
+
+static bool handle_fault(uint64_t fault_addr, uint64_t error_code) {
+    struct vma *vma = vma_find(&kernel_space, fault_addr);
+    if (!vma) {
+        return false;
+    }
+
+    bool write = error_code & PF_WRITE;
+    if (write && !(vma->flags & VMA_WRITE)) {
+        return false;
+    }
+
+    uint64_t page = fault_addr & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if (!(error_code & PF_PRESENT)) {
+        if (!write && zero_page) {
+            map_page(page, zero_page, vma_page_flags(vma, false));
+            fault_stats.zero_maps++;
+            return true;
+        }
+
+        uint64_t phys = allocate_zeroed_page();
+        if (!phys) {
+            return false;
+        }
+        map_page(page, phys, vma_page_flags(vma, true));
+        fault_stats.anon_maps++;
+        return true;
+    }
+
+    if (!write) {
+        return false;
+    }
+
+    // write to a present read-only page of a writable VMA: either the
+    // shared zero page, which gets copied, or a page this VMA already owns
+    uint64_t current = get_physical_address(page);
+    if (current == zero_page) {
+        // copying the zero page is the same as handing out a zeroed one
+        uint64_t phys = allocate_zeroed_page();
+        if (!phys) {
+            return false;
+        }
+        map_page(page, phys, vma_page_flags(vma, true));
+        fault_stats.cow_copies++;
+    } else {
+        map_page(page, current, vma_page_flags(vma, true));
+        fault_stats.write_upgrades++;
+    }
+    return true;
+}
+
+bool vmm_handle_fault(uint64_t fault_addr, uint64_t error_code) {
+    spin_lock(&kernel_space.lock);
+    uint64_t start = rdtsc();
+    bool handled = handle_fault(fault_addr, error_code);
+    uint64_t cycles = rdtsc() - start;
+
+    fault_stats.faults++;
+    if (!handled) {
+        fault_stats.bad_faults++;
+    } else {
+        fault_stats.total_cycles += cycles;
+        if (cycles > fault_stats.max_cycles) {
+            fault_stats.max_cycles = cycles;
+        }
+    }
+    spin_unlock(&kernel_space.lock);
+    return handled;
+}
+
+void vmm_stats(void) {
+    spin_lock(&kernel_space.lock);
+    struct fault_stats stats = fault_stats;
+    uint64_t vma_count = kernel_space.vma_count;
+    spin_unlock(&kernel_space.lock);
+
+    uint64_t handled = stats.faults - stats.bad_faults;
+
+    terminal_write("\n=== Page Faults ===\n");
+    terminal_write("Faults: ");
+    terminal_write_dec(stats.faults);
+    terminal_write(" (unhandled ");
+    terminal_write_dec(stats.bad_faults);
+    terminal_write(")\n");
+
+    terminal_write("Zero page maps: ");
+    terminal_write_dec(stats.zero_maps);
+    terminal_write("\nAnonymous maps: ");
+    terminal_write_dec(stats.anon_maps);
+    terminal_write("\nCopy on write: ");
+    terminal_write_dec(stats.cow_copies);
+    terminal_write("\nWrite upgrades: ");
+    terminal_write_dec(stats.write_upgrades);
+    terminal_write("\n");
+
+    uint64_t avg_cycles = handled ? stats.total_cycles / handled : 0;
+    terminal_write("Fault latency: ");
+    terminal_write_dec(cycles_to_ns(avg_cycles));
+    terminal_write(" ns avg, ");
+    terminal_write_dec(cycles_to_ns(stats.max_cycles));
+    terminal_write(" ns max\n");
+
+    terminal_write("VMAs: ");
+    terminal_write_dec(vma_count);
+    terminal_write("\n");
+}
@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "cpu.h"
+#include "ktime.h"
+#include "timer.h"
+#include "sched.h"
+#include "wait.h"
+
+void wait_queue_init(struct wait_queue *wq, const char *name) {
+    spin_lock_init(&wq->lock, name);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// caller holds wq->lock
+static void wait_enqueue(struct wait_queue *wq, struct wait_entry *entry) {
+    entry->next = NULL;
+    entry->prev = wq->tail;
+    if (wq->tail) {
+        wq->tail->next = entry;
+    } else {
+        wq->head = entry;
+    }
+    wq->tail = entry;
+    entry->queued = true;
+}
+
+static void wait_dequeue(struct wait_queue *wq, struct wait_entry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        wq->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        wq->tail = entry->prev;
+    }
+    entry->next = NULL;
+    entry->prev = NULL;
+    entry->queued = false;
+}
+
+// the timer lives on the waiter's stack; timer_cancel() waits out a
+// callback still in flight before the waiter returns
+static void wait_timeout(struct timer *timer, void *ctx) {
+    (void)timer;
+    sched_wake((struct thread *)ctx);
+}
+
+bool wait_until(struct wait_queue *wq, wait_cond_t cond, void *ctx, uint64_t timeout_ns) {
+    if (cond(ctx)) {
+        return true;
+    }
+
+    uint64_t deadline = timeout_ns == WAIT_FOREVER ? WAIT_FOREVER : ktime_ns() + timeout_ns;
+
+    if (!sched_can_block()) {
+        for (;;) {
+            uint64_t flags = irq_save();
+            bool done = cond(ctx);
+            irq_restore(flags);
+            if (done) {
+                return true;
+            }
+            if (ktime_ns() >= deadline) {
+                return false;
+            }
+            asm volatile("pause");
+        }
+    }
+
+    struct thread *self = thread_current();
+    struct wait_entry entry = { .thread = self, .queued = false };
+    struct timer timer;
+    timer_init(&timer, wait_timeout, self);
+    if (deadline != WAIT_FOREVER) {
+        timer_add(&timer, deadline);
+    }
+
+    // queued before cond is checked, so a wake_up() after the check finds
+    // us; one that lands before sched_block() makes it return at once
+    uint64_t flags = irq_save();
+    bool done;
+    for (;;) {
+        spin_lock(&wq->lock);
+        if (!entry.queued) {
+            wait_enqueue(wq, &entry);
+        }
+        spin_unlock(&wq->lock);
+
+        done = cond(ctx);
+        if (done || ktime_ns() >= deadline) {
+            break;
+        }
+        sched_block();
+    }
+
+    spin_lock(&wq->lock);
+    if (entry.queued) {
+        wait_dequeue(wq, &entry);
+    }
+    spin_unlock(&wq->lock);
+    irq_restore(flags);
+
+    if (deadline != WAIT_FOREVER) {
+        timer_cancel(&timer);
+    }
+    return done;
+}
+
+uint32_t wake_up(struct wait_queue *wq, uint32_t count) {
+    uint32_t woken = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    while (wq->head && woken < count) {
+        struct wait_entry *entry = wq->head;
+        wait_dequeue(wq, entry);
+        sched_wake(entry->thread);
+        woken++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+struct futex_ctx {
+    volatile uint32_t *word;
+    uint32_t expected;
+};
+
+static bool futex_changed(void *ctx) {
+    struct futex_ctx *futex = ctx;
+    return __atomic_load_n(futex->word, __ATOMIC_ACQUIRE) != futex->expected;
+}
+
+bool futex_wait(struct wait_queue *wq, volatile uint32_t *word, uint32_t expected, uint64_t timeout_ns) {
+    struct futex_ctx futex = { word, expected };
+    return wait_until(wq, futex_changed, &futex, timeout_ns);
+}
+
+void futex_wake(struct wait_queue *wq, uint32_t count) {
+    wake_up(wq, count);
+}
+
+void mutex_init(struct mutex *mutex, const char *name) {
+    mutex->state = 0;
+    wait_queue_init(&mutex->wait, name);
+}
+
+void mutex_lock(struct mutex *mutex) {
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // once anyone has slept the state stays at 2 until the lock is free,
+    // so the holder knows to wake someone on unlock
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(&mutex->wait, &mutex->state, 2, WAIT_FOREVER);
+    }
+}
+
+bool mutex_trylock(struct mutex *mutex) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&mutex->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void mutex_unlock(struct mutex *mutex) {
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(&mutex->wait, 1);
+    }
+}